@@ -0,0 +1,79 @@
+/*
+ * A peer for the cross-language binding benchmark (see bench/harness.py) that
+ * uses libtransact directly.
+ *
+ * Usage: peer <parent|child> <transact file> <shm file> <turns> <size>
+ */
+
+#include <libtransact.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SHM_SIZE (1 << 24)
+#define WARMUP 1000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 6) {
+    fprintf(stderr, "%s <parent|child> <transact file> <shm file> <turns> <size>\n",
+            argv[0]);
+    return 1;
+  }
+  int parent = strcmp(argv[1], "parent") == 0;
+  long turns = atol(argv[4]);
+  size_t size = atol(argv[5]);
+  char* payload = calloc(size ? size : 1, 1);
+
+  struct transact_interface* interface =
+      transact_interface_open(parent, argv[2], argv[3], SHM_SIZE);
+  if (!interface) {
+    perror("transact_interface_open");
+    return 1;
+  }
+  struct transact_message message;
+  transact_message_init(interface, &message);
+
+  double start = 0;
+  for (long i = 0; i < turns + WARMUP; i++) {
+    if (i == WARMUP)
+      start = now();
+    if (!parent) {
+      if (transact_message_recv(&message) == -1) {
+        perror("transact_message_recv");
+        return 1;
+      }
+      transact_message_read(&message, payload, size);
+    }
+    if (transact_message_allocate(&message, 1, size) == -1) {
+      perror("transact_message_allocate");
+      return 1;
+    }
+    transact_message_write(&message, payload, size);
+    if (transact_message_send(&message) != 1)
+      break;
+    if (parent) {
+      if (transact_message_recv(&message) == -1) {
+        perror("transact_message_recv");
+        return 1;
+      }
+      transact_message_read(&message, payload, size);
+    }
+  }
+  double elapsed = now() - start;
+
+  if (parent) {
+    printf("turns=%ld size=%zu ns_per_turn=%.1f bytes_per_sec=%.0f\n", turns,
+           size, elapsed * 1e9 / turns, 2.0 * size * turns / elapsed);
+  }
+  transact_interface_close(interface);
+  free(payload);
+  return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Measures how transact scales with the number of concurrent pairs on a host.
+ *
+ * For every pair count N in 1, 2, 4, ... up to <max pairs>, it forks N parent
+ * and N child processes. All of them open their interfaces at the same time
+ * (an open/handshake storm), and then every pair performs <turns> ping-pong
+ * turns of <size> bytes. It reports the aggregate turns per second across all
+ * pairs, the median and worst per-pair p99 turn latency, and the p99 and worst
+ * latency of the parents' transact_interface_open().
+ *
+ * Each pair needs its own transact file, so <transact dir> must contain files
+ * named 0, 1, ..., <max pairs> - 1, all created with mktransact.
+ *
+ * Usage: scale <transact dir> <max pairs> [turns] [size]
+ */
+
+#include <libtransact.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_SIZE (1 << 20)
+#define WARMUP 1000
+
+struct pair_result {
+  long open_ns;
+  long p99_ns;
+  long first_ns;
+  long last_ns;
+};
+
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_long(const void* a, const void* b) {
+  long x = *(const long*)a, y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+static long percentile(long* values, int count, int pct) {
+  qsort(values, count, sizeof(long), compare_long);
+  int index = (int)((long)count * pct / 100);
+  return values[index < count ? index : count - 1];
+}
+
+/* The shared memory file of |pair|, created by the process |coordinator|. */
+static void shm_path(char* path, size_t len, pid_t coordinator, int pair) {
+  snprintf(path, len, "/dev/shm/transact_scale_%d_%d", (int)coordinator, pair);
+}
+
+static void remove_shm_files(int pairs) {
+  char path[64];
+  for (int i = 0; i < pairs; i++) {
+    shm_path(path, sizeof(path), getpid(), i);
+    unlink(path);
+  }
+}
+
+/*
+ * Creates the shared memory files of |pairs| pairs, since the peers only open
+ * existing ones. Returns -1 on failure, after removing the ones it created.
+ */
+static int create_shm_files(int pairs) {
+  char path[64];
+  for (int i = 0; i < pairs; i++) {
+    shm_path(path, sizeof(path), getpid(), i);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, SHM_SIZE) == -1) {
+      perror(path);
+      if (fd != -1)
+        close(fd);
+      remove_shm_files(i + 1);
+      return -1;
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+/* Blocks until the coordinator closes the write end of |start_pipe|. */
+static void wait_for_start(int start_pipe[2]) {
+  char c;
+  close(start_pipe[1]);
+  while (read(start_pipe[0], &c, 1) > 0) {
+  }
+  close(start_pipe[0]);
+}
+
+static int run_peer(int parent,
+                    const char* dir,
+                    int pair,
+                    long turns,
+                    size_t size,
+                    int start_pipe[2],
+                    struct pair_result* result) {
+  char transact_path[4096], shm_file[64];
+  snprintf(transact_path, sizeof(transact_path), "%s/%d", dir, pair);
+  shm_path(shm_file, sizeof(shm_file), getppid(), pair);
+  long* latencies = parent ? malloc(sizeof(long) * turns) : NULL;
+  if (parent && !latencies)
+    return 1;
+
+  wait_for_start(start_pipe);
+  long start = now_ns();
+  struct transact_interface* interface =
+      transact_interface_open(parent, transact_path, shm_file, SHM_SIZE);
+  if (!interface) {
+    perror("transact_interface_open");
+    return 1;
+  }
+  if (parent)
+    result->open_ns = now_ns() - start;
+  struct transact_message message;
+  transact_message_init(interface, &message);
+
+  for (long i = 0; i < turns + WARMUP; i++) {
+    long turn_start = now_ns();
+    if (i == WARMUP && parent)
+      result->first_ns = turn_start;
+    if (!parent && transact_message_recv(&message) == -1) {
+      perror("transact_message_recv");
+      return 1;
+    }
+    if (transact_message_allocate(&message, 1, size) == -1) {
+      perror("transact_message_allocate");
+      return 1;
+    }
+    if (transact_message_send(&message) != 1)
+      break;
+    if (parent) {
+      if (transact_message_recv(&message) == -1) {
+        perror("transact_message_recv");
+        return 1;
+      }
+      if (i >= WARMUP)
+        latencies[i - WARMUP] = now_ns() - turn_start;
+    }
+  }
+
+  if (parent) {
+    result->last_ns = now_ns();
+    result->p99_ns = percentile(latencies, turns, 99);
+  }
+  transact_interface_close(interface);
+  free(latencies);
+  return 0;
+}
+
+static int run_round(const char* dir, int pairs, long turns, size_t size,
+                     struct pair_result* results) {
+  int start_pipe[2];
+  if (create_shm_files(pairs) == -1)
+    return -1;
+  if (pipe(start_pipe) == -1) {
+    perror("pipe");
+    remove_shm_files(pairs);
+    return -1;
+  }
+  memset(results, 0, sizeof(struct pair_result) * pairs);
+  for (int i = 0; i < 2 * pairs; i++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      remove_shm_files(pairs);
+      return -1;
+    }
+    if (pid == 0) {
+      int parent = i < pairs;
+      _exit(run_peer(parent, dir, i % pairs, turns, size, start_pipe,
+                     &results[i % pairs]));
+    }
+  }
+  close(start_pipe[0]);
+  close(start_pipe[1]);
+
+  int failed = 0;
+  int status;
+  while (wait(&status) != -1) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+  }
+  remove_shm_files(pairs);
+  return failed ? -1 : 0;
+}
+
+static void report(int pairs, long turns, struct pair_result* results) {
+  long open_ns[pairs], p99_ns[pairs];
+  long first = results[0].first_ns, last = results[0].last_ns;
+  for (int i = 0; i < pairs; i++) {
+    open_ns[i] = results[i].open_ns;
+    p99_ns[i] = results[i].p99_ns;
+    if (results[i].first_ns < first)
+      first = results[i].first_ns;
+    if (results[i].last_ns > last)
+      last = results[i].last_ns;
+  }
+  double turns_per_sec = (double)pairs * turns * 1e9 / (last - first);
+  long open_p99 = percentile(open_ns, pairs, 99);
+  long open_max = open_ns[pairs - 1];
+  long p99_median = percentile(p99_ns, pairs, 50);
+  long p99_max = p99_ns[pairs - 1];
+  printf("%6d %14.0f %12ld %12ld %12ld %12ld\n", pairs, turns_per_sec,
+         p99_median, p99_max, open_p99, open_max);
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "%s <transact dir> <max pairs> [turns] [size]\n", argv[0]);
+    return 1;
+  }
+  const char* dir = argv[1];
+  int max_pairs = atoi(argv[2]);
+  long turns = argc > 3 ? atol(argv[3]) : 100000;
+  size_t size = argc > 4 ? atol(argv[4]) : 64;
+  if (max_pairs < 1 || turns < 1) {
+    fprintf(stderr, "invalid arguments\n");
+    return 1;
+  }
+
+  struct pair_result* results =
+      mmap(NULL, sizeof(struct pair_result) * max_pairs,
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  printf("%6s %14s %12s %12s %12s %12s\n", "pairs", "turns/s", "p99 ns",
+         "max p99 ns", "open p99 ns", "open max ns");
+  for (int pairs = 1;; pairs *= 2) {
+    if (pairs > max_pairs)
+      pairs = max_pairs;
+    if (run_round(dir, pairs, turns, size, results) == -1) {
+      fprintf(stderr, "round with %d pairs failed\n", pairs);
+      return 1;
+    }
+    report(pairs, turns, results);
+    if (pairs == max_pairs)
+      break;
+  }
+  return 0;
+}
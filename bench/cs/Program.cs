@@ -0,0 +1,146 @@
+using Omegaup.Transact;
+using System.Diagnostics;
+using System.Globalization;
+using System.Runtime.InteropServices;
+using System;
+
+namespace Omegaup.Transact.Bench
+{
+	// A tight ping-pong loop that measures the per-turn cost of the C# binding.
+	// Each turn the parent sends |size| bytes and the child echoes them back.
+	// This is also the C# peer for the cross-language harness in
+	// bench/harness.py.
+	//
+	// Passing "legacy" as the last argument uses the previous P/Invoke
+	// strategy (managed State pinned with fixed on every call, SetLastError
+	// marshaling) so both can be compared on the same machine.
+	public static class Program
+	{
+		internal unsafe static class Legacy {
+			[StructLayout (LayoutKind.Sequential)]
+			internal struct State {
+				public IntPtr interfacePtr;
+				IntPtr messagePtr;
+				public int methodId;
+				int padding;
+
+				public byte* shmPtr;
+				public byte* end;
+			}
+
+			[DllImport("libtransact.so", EntryPoint = "transact_interface_open", SetLastError = true)]
+			public static extern IntPtr InterfaceOpen(int is_parent, string
+					transact_filename, string shm_filename, ulong shm_len);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_init", SetLastError = true)]
+			public static extern int MessageInit(IntPtr interface_ptr,
+					State* message_ptr);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_allocate", SetLastError = true)]
+			public static extern int Allocate(State* message_ptr, int msgid,
+					ulong bytes);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_recv", SetLastError = true)]
+			public static extern int Receive(State* message_ptr);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_send", SetLastError = true)]
+			public static extern int Send(State* message_ptr);
+
+			public static long Run(bool parent, string transactName,
+					string shmName, long turns, byte[] payload) {
+				IntPtr interfacePtr = InterfaceOpen(parent ? 1 : 0, transactName,
+						shmName, ShmSize);
+				if (interfacePtr == IntPtr.Zero) {
+					Marshal.ThrowExceptionForHR(Marshal.GetHRForLastWin32Error());
+				}
+				State state = new State();
+				fixed (State* statePtr = &state) {
+					MessageInit(interfacePtr, statePtr);
+				}
+				Stopwatch stopwatch = new Stopwatch();
+				fixed (byte* payloadPtr = payload) {
+					for (long i = 0; i < turns + Warmup; i++) {
+						if (i == Warmup) {
+							stopwatch.Start();
+						}
+						if (!parent) {
+							fixed (State* statePtr = &state) {
+								Receive(statePtr);
+							}
+							Buffer.MemoryCopy(state.shmPtr, payloadPtr, payload.Length,
+									payload.Length);
+						}
+						fixed (State* statePtr = &state) {
+							Allocate(statePtr, 1, (ulong)payload.Length);
+						}
+						Buffer.MemoryCopy(payloadPtr, state.shmPtr, payload.Length,
+								payload.Length);
+						fixed (State* statePtr = &state) {
+							if (Send(statePtr) != 1) {
+								break;
+							}
+						}
+						if (parent) {
+							fixed (State* statePtr = &state) {
+								Receive(statePtr);
+							}
+							Buffer.MemoryCopy(state.shmPtr, payloadPtr, payload.Length,
+									payload.Length);
+						}
+					}
+				}
+				return stopwatch.ElapsedTicks;
+			}
+		}
+
+		private const ulong ShmSize = 1 << 24;
+		private const int Warmup = 1000;
+
+		private static long Run(bool parent, string transactName,
+				string shmName, long turns, byte[] payload) {
+			Interface iface = new Interface(parent, "bench", transactName,
+					shmName, ShmSize);
+			Message message = iface.BuildMessage();
+			Stopwatch stopwatch = new Stopwatch();
+			for (long i = 0; i < turns + Warmup; i++) {
+				if (i == Warmup) {
+					stopwatch.Start();
+				}
+				if (!parent) {
+					message.Receive();
+					message.Read(new Span<byte>(payload));
+				}
+				message.Allocate(1, (ulong)payload.Length);
+				message.Write(payload);
+				if (message.Send() != 1) {
+					break;
+				}
+				if (parent) {
+					message.Receive();
+					message.Read(new Span<byte>(payload));
+				}
+			}
+			return stopwatch.ElapsedTicks;
+		}
+
+		public static int Main(string[] args) {
+			if (args.Length < 5) {
+				Console.Error.WriteLine("Usage: PingPong <parent|child> " +
+						"<transact file> <shm file> <turns> <size> [legacy]");
+				return 1;
+			}
+			bool parent = args[0] == "parent";
+			long turns = long.Parse(args[3]);
+			byte[] payload = new byte[int.Parse(args[4])];
+			bool legacy = args.Length > 5 && args[5] == "legacy";
+
+			long ticks = legacy ?
+					Legacy.Run(parent, args[1], args[2], turns, payload) :
+					Run(parent, args[1], args[2], turns, payload);
+			if (parent) {
+				double seconds = (double)ticks / Stopwatch.Frequency;
+				Console.WriteLine(String.Format(CultureInfo.InvariantCulture,
+						"turns={0} size={1} ns_per_turn={2:F1} bytes_per_sec={3:F0}",
+						turns, payload.Length, seconds * 1e9 / turns,
+						2.0 * payload.Length * turns / seconds));
+			}
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+"""Measures the overhead of each language binding.
+
+Runs the same scripted exchange (a fixed number of turns, each one sending a
+|size|-byte message and getting a |size|-byte reply) for every parent/child
+combination of language bindings, and reports the per-turn latency and the
+throughput as seen by the parent.
+
+The transact file must have been created beforehand with mktransact. Every
+peer is expected to be already built (run `make` in this directory).
+"""
+
+import argparse
+import itertools
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+PEERS = {
+    'c': [os.path.join(BENCH_DIR, 'c', 'peer')],
+    'python': ['python2', os.path.join(BENCH_DIR, 'python', 'peer.py')],
+    'java': [
+        'java',
+        '-cp',
+        '%s:%s' % (os.path.join(ROOT_DIR, 'java', 'bin', 'libtransact.jar'),
+                   os.path.join(BENCH_DIR, 'java', 'classes')),
+        '-Djava.library.path=%s' % os.path.join(ROOT_DIR, 'java', 'bin'),
+        'Peer',
+    ],
+    'cs': [
+        os.path.join(BENCH_DIR, 'cs', 'bin', 'Release', 'net6.0', 'linux-x64',
+                     'PingPong')
+    ],
+}
+
+RESULT_RE = re.compile(r'turns=(\d+) size=(\d+) ns_per_turn=([\d.]+) '
+                       r'bytes_per_sec=([\d.]+)')
+
+
+def run_pair(transact, parent, child, turns, size):
+    """Runs one exchange and returns (ns_per_turn, bytes_per_sec)."""
+    with tempfile.NamedTemporaryFile(prefix='transact_shm_') as shm:
+        args = [transact, shm.name, str(turns), str(size)]
+        child_proc = subprocess.Popen(PEERS[child] + ['child'] + args)
+        try:
+            output = subprocess.check_output(PEERS[parent] + ['parent'] + args,
+                                             universal_newlines=True)
+        finally:
+            child_proc.wait()
+    match = RESULT_RE.search(output)
+    if not match:
+        raise RuntimeError('unexpected output from %s: %r' % (parent, output))
+    return float(match.group(3)), float(match.group(4))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('transact', help='transact file created by mktransact')
+    parser.add_argument('--turns', type=int, default=100000)
+    parser.add_argument('--sizes', default='4,64,4096,65536',
+                        help='comma-separated message sizes, in bytes')
+    parser.add_argument('--langs', default=','.join(sorted(PEERS)),
+                        help='comma-separated bindings to test')
+    args = parser.parse_args()
+
+    langs = args.langs.split(',')
+    sizes = [int(size) for size in args.sizes.split(',')]
+
+    print('%-8s %-8s %8s %12s %12s' % ('parent', 'child', 'size',
+                                        'ns/turn', 'MB/s'))
+    for parent, child in itertools.product(langs, repeat=2):
+        for size in sizes:
+            try:
+                ns_per_turn, bytes_per_sec = run_pair(args.transact, parent,
+                                                      child, args.turns, size)
+            except (OSError, RuntimeError, subprocess.CalledProcessError) as e:
+                print('%-8s %-8s %8d failed: %s' % (parent, child, size, e))
+                continue
+            print('%-8s %-8s %8d %12.1f %12.1f' %
+                  (parent, child, size, ns_per_turn, bytes_per_sec / 1e6))
+            sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()
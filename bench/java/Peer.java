@@ -0,0 +1,57 @@
+// Copyright (c) 2014 The omegaUp Contributors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+import com.omegaup.transact.Interface;
+import com.omegaup.transact.Message;
+
+// A peer for the cross-language binding benchmark that uses the Java binding.
+//
+// Usage: Peer <parent|child> <transact file> <shm file> <turns> <size>
+public class Peer {
+	private static final long SHM_SIZE = 1 << 24;
+	private static final int WARMUP = 1000;
+
+	public static void main(String[] args) throws Exception {
+		if (args.length < 5) {
+			System.err.println("Peer <parent|child> <transact file> " +
+					"<shm file> <turns> <size>");
+			System.exit(1);
+		}
+		boolean parent = args[0].equals("parent");
+		long turns = Long.parseLong(args[3]);
+		int size = Integer.parseInt(args[4]);
+		byte[] payload = new byte[size];
+
+		try (Interface iface = new Interface(parent, "bench", args[1], args[2],
+					SHM_SIZE)) {
+			Message message = iface.buildMessage();
+			long start = 0;
+			for (long i = 0; i < turns + WARMUP; i++) {
+				if (i == WARMUP) {
+					start = System.nanoTime();
+				}
+				if (!parent) {
+					message.receive();
+					message.readByteArray(payload);
+				}
+				message.allocate(1, size);
+				message.writeByteArray(payload);
+				if (message.send() != 1) {
+					break;
+				}
+				if (parent) {
+					message.receive();
+					message.readByteArray(payload);
+				}
+			}
+			double elapsed = (System.nanoTime() - start) * 1e-9;
+
+			if (parent) {
+				System.out.printf("turns=%d size=%d ns_per_turn=%.1f " +
+						"bytes_per_sec=%.0f%n", turns, size, elapsed * 1e9 / turns,
+						2.0 * size * turns / elapsed);
+			}
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+"""A peer for the cross-language binding benchmark that uses the transact
+Python module.
+
+Usage: peer.py <parent|child> <transact file> <shm file> <turns> <size>
+"""
+
+import sys
+import time
+
+import transact
+
+SHM_SIZE = 1 << 24
+WARMUP = 1000
+
+
+def main():
+	if len(sys.argv) < 6:
+		print >> sys.stderr, ('%s <parent|child> <transact file> <shm file> '
+				'<turns> <size>' % sys.argv[0])
+		sys.exit(1)
+	parent = sys.argv[1] == 'parent'
+	turns = int(sys.argv[4])
+	size = int(sys.argv[5])
+	payload = '\0' * size
+
+	interface = transact.Interface(parent, 'bench', sys.argv[2], sys.argv[3],
+			SHM_SIZE)
+	message = transact.Message()
+	if not parent:
+		interface.get(message)
+
+	start = 0
+	for i in xrange(turns + WARMUP):
+		if i == WARMUP:
+			start = time.time()
+		if not parent:
+			message.read(size)
+		interface.allocate(message, 1, size)
+		message.write(payload)
+		# The child exits quietly once the parent is gone.
+		interface.call(message, not parent, False)
+		if parent:
+			message.read(size)
+	elapsed = time.time() - start
+
+	if parent:
+		print 'turns=%d size=%d ns_per_turn=%.1f bytes_per_sec=%.0f' % (
+				turns, size, elapsed * 1e9 / turns, 2.0 * size * turns / elapsed)
+
+
+if __name__ == '__main__':
+	main()
@@ -1,39 +1,95 @@
-﻿using System.IO;
+﻿using Microsoft.Win32.SafeHandles;
+using System.IO;
 using System.Runtime.InteropServices;
+using System.Security;
 using System;
 
 namespace Omegaup.Transact
 {
-	public class Interface
+	public class Interface : IDisposable
 	{
-		internal unsafe class Transact {
+		[SuppressUnmanagedCodeSecurity]
+		internal static unsafe class Transact {
 			[DllImport("libtransact.so", EntryPoint = "transact_interface_open", SetLastError = true)]
-			public static extern IntPtr InterfaceOpen(int is_parent, string
+			public static extern InterfaceHandle InterfaceOpen(int is_parent, string
 					transact_filename, string shm_filename, ulong shm_len);
-			[DllImport("libtransact.so", EntryPoint = "transact_interface_close", SetLastError = true)]
-			public static extern int InterfaceClose(IntPtr interface_ptr);
+			[DllImport("libtransact.so", EntryPoint = "transact_interface_close", ExactSpelling = true)]
+			public static extern void InterfaceClose(IntPtr interface_ptr);
+
+			[DllImport("libtransact.so", EntryPoint = "transact_message_new", ExactSpelling = true)]
+			public static extern Message.StateHandle MessageNew();
+			[DllImport("libtransact.so", EntryPoint = "transact_message_free", ExactSpelling = true)]
+			public static extern void MessageFree(IntPtr message_ptr);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_init", ExactSpelling = true, SetLastError = true)]
+			public static extern int MessageInit(IntPtr interface_ptr,
+					Message.State* message_ptr);
+
+			[DllImport("libtransact.so", EntryPoint = "transact_message_allocate", ExactSpelling = true, SetLastError = true)]
+			public static extern int Allocate(Message.State* message_ptr, int msgid,
+					ulong bytes);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_recv", ExactSpelling = true, SetLastError = true)]
+			public static extern int Receive(Message.State* message_ptr);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_send", ExactSpelling = true, SetLastError = true)]
+			public static extern int Send(Message.State* message_ptr);
+
+			[DllImport("libtransact.so", EntryPoint = "transact_message_read_int32_array", ExactSpelling = true, SetLastError = true)]
+			public static extern IntPtr ReadInt32Array(Message.State* message_ptr,
+					int* target, UIntPtr count, int min_value, int max_value,
+					UIntPtr* bad_index);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_view_int32_array", ExactSpelling = true, SetLastError = true)]
+			public static extern IntPtr ViewInt32Array(Message.State* message_ptr,
+					int** target, UIntPtr count, int min_value, int max_value,
+					UIntPtr* bad_index);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_read_int64_array", ExactSpelling = true, SetLastError = true)]
+			public static extern IntPtr ReadInt64Array(Message.State* message_ptr,
+					long* target, UIntPtr count, long min_value, long max_value,
+					UIntPtr* bad_index);
+			[DllImport("libtransact.so", EntryPoint = "transact_message_view_int64_array", ExactSpelling = true, SetLastError = true)]
+			public static extern IntPtr ViewInt64Array(Message.State* message_ptr,
+					long** target, UIntPtr count, long min_value, long max_value,
+					UIntPtr* bad_index);
+
+			// The imports that can fail use SetLastError, so that errno is saved
+			// as soon as the call returns: the runtime is free to change it
+			// afterwards, on a GC transition or while releasing a SafeHandle. It
+			// is only ever read back once a call has failed.
+			public static void ThrowLastError() {
+				int errno = Marshal.GetLastWin32Error();
+				Marshal.ThrowExceptionForHR(unchecked((int)0x80070000) | (errno & 0xFFFF));
+			}
+		}
+
+		internal sealed class InterfaceHandle : SafeHandleZeroOrMinusOneIsInvalid {
+			private InterfaceHandle() : base(true) {}
+
+			protected override bool ReleaseHandle() {
+				Transact.InterfaceClose(handle);
+				return true;
+			}
 		}
 
-		private IntPtr interfacePtr;
+		private readonly InterfaceHandle interfaceHandle;
 
 		public Interface(bool parent, string name, string transactName,
 				string shmName, ulong size) {
-			interfacePtr = Transact.InterfaceOpen(parent ? 1 : 0,
+			interfaceHandle = Transact.InterfaceOpen(parent ? 1 : 0,
 					transactName, shmName, size);
-			if (interfacePtr == IntPtr.Zero) {
+			if (interfaceHandle.IsInvalid) {
 				throw new IOException("Unable to initialize " + name,
 						Marshal.GetExceptionForHR(Marshal.GetHRForLastWin32Error()));
 			}
 		}
 
-		~Interface() {
-			if (interfacePtr != IntPtr.Zero) {
-				Transact.InterfaceClose(interfacePtr);
-			}
+		internal IntPtr interfacePtr {
+			get { return interfaceHandle.DangerousGetHandle(); }
+		}
+
+		public void Dispose() {
+			interfaceHandle.Dispose();
 		}
 
 		public Message BuildMessage() {
-			return new Message(interfacePtr);
+			return new Message(this);
 		}
 	}
 }
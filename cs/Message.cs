@@ -1,9 +1,10 @@
-﻿using System.Runtime.InteropServices;
+﻿using Microsoft.Win32.SafeHandles;
+using System.Runtime.InteropServices;
 using System;
 
 namespace Omegaup.Transact
 {
-	public class Message
+	public class Message : IDisposable
 	{
 		[StructLayout (LayoutKind.Sequential)]
 		internal unsafe struct State {
@@ -14,59 +15,72 @@ namespace Omegaup.Transact
 
 			public byte* shmPtr;
 			public byte* end;
+		}
 
-			[DllImport("libtransact.so", EntryPoint = "transact_message_init", SetLastError = true)]
-			public static extern int MessageInit(IntPtr interface_ptr,
-					Message.State* message_ptr);
+		internal sealed class StateHandle : SafeHandleZeroOrMinusOneIsInvalid {
+			private StateHandle() : base(true) {}
 
-			[DllImport("libtransact.so", EntryPoint = "transact_message_allocate", SetLastError = true)]
-			public static extern int Allocate(State* message_ptr, int msgid,
-					ulong bytes);
-			[DllImport("libtransact.so", EntryPoint = "transact_message_recv", SetLastError = true)]
-			public static extern int Receive(State* message_ptr);
-			[DllImport("libtransact.so", EntryPoint = "transact_message_send", SetLastError = true)]
-			public static extern int Send(State* message_ptr);
+			protected override bool ReleaseHandle() {
+				Interface.Transact.MessageFree(handle);
+				return true;
+			}
 		}
 
-		internal State state;
+		// Keeps the interface (and therefore the shm mapping) alive for as long
+		// as any of its messages are.
+		private readonly Interface iface;
+		private readonly StateHandle stateHandle;
+		// The state lives in the native heap, so it never moves and can be
+		// passed to libtransact without pinning. Nothing keeps |stateHandle|
+		// from being finalized while a raw pointer to it is in use, though, so
+		// every call that gets one is followed by GC.KeepAlive(this).
+		private readonly unsafe State* state;
 
-		internal unsafe Message(IntPtr interfacePtr) {
-			state = new State();
-			fixed (State *statePtr = &state) {
-				if (State.MessageInit(interfacePtr, statePtr) != 0) {
-					Marshal.ThrowExceptionForHR(Marshal.GetHRForLastWin32Error());
-				}
+		internal unsafe Message(Interface iface) {
+			this.iface = iface;
+			stateHandle = Interface.Transact.MessageNew();
+			if (stateHandle.IsInvalid) {
+				throw new OutOfMemoryException();
 			}
+			state = (State*)stateHandle.DangerousGetHandle();
+			int res = Interface.Transact.MessageInit(iface.interfacePtr, state);
+			GC.KeepAlive(this);
+			if (res != 0) {
+				Interface.Transact.ThrowLastError();
+			}
+		}
+
+		public void Dispose() {
+			stateHandle.Dispose();
 		}
 
-		public int methodId {
-			get { return state.methodId; }
+		public unsafe int methodId {
+			get { return state->methodId; }
 		}
 
 		public unsafe void Allocate(int msgid, ulong bytes) {
-			fixed (State *statePtr = &state) {
-				if (State.Allocate(statePtr, msgid, bytes) != 0) {
-					Marshal.ThrowExceptionForHR(Marshal.GetHRForLastWin32Error());
-				}
-			}	
+			int res = Interface.Transact.Allocate(state, msgid, bytes);
+			GC.KeepAlive(this);
+			if (res != 0) {
+				Interface.Transact.ThrowLastError();
+			}
 		}
 
 		public unsafe void Receive() {
-			fixed (State *statePtr = &state) {
-				if (State.Receive(statePtr) != 0) {
-					Marshal.ThrowExceptionForHR(Marshal.GetHRForLastWin32Error());
-				}
+			int res = Interface.Transact.Receive(state);
+			GC.KeepAlive(this);
+			if (res != 0) {
+				Interface.Transact.ThrowLastError();
 			}
 		}
 
 		public unsafe int Send() {
-			fixed (State *statePtr = &state) {
-				int retval = State.Send(statePtr);
-				if (retval == -1) {
-					Marshal.ThrowExceptionForHR(Marshal.GetHRForLastWin32Error());
-				}
-				return retval;
+			int retval = Interface.Transact.Send(state);
+			GC.KeepAlive(this);
+			if (retval == -1) {
+				Interface.Transact.ThrowLastError();
 			}
+			return retval;
 		}
 
 		public void Write(int x, int minValue, int maxValue) {
@@ -79,23 +93,23 @@ namespace Omegaup.Transact
 		}
 
 		public unsafe void Write(byte x) {
-			*((byte*)state.shmPtr) = x;
-			state.shmPtr += sizeof(byte);
+			*((byte*)state->shmPtr) = x;
+			state->shmPtr += sizeof(byte);
 		}
 
 		public unsafe void Write(short x) {
-			*((short*)state.shmPtr) = x;
-			state.shmPtr += sizeof(short);
+			*((short*)state->shmPtr) = x;
+			state->shmPtr += sizeof(short);
 		}
 
 		public unsafe void Write(int x) {
-			*((int*)state.shmPtr) = x;
-			state.shmPtr += sizeof(int);
+			*((int*)state->shmPtr) = x;
+			state->shmPtr += sizeof(int);
 		}
 
 		public unsafe void Write(long x) {
-			*((long*)state.shmPtr) = x;
-			state.shmPtr += sizeof(long);
+			*((long*)state->shmPtr) = x;
+			state->shmPtr += sizeof(long);
 		}
 
 		public void Write(char x) {
@@ -106,12 +120,24 @@ namespace Omegaup.Transact
 			Write((byte)(x ? 1 : 0));
 		}
 
-		public void Write(double x) {
-			Write(BitConverter.DoubleToInt64Bits(x));
+		public unsafe void Write(double x) {
+			*((double*)state->shmPtr) = x;
+			state->shmPtr += sizeof(double);
+		}
+
+		public unsafe void Write(float x) {
+			*((float*)state->shmPtr) = x;
+			state->shmPtr += sizeof(float);
 		}
 
-		public void Write(float x) {
-			Write(BitConverter.ToInt32(BitConverter.GetBytes(x), 0));
+		// Copies all of |values| into the message with a single bounds check.
+		public void Write<T>(ReadOnlySpan<T> values) where T : unmanaged {
+			ReadOnlySpan<byte> bytes = MemoryMarshal.AsBytes(values);
+			bytes.CopyTo(Reserve(bytes.Length));
+		}
+
+		public void Write<T>(T[] values) where T : unmanaged {
+			Write(new ReadOnlySpan<T>(values));
 		}
 
 		public int ReadInt32(int minValue, int maxValue) {
@@ -125,26 +151,26 @@ namespace Omegaup.Transact
 		}
 
 		public unsafe byte ReadByte() {
-			byte x = *((byte*)state.shmPtr);
-			state.shmPtr += sizeof(byte);
+			byte x = *((byte*)state->shmPtr);
+			state->shmPtr += sizeof(byte);
 			return x;
 		}
 
 		public unsafe short ReadShort() {
-			short x = *((short*)state.shmPtr);
-			state.shmPtr += sizeof(short);
+			short x = *((short*)state->shmPtr);
+			state->shmPtr += sizeof(short);
 			return x;
 		}
 
 		public unsafe int ReadInt32() {
-			int x = *((int*)state.shmPtr);
-			state.shmPtr += sizeof(int);
+			int x = *((int*)state->shmPtr);
+			state->shmPtr += sizeof(int);
 			return x;
 		}
 
 		public unsafe long ReadInt64() {
-			long x = *((long*)state.shmPtr);
-			state.shmPtr += sizeof(long);
+			long x = *((long*)state->shmPtr);
+			state->shmPtr += sizeof(long);
 			return x;
 		}
 
@@ -152,16 +178,139 @@ namespace Omegaup.Transact
 			return (char)ReadByte();
 		}
 
-		public double ReadDouble() {
-			return BitConverter.Int64BitsToDouble(ReadInt64());
+		public unsafe double ReadDouble() {
+			double x = *((double*)state->shmPtr);
+			state->shmPtr += sizeof(double);
+			return x;
 		}
 
-		public float ReadSingle() {
-			return BitConverter.ToSingle(BitConverter.GetBytes(ReadInt32()), 0);
+		public unsafe float ReadSingle() {
+			float x = *((float*)state->shmPtr);
+			state->shmPtr += sizeof(float);
+			return x;
 		}
 
 		public bool ReadBool() {
 			return ReadByte() != 0;
 		}
+
+		// Fills |destination| from the message with a single bounds check.
+		public void Read<T>(Span<T> destination) where T : unmanaged {
+			Span<byte> bytes = MemoryMarshal.AsBytes(destination);
+			Reserve(bytes.Length).CopyTo(bytes);
+		}
+
+		// Returns a view of the next |length| elements of the message without
+		// copying them. The view is only valid until the next call to Send().
+		public unsafe ReadOnlySpan<T> ReadSpan<T>(int length) where T : unmanaged {
+			if (length < 0) {
+				throw new ArgumentOutOfRangeException(nameof(length));
+			}
+			byte* ptr = state->shmPtr;
+			Reserve(checked(length * sizeof(T)));
+			return new ReadOnlySpan<T>(ptr, length);
+		}
+
+		// The range-checked reads validate every element against [|minValue|,
+		// |maxValue|] in native code, in the same pass that copies them, and
+		// throw ArgumentOutOfRangeException naming the first offending index.
+		// The elements are consumed from the message either way.
+
+		public unsafe void Read(Span<int> destination, int minValue,
+				int maxValue) {
+			// An empty span has no address to hand over.
+			if (destination.Length == 0) {
+				return;
+			}
+			UIntPtr badIndex;
+			IntPtr res;
+			fixed (int* ptr = destination) {
+				res = Interface.Transact.ReadInt32Array(state, ptr,
+						(UIntPtr)destination.Length, minValue, maxValue, &badIndex);
+			}
+			GC.KeepAlive(this);
+			CheckArrayRead(res, nameof(destination), destination.Length,
+					badIndex, minValue, maxValue);
+		}
+
+		public unsafe void Read(Span<long> destination, long minValue,
+				long maxValue) {
+			// An empty span has no address to hand over.
+			if (destination.Length == 0) {
+				return;
+			}
+			UIntPtr badIndex;
+			IntPtr res;
+			fixed (long* ptr = destination) {
+				res = Interface.Transact.ReadInt64Array(state, ptr,
+						(UIntPtr)destination.Length, minValue, maxValue, &badIndex);
+			}
+			GC.KeepAlive(this);
+			CheckArrayRead(res, nameof(destination), destination.Length,
+					badIndex, minValue, maxValue);
+		}
+
+		public unsafe ReadOnlySpan<int> ReadSpan(int length, int minValue,
+				int maxValue) {
+			if (length < 0) {
+				throw new ArgumentOutOfRangeException(nameof(length));
+			}
+			int* ptr;
+			UIntPtr badIndex;
+			IntPtr res = Interface.Transact.ViewInt32Array(state, &ptr,
+					(UIntPtr)length, minValue, maxValue, &badIndex);
+			GC.KeepAlive(this);
+			CheckArrayRead(res, nameof(length), length, badIndex, minValue,
+					maxValue);
+			return new ReadOnlySpan<int>(ptr, length);
+		}
+
+		public unsafe ReadOnlySpan<long> ReadSpan(int length, long minValue,
+				long maxValue) {
+			if (length < 0) {
+				throw new ArgumentOutOfRangeException(nameof(length));
+			}
+			long* ptr;
+			UIntPtr badIndex;
+			IntPtr res = Interface.Transact.ViewInt64Array(state, &ptr,
+					(UIntPtr)length, minValue, maxValue, &badIndex);
+			GC.KeepAlive(this);
+			CheckArrayRead(res, nameof(length), length, badIndex, minValue,
+					maxValue);
+			return new ReadOnlySpan<long>(ptr, length);
+		}
+
+		// The errno of range-checked reads that found an element out of range.
+		private const int ERANGE = 34;
+
+		// Throws if the read of |length| elements failed, naming |paramName|,
+		// the argument that asked for them.
+		private static void CheckArrayRead(IntPtr res, string paramName,
+				int length, UIntPtr badIndex, long minValue, long maxValue) {
+			if (res == (IntPtr)(-1)) {
+				if (Marshal.GetLastWin32Error() != ERANGE) {
+					Interface.Transact.ThrowLastError();
+				}
+				throw new ArgumentOutOfRangeException(paramName,
+						"Value at index " + badIndex + " outside of legal range: [" +
+						minValue + ", " + maxValue + "]");
+			}
+			if (res == IntPtr.Zero && length != 0) {
+				throw new ArgumentOutOfRangeException(paramName,
+						"Message is too short for " + length + " elements");
+			}
+		}
+
+		// Returns the next |bytes| bytes of the message and advances past them.
+		private unsafe Span<byte> Reserve(int bytes) {
+			if (bytes > state->end - state->shmPtr) {
+				throw new ArgumentOutOfRangeException(nameof(bytes),
+						"Message has only " + (state->end - state->shmPtr) +
+						" bytes left, " + bytes + " needed");
+			}
+			Span<byte> span = new Span<byte>(state->shmPtr, bytes);
+			state->shmPtr += bytes;
+			return span;
+		}
 	}
 }
@@ -0,0 +1,1153 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+"""Generates typed transact stubs from an interface description.
+
+An interface description looks like this:
+
+    // Line comments are allowed anywhere.
+    interface Grader {
+        void init(int n, long seed);
+        long query(int a, int b);
+        int[n] neighbors(int node, int n);
+        double mean(double[count] values, int count);
+    }
+
+Every method becomes a message id (numbered from 1, in declaration order,
+across all the interfaces in the file) and a pair of stubs: one that calls the
+method on the peer and waits for the result, and one that serves calls by
+dispatching on the message id through a jump table.
+
+The supported types are bool, byte, short, int, long, float and double, plus
+arrays of them. The length of an array is either a constant or the name of an
+integer parameter of the same method. Array results take their length from a
+parameter.
+
+Messages are laid out the same way in every language: the scalars first,
+sorted by decreasing size, then the arrays, also sorted by decreasing element
+size, with just enough padding after the scalars for every field to be
+naturally aligned. The size of each message is computed here, so the stubs
+allocate exactly what they need.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+TYPES = {
+    # name: (size, C, Java, C#, struct code)
+    'bool': (1, 'bool', 'boolean', 'bool', '?'),
+    'byte': (1, 'int8_t', 'byte', 'sbyte', 'b'),
+    'short': (2, 'int16_t', 'short', 'short', 'h'),
+    'int': (4, 'int32_t', 'int', 'int', 'i'),
+    'long': (8, 'int64_t', 'long', 'long', 'q'),
+    'float': (4, 'float', 'float', 'float', 'f'),
+    'double': (8, 'double', 'double', 'double', 'd'),
+}
+
+INTEGER_TYPES = ('byte', 'short', 'int', 'long')
+
+# Names used by the generated code itself, which parameters cannot take.
+RESERVED_NAMES = frozenset(('context', 'data', 'dispatch', 'i', 'index',
+                            'interface', 'len', 'list', 'message', 'request',
+                            'res', 'result', 'self', 'server', 'size',
+                            'struct', 'x'))
+
+TOKEN_RE = re.compile(r'(\s+|//[^\n]*)|([A-Za-z_][A-Za-z0-9_]*)|(\d+)|(.)',
+                      re.DOTALL)
+
+
+class IdlError(Exception):
+    pass
+
+
+class Field(object):
+    """A parameter or a result of a method."""
+
+    def __init__(self, name, type_name, length=None):
+        self.name = name
+        self.type = type_name
+        # None for scalars, an int for fixed-size arrays, or the name of the
+        # parameter that holds the length.
+        self.length = length
+        self.offset = None
+
+    @property
+    def size(self):
+        return TYPES[self.type][0]
+
+    @property
+    def is_array(self):
+        return self.length is not None
+
+
+class Layout(object):
+    """The position of every field of a message."""
+
+    def __init__(self, fields):
+        scalars = sorted((f for f in fields if not f.is_array),
+                         key=lambda f: -f.size)
+        self.arrays = sorted((f for f in fields if f.is_array),
+                             key=lambda f: -f.size)
+        offset = 0
+        for field in scalars:
+            field.offset = offset
+            offset += field.size
+        self.scalars = scalars
+        self.padding = 0
+        if self.arrays:
+            self.padding = -offset % self.arrays[0].size
+        offset += self.padding
+        self.header_size = offset
+        # The size of the message is |fixed_size| plus, for each entry of
+        # |dynamic|, the value of the named parameter times the element size.
+        self.dynamic = []
+        for field in self.arrays:
+            if isinstance(field.length, int):
+                offset += field.length * field.size
+            else:
+                self.dynamic.append((field.length, field.size))
+        self.fixed_size = offset
+        self.fields = scalars + self.arrays
+
+    def size_expression(self, fmt, cast=lambda s: s):
+        terms = [str(self.fixed_size)]
+        for name, size in self.dynamic:
+            terms.append('%s * %d' % (cast(fmt(name)), size))
+        if len(terms) > 1 and terms[0] == '0':
+            terms.pop(0)
+        return ' + '.join(terms)
+
+
+class Method(object):
+
+    def __init__(self, name, params, result, msgid):
+        self.name = name
+        self.params = params
+        self.result = result
+        self.msgid = msgid
+        self.request = Layout(params)
+        self.reply = Layout([result] if result else [])
+
+
+class Interface(object):
+
+    def __init__(self, name, methods):
+        self.name = name
+        self.methods = methods
+
+
+def snake_case(name):
+    return re.sub(r'(?<=[a-z0-9])([A-Z])', r'_\1', name).lower()
+
+
+def camel_case(name):
+    parts = name.split('_')
+    return parts[0] + ''.join(p[:1].upper() + p[1:] for p in parts[1:])
+
+
+def pascal_case(name):
+    name = camel_case(name)
+    return name[:1].upper() + name[1:]
+
+
+class Parser(object):
+
+    def __init__(self, filename, text):
+        self.filename = filename
+        self.tokens = []
+        for match in TOKEN_RE.finditer(text):
+            line = text.count('\n', 0, match.start()) + 1
+            _, ident, number, punct = match.groups()
+            if ident is not None:
+                self.tokens.append((line, 'ident', ident))
+            elif number is not None:
+                self.tokens.append((line, 'number', int(number)))
+            elif punct is not None:
+                self.tokens.append((line, 'punct', punct))
+        self.pos = 0
+
+    def error(self, message):
+        line = self.tokens[min(self.pos, len(self.tokens) - 1)][0] \
+            if self.tokens else 1
+        return IdlError('%s:%d: %s' % (self.filename, line, message))
+
+    def peek(self):
+        if self.pos >= len(self.tokens):
+            return (None, None, None)
+        return self.tokens[self.pos]
+
+    def next(self, kind, value=None):
+        _, token_kind, token_value = self.peek()
+        if token_kind != kind or (value is not None and token_value != value):
+            raise self.error('expected %s, got %r' %
+                             (value or kind, token_value))
+        self.pos += 1
+        return token_value
+
+    def parse(self):
+        interfaces = []
+        msgid = 1
+        names = set()
+        while self.peek()[1] is not None:
+            self.next('ident', 'interface')
+            name = self.next('ident')
+            if name in names:
+                raise self.error('duplicate interface %s' % name)
+            names.add(name)
+            self.next('punct', '{')
+            methods = []
+            while self.peek()[2] != '}':
+                methods.append(self.parse_method(msgid))
+                if methods[-1].name in (m.name for m in methods[:-1]):
+                    raise self.error('duplicate method %s' % methods[-1].name)
+                msgid += 1
+            self.next('punct', '}')
+            interfaces.append(Interface(name, methods))
+        return interfaces
+
+    def parse_type(self):
+        type_name = self.next('ident')
+        if type_name not in TYPES:
+            raise self.error('unknown type %s' % type_name)
+        length = None
+        if self.peek()[2] == '[':
+            self.next('punct', '[')
+            if self.peek()[1] == 'number':
+                length = self.next('number')
+            else:
+                length = self.next('ident')
+            self.next('punct', ']')
+        return type_name, length
+
+    def parse_method(self, msgid):
+        if self.peek()[2] == 'void':
+            self.next('ident')
+            result = None
+        else:
+            type_name, length = self.parse_type()
+            result = Field('result', type_name, length)
+        name = self.next('ident')
+        self.next('punct', '(')
+        params = []
+        while self.peek()[2] != ')':
+            if params:
+                self.next('punct', ',')
+            type_name, length = self.parse_type()
+            param = self.next('ident')
+            if param in RESERVED_NAMES or param in (p.name for p in params):
+                raise self.error('invalid parameter name %s' % param)
+            params.append(Field(param, type_name, length))
+        self.next('punct', ')')
+        self.next('punct', ';')
+
+        scalars = dict((p.name, p) for p in params if not p.is_array)
+        for field in params + ([result] if result else []):
+            if not isinstance(field.length, str):
+                continue
+            length = scalars.get(field.length)
+            if length is None or length.type not in INTEGER_TYPES:
+                raise self.error('length of %s.%s must be an integer '
+                                 'parameter' % (name, field.name))
+        return Method(name, params, result, msgid)
+
+
+class Writer(object):
+    """Accumulates indented lines of output."""
+
+    def __init__(self, indent):
+        self.lines = []
+        self.level = 0
+        self.indent = indent
+
+    def __call__(self, line=''):
+        self.lines.append((self.indent * self.level + line) if line else '')
+
+    def push(self):
+        self.level += 1
+
+    def pop(self):
+        self.level -= 1
+
+    def text(self):
+        return '\n'.join(self.lines) + '\n'
+
+
+def header_comment(source):
+    return 'Generated by transactgen.py from %s. Do not edit.' % (
+        os.path.basename(source))
+
+
+class CGenerator(object):
+    """Emits a single header usable from both C and C++."""
+
+    extension = '.h'
+
+    def __init__(self, args):
+        self.args = args
+
+    def c_type(self, field):
+        return TYPES[field.type][1]
+
+    def param_decl(self, field):
+        if not field.is_array:
+            return '%s %s' % (self.c_type(field), field.name)
+        return 'const %s* %s' % (self.c_type(field), field.name)
+
+    def length(self, field):
+        return str(field.length) if isinstance(field.length, int) \
+            else '(size_t)%s' % field.length
+
+    def generate(self, interfaces, source, basename):
+        w = Writer('  ')
+        guard = re.sub(r'\W', '_', basename).upper() + '_TRANSACT_H_'
+        w('/* %s */' % header_comment(source))
+        w()
+        w('#ifndef %s' % guard)
+        w('#define %s' % guard)
+        w()
+        w('#include <libtransact.h>')
+        w()
+        w('#include <errno.h>')
+        w('#include <stdbool.h>')
+        w('#include <stdint.h>')
+        w('#include <string.h>')
+        w()
+        w('#ifdef __cplusplus')
+        w('extern "C" {')
+        w('#endif')
+        for interface in interfaces:
+            self.generate_interface(w, interface)
+        w()
+        w('#ifdef __cplusplus')
+        w('}')
+        w('#endif')
+        w()
+        w('#endif  /* %s */' % guard)
+        return w.text()
+
+    def generate_interface(self, w, interface):
+        prefix = snake_case(interface.name)
+        upper = prefix.upper()
+        w()
+        w('enum {')
+        w.push()
+        for method in interface.methods:
+            w('%s_%s_ID = %d,' % (upper, method.name.upper(), method.msgid))
+        w.pop()
+        w('};')
+
+        for method in interface.methods:
+            self.generate_call(w, prefix, upper, method)
+
+        w()
+        w('/*')
+        w(' * The implementation of %s served by %s_serve(). Array results '
+          'are' % (interface.name, prefix))
+        w(' * written directly into the reply through |result|, which has '
+          'room for')
+        w(' * exactly as many elements as the method declares.')
+        w(' */')
+        w('struct %s_server {' % prefix)
+        w.push()
+        for method in interface.methods:
+            params = ['void* context'] + [self.param_decl(p)
+                                          for p in method.params]
+            result = method.result
+            if result and result.is_array:
+                params.append('%s* result' % self.c_type(result))
+            ret = self.c_type(result) if result and not result.is_array \
+                else 'void'
+            w('%s (*%s)(%s);' % (ret, method.name, ', '.join(params)))
+        w.pop()
+        w('};')
+
+        for method in interface.methods:
+            self.generate_dispatch(w, prefix, method)
+
+        first = interface.methods[0].msgid if interface.methods else 1
+        w()
+        w('/*')
+        w(' * Serves calls from the peer until it goes away. Returns 0 once '
+          'the peer is')
+        w(' * gone, and -1 on error. A malformed request or an unknown '
+          'method id fails')
+        w(' * with EBADMSG.')
+        w(' */')
+        w('static inline int %s_serve(struct transact_message* message,' %
+          prefix)
+        indent = ' ' * len('static inline int %s_serve(' % prefix)
+        w('%sconst struct %s_server* server,' % (indent, prefix))
+        w('%svoid* context) {' % indent)
+        w.push()
+        w('typedef int (*dispatch_fn)(struct transact_message*,')
+        w('                           const struct %s_server*, void*);' %
+          prefix)
+        w('static const dispatch_fn kDispatch[] = {')
+        w.push()
+        for method in interface.methods:
+            w('%s_dispatch_%s,' % (prefix, method.name))
+        w.pop()
+        w('};')
+        w('for (;;) {')
+        w.push()
+        w('unsigned int index;')
+        w('int res;')
+        w('if (transact_message_recv(message) == -1)')
+        w('  return -1;')
+        w('index = (unsigned int)(message->method_id - %d);' % first)
+        w('if (index >= sizeof(kDispatch) / sizeof(kDispatch[0])) {')
+        w('  errno = EBADMSG;')
+        w('  return -1;')
+        w('}')
+        w('if (kDispatch[index](message, server, context) == -1)')
+        w('  return -1;')
+        w('res = transact_message_send(message);')
+        w('if (res != 1)')
+        w('  return res;')
+        w.pop()
+        w('}')
+        w.pop()
+        w('}')
+
+    def generate_call(self, w, prefix, upper, method):
+        result = method.result
+        params = ['struct transact_message* message'] + [
+            self.param_decl(p) for p in method.params]
+        if result:
+            params.append('%s* result' % self.c_type(result))
+        w()
+        w('/*')
+        w(' * Calls %s() on the peer. Returns 1 on success, 0 if the peer is'
+          % method.name)
+        w(' * gone, and -1 on error, with errno set to EBADMSG if the reply '
+          'is')
+        w(' * malformed.')
+        w(' */')
+        w('static inline int %s_%s(%s) {' % (prefix, method.name,
+                                            ', '.join(params)))
+        w.push()
+        w('size_t size = %s;' % method.request.size_expression(
+            lambda n: n, lambda s: '(size_t)%s' % s))
+        w('char* data;')
+        w('int res;')
+        w('if (transact_message_allocate(message, %s_%s_ID, size) == -1)' %
+          (upper, method.name.upper()))
+        w('  return -1;')
+        w('data = message->data;')
+        self.emit_copies(w, method.request, 'data', write=True)
+        w('res = transact_message_send(message);')
+        w('if (res != 1)')
+        w('  return res;')
+        w('if (transact_message_recv(message) == -1)')
+        w('  return -1;')
+        # The reply comes from the peer, so it might be anything.
+        self.emit_bad_message(w, 'message->method_id != %s_%s_ID' % (
+            upper, method.name.upper()))
+        if result:
+            w('size = %s;' % method.reply.size_expression(
+                lambda n: n, lambda s: '(size_t)%s' % s))
+            self.emit_bad_message(
+                w, '(size_t)(message->end - message->data) < size')
+            w('memcpy(result, message->data, size);')
+        w('return 1;')
+        w.pop()
+        w('}')
+
+    def emit_bad_message(self, w, condition):
+        w('if (%s) {' % condition)
+        w('  errno = EBADMSG;')
+        w('  return -1;')
+        w('}')
+
+    def emit_copies(self, w, layout, data, write):
+        """Copies |layout| into or out of |data|.
+
+        When reading, the |len| bytes left at |data| are checked before every
+        access, since the message comes from the peer."""
+        if not write and layout.header_size:
+            self.emit_bad_message(w, 'len < %d' % layout.header_size)
+        for field in layout.scalars:
+            if write:
+                w('memcpy(%s + %d, &%s, %d);' % (data, field.offset,
+                                                 field.name, field.size))
+            else:
+                w('memcpy(&%s, %s + %d, %d);' % (field.name, data,
+                                                 field.offset, field.size))
+        if not layout.arrays:
+            return
+        if layout.header_size:
+            w('%s += %d;' % (data, layout.header_size))
+            if not write:
+                w('len -= %d;' % layout.header_size)
+        for field in layout.arrays:
+            length = '%s * %d' % (self.length(field), field.size)
+            if write:
+                w('memcpy(%s, %s, %s);' % (data, field.name, length))
+            else:
+                if isinstance(field.length, int):
+                    self.emit_bad_message(w, 'len < %s' % length)
+                else:
+                    self.emit_bad_message(w, '%s < 0 || (size_t)%s > len / %d'
+                                          % (field.length, field.length,
+                                             field.size))
+                w('%s = (const %s*)%s;' % (field.name, self.c_type(field),
+                                            data))
+            if field is not layout.arrays[-1]:
+                w('%s += %s;' % (data, length))
+                if not write:
+                    w('len -= %s;' % length)
+
+    def generate_dispatch(self, w, prefix, method):
+        result = method.result
+        w()
+        w('static inline int %s_dispatch_%s(struct transact_message* message,'
+          % (prefix, method.name))
+        indent = ' ' * len('static inline int %s_dispatch_%s(' %
+                           (prefix, method.name))
+        w('%sconst struct %s_server* server,' % (indent, prefix))
+        w('%svoid* context) {' % indent)
+        w.push()
+        # The request stays valid until this side sends the reply, so arrays
+        # are handed to the implementation in place.
+        if method.params:
+            w('const char* request = message->data;')
+            w('size_t len = (size_t)(message->end - message->data);')
+        for field in method.params:
+            if field.is_array:
+                w('const %s* %s;' % (self.c_type(field), field.name))
+            else:
+                w('%s %s;' % (self.c_type(field), field.name))
+        if method.params:
+            self.emit_copies(w, method.request, 'request', write=False)
+        args = ['context'] + [p.name for p in method.params]
+        size = method.reply.size_expression(lambda n: n,
+                                            lambda s: '(size_t)%s' % s)
+        if result and not result.is_array:
+            w('%s result = server->%s(%s);' % (self.c_type(result),
+                                              method.name, ', '.join(args)))
+        elif not result:
+            w('server->%s(%s);' % (method.name, ', '.join(args)))
+        if result and result.is_array and \
+                not isinstance(result.length, int):
+            self.emit_bad_message(w, '%s < 0' % result.length)
+        if result and result.is_array:
+            # The implementation writes the result while it might still be
+            # reading arrays from the request, so it needs a block of its own.
+            w('if (transact_message_allocate(message, message->method_id, %s) '
+              '== -1)' % size)
+        else:
+            # Everything has been read from the request by now, so the reply
+            # can be written over it.
+            w('if (transact_message_reply(message, message->method_id, %s) '
+              '== -1)' % size)
+        w('  return -1;')
+        if result and result.is_array:
+            w('server->%s(%s);' % (method.name, ', '.join(
+                args + ['(%s*)message->data' % self.c_type(result)])))
+        elif result:
+            w('memcpy(message->data, &result, %d);' % result.size)
+        w('return 0;')
+        w.pop()
+        w('}')
+
+
+class JavaGenerator(object):
+
+    extension = '.java'
+
+    def __init__(self, args):
+        self.args = args
+
+    def java_type(self, field):
+        base = TYPES[field.type][2]
+        return base + '[]' if field.is_array else base
+
+    def length(self, field):
+        return str(field.length) if isinstance(field.length, int) \
+            else field.length
+
+    def write_field(self, w, field, name):
+        t = field.type
+        if field.is_array:
+            if t in ('byte', 'int', 'long', 'double'):
+                w('message.write%sArray(%s);' % (t.capitalize(), name))
+            else:
+                w('for (%s x : %s) {' % (TYPES[t][2], name))
+                w('\t%s' % self.write_scalar(t, 'x'))
+                w('}')
+        else:
+            w(self.write_scalar(t, name))
+
+    def write_scalar(self, t, name):
+        return 'message.write%s(%s);' % (t.capitalize(), name)
+
+    def read_scalar(self, t):
+        if t == 'byte':
+            return '(byte)message.readByte()'
+        return 'message.read%s()' % t.capitalize()
+
+    # Declares |target| and reads |field| into it.
+    def emit_read(self, w, field, target):
+        t = field.type
+        decl = '%s %s' % (self.java_type(field), target)
+        if not field.is_array:
+            w('%s = %s;' % (decl, self.read_scalar(t)))
+        elif t in ('byte', 'int', 'long', 'double'):
+            w('%s = message.read%sArray(%s);' % (decl, t.capitalize(),
+                                                 self.length(field)))
+        else:
+            w('%s = new %s[%s];' % (decl, TYPES[t][2], self.length(field)))
+            w('for (int i = 0; i < %s.length; i++) {' % target)
+            w('\t%s[i] = %s;' % (target, self.read_scalar(t)))
+            w('}')
+
+    def emit_padding(self, w, layout, write):
+        for _ in range(layout.padding):
+            w('message.writeByte(0);' if write else 'message.readByte();')
+
+    def check_lengths(self, w, method):
+        for field in method.params:
+            if field.is_array:
+                w('if (%s.length != %s) {' % (field.name, self.length(field)))
+                w('\tthrow new IllegalArgumentException("%s must have " + %s '
+                  '+ " elements");' % (field.name, self.length(field)))
+                w('}')
+
+    def generate(self, interfaces, source, basename):
+        w = Writer('\t')
+        w('// %s' % header_comment(source))
+        w()
+        if self.args.package:
+            w('package %s;' % self.args.package)
+            w()
+        w('import com.omegaup.transact.Message;')
+        w('import java.io.EOFException;')
+        w('import java.io.IOException;')
+        for interface in interfaces:
+            self.generate_interface(w, interface)
+        return w.text()
+
+    def generate_interface(self, w, interface):
+        w()
+        w('public final class %s {' % interface.name)
+        w.push()
+        for method in interface.methods:
+            w('public static final int %s_ID = %d;' % (method.name.upper(),
+                                                      method.msgid))
+        w()
+        w('private %s() {}' % interface.name)
+        w()
+        w('// The implementation of %s served by serve().' % interface.name)
+        w('public interface Server {')
+        w.push()
+        for method in interface.methods:
+            ret = self.java_type(method.result) if method.result else 'void'
+            w('%s %s(%s);' % (ret, camel_case(method.name), ', '.join(
+                '%s %s' % (self.java_type(p), p.name)
+                for p in method.params)))
+        w.pop()
+        w('}')
+        w()
+        w('// Calls the methods of %s on the peer. Every call throws' %
+          interface.name)
+        w('// EOFException if the peer goes away before replying.')
+        w('public static final class Client {')
+        w.push()
+        w('private final Message message;')
+        w()
+        w('public Client(Message message) {')
+        w('\tthis.message = message;')
+        w('}')
+        for method in interface.methods:
+            self.generate_call(w, method)
+        w.pop()
+        w('}')
+        w()
+        w('// Serves calls from the peer until it goes away.')
+        w('public static void serve(Message message, Server server) '
+          'throws IOException {')
+        w.push()
+        w('while (true) {')
+        w.push()
+        w('message.receive();')
+        w('switch (message.msgid) {')
+        for method in interface.methods:
+            self.generate_dispatch(w, method)
+        w('default:')
+        w('\tthrow new IOException("Unknown method id " + message.msgid);')
+        w('}')
+        w('if (message.send() != 1) {')
+        w('\treturn;')
+        w('}')
+        w.pop()
+        w('}')
+        w.pop()
+        w('}')
+        w.pop()
+        w('}')
+
+    def generate_call(self, w, method):
+        result = method.result
+        ret = self.java_type(result) if result else 'void'
+        w()
+        w('public %s %s(%s) throws IOException {' % (
+            ret, camel_case(method.name), ', '.join(
+                '%s %s' % (self.java_type(p), p.name)
+                for p in method.params)))
+        w.push()
+        self.check_lengths(w, method)
+        w('message.allocate(%s_ID, %s);' % (
+            method.name.upper(), method.request.size_expression(
+                lambda n: n, lambda s: '(long)%s' % s)))
+        for field in method.request.scalars:
+            self.write_field(w, field, field.name)
+        self.emit_padding(w, method.request, write=True)
+        for field in method.request.arrays:
+            self.write_field(w, field, field.name)
+        w('if (message.send() != 1) {')
+        w('\tthrow new EOFException("Peer is gone");')
+        w('}')
+        w('message.receive();')
+        w('if (message.msgid != %s_ID) {' % method.name.upper())
+        w('\tthrow new IOException("Unexpected reply " + message.msgid);')
+        w('}')
+        if result:
+            self.emit_read(w, result, 'result')
+            w('return result;')
+        w.pop()
+        w('}')
+
+    def generate_dispatch(self, w, method):
+        result = method.result
+        w('case %s_ID: {' % method.name.upper())
+        w.push()
+        for field in method.request.scalars:
+            self.emit_read(w, field, field.name)
+        self.emit_padding(w, method.request, write=False)
+        for field in method.request.arrays:
+            self.emit_read(w, field, field.name)
+        call = 'server.%s(%s)' % (camel_case(method.name), ', '.join(
+            p.name for p in method.params))
+        if result:
+            w('%s result = %s;' % (self.java_type(result), call))
+            if result.is_array:
+                w('if (result.length != %s) {' % self.length(result))
+                w('\tthrow new IllegalStateException("%s() must return " + %s '
+                  '+ " elements");' % (camel_case(method.name),
+                                       self.length(result)))
+                w('}')
+        else:
+            w('%s;' % call)
+        w('message.allocate(%s_ID, %s);' % (
+            method.name.upper(), method.reply.size_expression(
+                lambda n: n, lambda s: '(long)%s' % s)))
+        if result:
+            self.write_field(w, result, 'result')
+        w('break;')
+        w.pop()
+        w('}')
+
+
+class CSharpGenerator(object):
+
+    extension = '.cs'
+
+    def __init__(self, args):
+        self.args = args
+
+    def cs_type(self, field):
+        base = TYPES[field.type][3]
+        return base + '[]' if field.is_array else base
+
+    def length(self, field):
+        return str(field.length) if isinstance(field.length, int) \
+            else field.length
+
+    def write_field(self, field, name):
+        if field.is_array:
+            return 'message.Write(%s);' % name
+        if field.type == 'byte':
+            return 'message.Write((byte)%s);' % name
+        return 'message.Write(%s);' % name
+
+    def read_field(self, field):
+        if field.is_array:
+            return 'message.ReadSpan<%s>(%s).ToArray()' % (
+                TYPES[field.type][3], self.length(field))
+        return {
+            'bool': 'message.ReadBool()',
+            'byte': '(sbyte)message.ReadByte()',
+            'short': 'message.ReadShort()',
+            'int': 'message.ReadInt32()',
+            'long': 'message.ReadInt64()',
+            'float': 'message.ReadSingle()',
+            'double': 'message.ReadDouble()',
+        }[field.type]
+
+    def emit_padding(self, w, layout, write):
+        for _ in range(layout.padding):
+            w('message.Write((byte)0);' if write else 'message.ReadByte();')
+
+    def generate(self, interfaces, source, basename):
+        w = Writer('\t')
+        w('// %s' % header_comment(source))
+        w()
+        w('using System;')
+        w('using System.IO;')
+        w()
+        namespace = self.args.namespace or 'Omegaup.Transact.Generated'
+        w('namespace %s {' % namespace)
+        w.push()
+        for i, interface in enumerate(interfaces):
+            if i:
+                w()
+            self.generate_interface(w, interface)
+        w.pop()
+        w('}')
+        return w.text()
+
+    def generate_interface(self, w, interface):
+        w('public static class %s {' % interface.name)
+        w.push()
+        for method in interface.methods:
+            w('public const int %sId = %d;' % (pascal_case(method.name),
+                                              method.msgid))
+        w()
+        w('// The implementation of %s served by Serve().' % interface.name)
+        w('public interface IServer {')
+        w.push()
+        for method in interface.methods:
+            ret = self.cs_type(method.result) if method.result else 'void'
+            w('%s %s(%s);' % (ret, pascal_case(method.name), ', '.join(
+                '%s %s' % (self.cs_type(p), p.name) for p in method.params)))
+        w.pop()
+        w('}')
+        w()
+        w('// Calls the methods of %s on the peer. Every call throws' %
+          interface.name)
+        w('// EndOfStreamException if the peer goes away before replying.')
+        w('public sealed class Client {')
+        w.push()
+        w('private readonly Omegaup.Transact.Message message;')
+        w()
+        w('public Client(Omegaup.Transact.Message message) {')
+        w('\tthis.message = message;')
+        w('}')
+        for method in interface.methods:
+            self.generate_call(w, method)
+        w.pop()
+        w('}')
+        w()
+        w('// Serves calls from the peer until it goes away.')
+        w('public static void Serve(Omegaup.Transact.Message message, '
+          'IServer server) {')
+        w.push()
+        w('while (true) {')
+        w.push()
+        w('message.Receive();')
+        w('switch (message.methodId) {')
+        w.push()
+        for method in interface.methods:
+            self.generate_dispatch(w, method)
+        w('default:')
+        w('\tthrow new InvalidDataException("Unknown method id " + '
+          'message.methodId);')
+        w.pop()
+        w('}')
+        w('if (message.Send() != 1) {')
+        w('\treturn;')
+        w('}')
+        w.pop()
+        w('}')
+        w.pop()
+        w('}')
+        w.pop()
+        w('}')
+
+    def generate_call(self, w, method):
+        result = method.result
+        ret = self.cs_type(result) if result else 'void'
+        w()
+        w('public %s %s(%s) {' % (ret, pascal_case(method.name), ', '.join(
+            '%s %s' % (self.cs_type(p), p.name) for p in method.params)))
+        w.push()
+        for field in method.params:
+            if field.is_array:
+                w('if (%s.Length != %s) {' % (field.name, self.length(field)))
+                w('\tthrow new ArgumentException("Expected " + %s + " '
+                  'elements", nameof(%s));' % (self.length(field), field.name))
+                w('}')
+        w('message.Allocate(%sId, %s);' % (
+            pascal_case(method.name), method.request.size_expression(
+                lambda n: n, lambda s: '(ulong)%s' % s)))
+        for field in method.request.scalars:
+            w(self.write_field(field, field.name))
+        self.emit_padding(w, method.request, write=True)
+        for field in method.request.arrays:
+            w(self.write_field(field, field.name))
+        w('if (message.Send() != 1) {')
+        w('\tthrow new EndOfStreamException("Peer is gone");')
+        w('}')
+        w('message.Receive();')
+        w('if (message.methodId != %sId) {' % pascal_case(method.name))
+        w('\tthrow new InvalidDataException("Unexpected reply " + '
+          'message.methodId);')
+        w('}')
+        if result:
+            w('return %s;' % self.read_field(result))
+        w.pop()
+        w('}')
+
+    def generate_dispatch(self, w, method):
+        result = method.result
+        w('case %sId: {' % pascal_case(method.name))
+        w.push()
+        for field in method.request.scalars:
+            w('%s %s = %s;' % (self.cs_type(field), field.name,
+                               self.read_field(field)))
+        self.emit_padding(w, method.request, write=False)
+        for field in method.request.arrays:
+            w('%s %s = %s;' % (self.cs_type(field), field.name,
+                               self.read_field(field)))
+        call = 'server.%s(%s)' % (pascal_case(method.name), ', '.join(
+            p.name for p in method.params))
+        if result:
+            w('%s result = %s;' % (self.cs_type(result), call))
+            if result.is_array:
+                w('if (result.Length != %s) {' % self.length(result))
+                w('\tthrow new InvalidOperationException("%s() must return " '
+                  '+ %s + " elements");' % (pascal_case(method.name),
+                                            self.length(result)))
+                w('}')
+        else:
+            w('%s;' % call)
+        w('message.Allocate(%sId, %s);' % (
+            pascal_case(method.name), method.reply.size_expression(
+                lambda n: n, lambda s: '(ulong)%s' % s)))
+        if result:
+            w(self.write_field(result, 'result'))
+        w('break;')
+        w.pop()
+        w('}')
+
+
+class PythonGenerator(object):
+    """Emits a module for the Python 2 binding, using struct for packing."""
+
+    extension = '.py'
+
+    def __init__(self, args):
+        self.args = args
+
+    def code(self, field):
+        return TYPES[field.type][4]
+
+    def scalar_format(self, layout):
+        return '=' + ''.join(self.code(f) for f in layout.scalars) + \
+            'x' * layout.padding
+
+    def length(self, field):
+        return str(field.length) if isinstance(field.length, int) \
+            else field.length
+
+    def generate(self, interfaces, source, basename):
+        w = Writer('\t')
+        w('#!/usr/bin/python')
+        w('# -*- coding: utf-8 -*-')
+        w('# %s' % header_comment(source))
+        w()
+        w('import struct')
+        for interface in interfaces:
+            self.generate_interface(w, interface)
+        return w.text()
+
+    def generate_interface(self, w, interface):
+        prefix = snake_case(interface.name).upper()
+        w()
+        for method in interface.methods:
+            w('%s_%s_ID = %d' % (prefix, method.name.upper(), method.msgid))
+        for method in interface.methods:
+            for kind, layout in (('REQUEST', method.request),
+                                 ('REPLY', method.reply)):
+                if layout.scalars:
+                    w('_%s_%s_%s = struct.Struct(%r)' % (
+                        prefix, method.name.upper(), kind,
+                        self.scalar_format(layout)))
+        w()
+        w()
+        w('class %sClient(object):' % interface.name)
+        w.push()
+        w('"""Calls the methods of %s on the peer."""' % interface.name)
+        w()
+        w('def __init__(self, interface, message):')
+        w('\tself._interface = interface')
+        w('\tself._message = message')
+        for method in interface.methods:
+            self.generate_call(w, prefix, method)
+        w.pop()
+        for method in interface.methods:
+            self.generate_dispatch(w, prefix, snake_case(interface.name),
+                                   method)
+        w()
+        w()
+        w('def serve_%s(interface, message, server):' %
+          snake_case(interface.name))
+        w.push()
+        w('"""Serves calls from the peer with the methods of |server|.')
+        w()
+        w('Like every transact.Interface.call() made on behalf of the child, '
+          'this exits')
+        w('the process once the peer is gone."""')
+        first = interface.methods[0].msgid if interface.methods else 1
+        w('dispatch = (')
+        for m in interface.methods:
+            w('\t\t_dispatch_%s_%s,' % (snake_case(interface.name), m.name))
+        w(')')
+        w('interface.get(message)')
+        w('while True:')
+        w.push()
+        w('index = message.msgid - %d' % first)
+        w('if not 0 <= index < len(dispatch):')
+        w("\traise IOError('Unknown method id %d' % message.msgid)")
+        w('dispatch[index](interface, message, server)')
+        w('interface.call(message, True, False)')
+        w.pop()
+        w.pop()
+
+    def size(self, layout):
+        return layout.size_expression(lambda n: n)
+
+    def emit_pack(self, w, prefix, method, kind, layout, target):
+        if layout.scalars:
+            w('%s.write(_%s_%s_%s.pack(%s))' % (
+                target, prefix, method.name.upper(), kind, ', '.join(
+                    f.name for f in layout.scalars)))
+        for field in layout.arrays:
+            w("%s.write(struct.pack('=%%d%s' %% %s, *%s))" % (
+                target, self.code(field), self.length(field), field.name))
+
+    def emit_unpack(self, w, prefix, method, kind, layout, source):
+        if layout.scalars:
+            names = ', '.join(f.name for f in layout.scalars)
+            if len(layout.scalars) == 1:
+                names += ','
+            w('%s = _%s_%s_%s.unpack(%s.read(%d))' % (
+                names, prefix,
+                method.name.upper(), kind, source, layout.header_size))
+        for field in layout.arrays:
+            w("%s = list(struct.unpack('=%%d%s' %% %s, %s.read(%s * %d)))" % (
+                field.name, self.code(field), self.length(field), source,
+                self.length(field), field.size))
+
+    def generate_call(self, w, prefix, method):
+        w()
+        w('def %s(self%s):' % (method.name, ''.join(
+            ', %s' % p.name for p in method.params)))
+        w.push()
+        for field in method.params:
+            if field.is_array:
+                w('if len(%s) != %s:' % (field.name, self.length(field)))
+                w("\traise ValueError('%s must have %%d elements' %% %s)" % (
+                    field.name, self.length(field)))
+        w('self._interface.allocate(self._message, %s_%s_ID, %s)' % (
+            prefix, method.name.upper(), self.size(method.request)))
+        self.emit_pack(w, prefix, method, 'REQUEST', method.request,
+                       'self._message')
+        w('self._interface.call(self._message, False, False)')
+        w('if self._message.msgid != %s_%s_ID:' % (prefix,
+                                                   method.name.upper()))
+        w("\traise IOError('Unexpected reply %d' % self._message.msgid)")
+        result = method.result
+        if result:
+            if result.is_array:
+                self.emit_unpack(w, prefix, method, 'REPLY', method.reply,
+                                 'self._message')
+            else:
+                w('return _%s_%s_REPLY.unpack(self._message.read(%d))[0]' % (
+                    prefix, method.name.upper(), result.size))
+                w.pop()
+                return
+            w('return result')
+        w.pop()
+
+    def generate_dispatch(self, w, prefix, snake_name, method):
+        w()
+        w()
+        w('def _dispatch_%s_%s(interface, message, server):' % (
+            snake_name, method.name))
+        w.push()
+        self.emit_unpack(w, prefix, method, 'REQUEST', method.request,
+                         'message')
+        call = 'server.%s(%s)' % (method.name, ', '.join(
+            p.name for p in method.params))
+        result = method.result
+        if result:
+            w('result = %s' % call)
+            if result.is_array:
+                w('if len(result) != %s:' % self.length(result))
+                w("\traise ValueError('%s() must return %%d elements' %% %s)"
+                  % (method.name, self.length(result)))
+        else:
+            w(call)
+        w('interface.allocate(message, message.msgid, %s)' % self.size(
+            method.reply))
+        if result:
+            if result.is_array:
+                self.emit_pack(w, prefix, method, 'REPLY', method.reply,
+                               'message')
+            else:
+                w('message.write(_%s_%s_REPLY.pack(result))' % (
+                    prefix, method.name.upper()))
+        w.pop()
+
+
+GENERATORS = {
+    'c': CGenerator,
+    'java': JavaGenerator,
+    'cs': CSharpGenerator,
+    'python': PythonGenerator,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('idl', help='the interface description')
+    parser.add_argument('--lang', action='append',
+                        choices=sorted(GENERATORS),
+                        help='the bindings to generate (default: all)')
+    parser.add_argument('--out', default='.',
+                        help='the directory to write the stubs into')
+    parser.add_argument('--package', help='the Java package of the stubs')
+    parser.add_argument('--namespace', help='the C# namespace of the stubs')
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    with open(args.idl) as f:
+        text = f.read()
+    try:
+        interfaces = Parser(args.idl, text).parse()
+    except IdlError as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+    basename = os.path.splitext(os.path.basename(args.idl))[0]
+    for lang in args.lang or sorted(GENERATORS):
+        generator = GENERATORS[lang](args)
+        if lang == 'java':
+            # Java wants one public class per file.
+            for interface in interfaces:
+                path = os.path.join(args.out, interface.name + '.java')
+                with open(path, 'w') as f:
+                    f.write(generator.generate([interface], args.idl,
+                                               basename))
+            continue
+        path = os.path.join(args.out, basename + '_transact' +
+                            generator.extension)
+        with open(path, 'w') as f:
+            f.write(generator.generate(interfaces, args.idl, basename))
+
+
+if __name__ == '__main__':
+    main()
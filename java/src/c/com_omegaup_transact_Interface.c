@@ -35,9 +35,6 @@ JNI_OnLoad(JavaVM* vm, void* reserved) {
 	g_fields.interface_interfacePtr = (*env)->GetFieldID(env, g_classes.interface,
 			"interfacePtr", "J");
 	if ((*env)->ExceptionCheck(env)) return -1;
-	g_fields.message_messagePtr = (*env)->GetFieldID(env, g_classes.message,
-			"messagePtr", "J");
-	if ((*env)->ExceptionCheck(env)) return -1;
 	g_fields.message_msgid = (*env)->GetFieldID(env, g_classes.message,
 			"msgid", "I");
 	if ((*env)->ExceptionCheck(env)) return -1;
@@ -57,23 +54,23 @@ JNI_OnUnload(JavaVM* vm, void* reserved) {
 
 JNIEXPORT jlong JNICALL
 Java_com_omegaup_transact_Interface_nativeInit(JNIEnv* env,
-		jobject thisObj, jboolean parent, jstring transact_nameJNI,
+		jclass clazz, jboolean parent, jstring transact_nameJNI,
 		jstring shm_nameJNI, jlong size) {
 	const char* transact_name = (*env)->GetStringUTFChars(
 			env, transact_nameJNI, NULL);
 	if (!transact_name) {
 		char buffer[1024];
 		snprintf(buffer, sizeof(buffer), "transactName");
-		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerExceptin"),
+		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerException"),
 				buffer);
 		return 0;
 	}
 	const char* shm_name = (*env)->GetStringUTFChars(env, shm_nameJNI, NULL);
-	if (!transact_name) {
+	if (!shm_name) {
 		(*env)->ReleaseStringUTFChars(env, transact_nameJNI, transact_name);
 		char buffer[1024];
 		snprintf(buffer, sizeof(buffer), "shmName");
-		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerExceptin"),
+		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerException"),
 				buffer);
 		return 0;
 	}
@@ -97,6 +94,6 @@ Java_com_omegaup_transact_Interface_nativeInit(JNIEnv* env,
 
 JNIEXPORT void JNICALL
 Java_com_omegaup_transact_Interface_nativeFinalize(JNIEnv* env,
-		jobject thisObj, jlong interfacePtr) {
+		jclass clazz, jlong interfacePtr) {
 	transact_interface_close((struct transact_interface*)interfacePtr);
 }
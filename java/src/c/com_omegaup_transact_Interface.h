@@ -13,7 +13,7 @@ extern "C" {
  * Signature: (ZLjava/lang/String;Ljava/lang/String;J)J
  */
 JNIEXPORT jlong JNICALL Java_com_omegaup_transact_Interface_nativeInit
-  (JNIEnv *, jobject, jboolean, jstring, jstring, jlong);
+  (JNIEnv *, jclass, jboolean, jstring, jstring, jlong);
 
 /*
  * Class:     com_omegaup_transact_Interface
@@ -21,7 +21,7 @@ JNIEXPORT jlong JNICALL Java_com_omegaup_transact_Interface_nativeInit
  * Signature: (J)V
  */
 JNIEXPORT void JNICALL Java_com_omegaup_transact_Interface_nativeFinalize
-  (JNIEnv *, jobject, jlong);
+  (JNIEnv *, jclass, jlong);
 
 #ifdef __cplusplus
 }
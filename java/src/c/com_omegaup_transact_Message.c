@@ -12,7 +12,7 @@
 
 JNIEXPORT jlong JNICALL
 Java_com_omegaup_transact_Message_nativeInit(JNIEnv* env,
-		jobject thisObj, jlong interfacePtr) {
+		jclass clazz, jlong interfacePtr) {
 	struct transact_message* message = transact_message_new();
 	if (!message) {
 		char buffer[1024];
@@ -33,47 +33,52 @@ Java_com_omegaup_transact_Message_nativeInit(JNIEnv* env,
 
 JNIEXPORT void JNICALL
 Java_com_omegaup_transact_Message_nativeFinalize(JNIEnv* env,
-		jobject thisObj, jlong messagePtr) {
+		jclass clazz, jlong messagePtr) {
 	transact_message_free((struct transact_message*)messagePtr);
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_allocate(JNIEnv* env,
-		jobject thisObj, jint msgid, jlong bytes) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
+// Wraps the data section of |message| in a direct ByteBuffer, so that all the
+// primitive reads and writes can be done from Java without crossing JNI.
+static jobject
+wrap_message(JNIEnv* env, struct transact_message* message) {
+	return (*env)->NewDirectByteBuffer(env, message->data,
+			message->end - message->data);
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_omegaup_transact_Message_nativeAllocate(JNIEnv* env,
+		jclass clazz, jlong messagePtr, jint msgid, jlong bytes) {
+	struct transact_message* message = (struct transact_message*)messagePtr;
 	if (transact_message_allocate(message, msgid, bytes)) {
 		char buffer[1024];
 		snprintf(buffer, sizeof(buffer), "transact_message_allocate: %m");
 		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/io/IOException"),
 				buffer);
+		return NULL;
 	}
+	return wrap_message(env, message);
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_receive(JNIEnv* env,
-		jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
+JNIEXPORT jobject JNICALL
+Java_com_omegaup_transact_Message_nativeReceive(JNIEnv* env,
+		jobject thisObj, jlong messagePtr) {
+	struct transact_message* message = (struct transact_message*)messagePtr;
 	if (transact_message_recv(message)) {
 		char buffer[1024];
 		snprintf(buffer, sizeof(buffer), "transact_message_recv: %m");
 		(*env)->ThrowNew(env, (*env)->FindClass(env, "java/io/IOException"),
 				buffer);
-		return;
+		return NULL;
 	}
 	(*env)->SetIntField(env, thisObj, g_fields.message_msgid,
 			message->method_id);
+	return wrap_message(env, message);
 }
 
-JNIEXPORT int JNICALL
-Java_com_omegaup_transact_Message_send(JNIEnv* env,
-		jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
+JNIEXPORT jint JNICALL
+Java_com_omegaup_transact_Message_nativeSend(JNIEnv* env,
+		jclass clazz, jlong messagePtr) {
+	struct transact_message* message = (struct transact_message*)messagePtr;
 	int res = transact_message_send(message);
 	if (res == -1) {
 		char buffer[1024];
@@ -85,86 +90,87 @@ Java_com_omegaup_transact_Message_send(JNIEnv* env,
 	return res;
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_writeByte(JNIEnv* env, jobject thisObj,
-		jint x) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	*(int8_t*)message->data = (int8_t)x;
-	message->data += sizeof(int8_t);
+// The return values of the range-checked array reads. Any other value is the
+// index of the first element that was out of range.
+#define ARRAY_IN_RANGE (-1)
+#define ARRAY_UNDERFLOW (-2)
+
+static jint
+array_read_result(ssize_t res, jsize length, size_t bad_index) {
+	if (res == -1)
+		return bad_index;
+	if (res == 0 && length != 0)
+		return ARRAY_UNDERFLOW;
+	return ARRAY_IN_RANGE;
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_writeShort(JNIEnv* env, jobject
-		thisObj, jshort x) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	*(int16_t*)message->data = x;
-	message->data += sizeof(int16_t);
+// Makes sure an exception is pending after GetPrimitiveArrayCritical() failed,
+// which Java throws as soon as the native method returns, whatever it
+// returns.
+static jint
+array_pin_failed(JNIEnv* env) {
+	if (!(*env)->ExceptionCheck(env)) {
+		(*env)->ThrowNew(env,
+				(*env)->FindClass(env, "java/lang/OutOfMemoryError"),
+				"GetPrimitiveArrayCritical");
+	}
+	return ARRAY_IN_RANGE;
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_writeInt(JNIEnv* env, jobject thisObj,
-		jint x) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	*(int32_t*)message->data = x;
-	message->data += sizeof(int32_t);
+// Whether |count| elements of |size| bytes fit in |message| after |position|.
+// The ByteBuffer that Java reads from only spans the current chunk of a
+// streamed message, and so do the reads below: fetching the next chunk would
+// hand control over to the peer while the JVM is in a critical section, and
+// would move the cursor they restore.
+static int
+array_fits(struct transact_message* message, jint position, jsize count,
+		size_t size) {
+	size_t available = message->end - message->data;
+	return position >= 0 && (size_t)position <= available &&
+		(size_t)count <= (available - position) / size;
 }
 
-JNIEXPORT void JNICALL
-Java_com_omegaup_transact_Message_writeLong(JNIEnv* env, jobject thisObj,
-		jlong x) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	*(int64_t*)message->data = x;
-	message->data += sizeof(int64_t);
-}
+// Java keeps track of its own position within the message, so the reads below
+// temporarily move |message|'s cursor there.
 
 JNIEXPORT jint JNICALL
-Java_com_omegaup_transact_Message_readByte(JNIEnv* env, jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	jint x = *(int8_t*)message->data;
-	message->data += sizeof(int8_t);
-
-	return (jint)x;
-}
-
-JNIEXPORT jshort JNICALL
-Java_com_omegaup_transact_Message_readShort(JNIEnv* env, jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	jshort x = *(int16_t*)message->data;
-	message->data += sizeof(int16_t);
-
-	return x;
+Java_com_omegaup_transact_Message_nativeReadIntArray(JNIEnv* env,
+		jclass clazz, jlong messagePtr, jint position, jintArray x,
+		jint minValue, jint maxValue) {
+	struct transact_message* message = (struct transact_message*)messagePtr;
+	jsize length = (*env)->GetArrayLength(env, x);
+	if (!array_fits(message, position, length, sizeof(jint)))
+		return ARRAY_UNDERFLOW;
+	jint* elements = (*env)->GetPrimitiveArrayCritical(env, x, NULL);
+	if (!elements)
+		return array_pin_failed(env);
+	char* data = message->data;
+	size_t bad_index;
+	message->data += position;
+	ssize_t res = transact_message_read_int32_array(message, elements, length,
+			minValue, maxValue, &bad_index);
+	message->data = data;
+	(*env)->ReleasePrimitiveArrayCritical(env, x, elements, 0);
+	return array_read_result(res, length, bad_index);
 }
 
 JNIEXPORT jint JNICALL
-Java_com_omegaup_transact_Message_readInt(JNIEnv* env, jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	jint x = *(int32_t*)message->data;
-	message->data += sizeof(int32_t);
-
-	return x;
-}
-
-JNIEXPORT jlong JNICALL
-Java_com_omegaup_transact_Message_readLong(JNIEnv* env, jobject thisObj) {
-	struct transact_message* message =
-			(struct transact_message*)(*env)->GetLongField(env, thisObj,
-					g_fields.message_messagePtr);
-	jlong x = *(int64_t*)message->data;
-	message->data += sizeof(int64_t);
-
-	return x;
+Java_com_omegaup_transact_Message_nativeReadLongArray(JNIEnv* env,
+		jclass clazz, jlong messagePtr, jint position, jlongArray x,
+		jlong minValue, jlong maxValue) {
+	struct transact_message* message = (struct transact_message*)messagePtr;
+	jsize length = (*env)->GetArrayLength(env, x);
+	if (!array_fits(message, position, length, sizeof(jlong)))
+		return ARRAY_UNDERFLOW;
+	jlong* elements = (*env)->GetPrimitiveArrayCritical(env, x, NULL);
+	if (!elements)
+		return array_pin_failed(env);
+	char* data = message->data;
+	size_t bad_index;
+	message->data += position;
+	ssize_t res = transact_message_read_int64_array(message,
+			(int64_t*)elements, length, minValue, maxValue, &bad_index);
+	message->data = data;
+	(*env)->ReleasePrimitiveArrayCritical(env, x, elements, 0);
+	return array_read_result(res, length, bad_index);
 }
@@ -9,107 +9,59 @@ extern "C" {
 #endif
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    allocate
- * Signature: (IJ)V
+ * Method:    nativeAllocate
+ * Signature: (JIJ)Ljava/nio/ByteBuffer;
  */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_allocate
-  (JNIEnv *, jobject, jint, jlong);
+JNIEXPORT jobject JNICALL Java_com_omegaup_transact_Message_nativeAllocate
+  (JNIEnv *, jclass, jlong, jint, jlong);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    receive
- * Signature: ()V
+ * Method:    nativeReceive
+ * Signature: (J)Ljava/nio/ByteBuffer;
  */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_receive
-  (JNIEnv *, jobject);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    send
- * Signature: ()I
- */
-JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_send
-  (JNIEnv *, jobject);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    writeByte
- * Signature: (I)V
- */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_writeByte
-  (JNIEnv *, jobject, jint);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    writeShort
- * Signature: (S)V
- */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_writeShort
-  (JNIEnv *, jobject, jshort);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    writeInt
- * Signature: (I)V
- */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_writeInt
-  (JNIEnv *, jobject, jint);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    writeLong
- * Signature: (J)V
- */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_writeLong
+JNIEXPORT jobject JNICALL Java_com_omegaup_transact_Message_nativeReceive
   (JNIEnv *, jobject, jlong);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    readByte
- * Signature: ()I
- */
-JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_readByte
-  (JNIEnv *, jobject);
-
-/*
- * Class:     com_omegaup_transact_Message
- * Method:    readShort
- * Signature: ()S
+ * Method:    nativeSend
+ * Signature: (J)I
  */
-JNIEXPORT jshort JNICALL Java_com_omegaup_transact_Message_readShort
-  (JNIEnv *, jobject);
+JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_nativeSend
+  (JNIEnv *, jclass, jlong);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    readInt
- * Signature: ()I
+ * Method:    nativeInit
+ * Signature: (J)J
  */
-JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_readInt
-  (JNIEnv *, jobject);
+JNIEXPORT jlong JNICALL Java_com_omegaup_transact_Message_nativeInit
+  (JNIEnv *, jclass, jlong);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    readLong
- * Signature: ()J
+ * Method:    nativeFinalize
+ * Signature: (J)V
  */
-JNIEXPORT jlong JNICALL Java_com_omegaup_transact_Message_readLong
-  (JNIEnv *, jobject);
+JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_nativeFinalize
+  (JNIEnv *, jclass, jlong);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    nativeInit
- * Signature: (J)J
+ * Method:    nativeReadIntArray
+ * Signature: (JI[III)I
  */
-JNIEXPORT jlong JNICALL Java_com_omegaup_transact_Message_nativeInit
-  (JNIEnv *, jobject, jlong);
+JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_nativeReadIntArray
+  (JNIEnv *, jclass, jlong, jint, jintArray, jint, jint);
 
 /*
  * Class:     com_omegaup_transact_Message
- * Method:    nativeFinalize
- * Signature: (J)V
+ * Method:    nativeReadLongArray
+ * Signature: (JI[JJJ)I
  */
-JNIEXPORT void JNICALL Java_com_omegaup_transact_Message_nativeFinalize
-  (JNIEnv *, jobject, jlong);
+JNIEXPORT jint JNICALL Java_com_omegaup_transact_Message_nativeReadLongArray
+  (JNIEnv *, jclass, jlong, jint, jlongArray, jlong, jlong);
 
 #ifdef __cplusplus
 }
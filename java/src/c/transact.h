@@ -10,7 +10,6 @@ extern struct classes g_classes;
 
 struct fields {
 	jfieldID interface_interfacePtr;
-	jfieldID message_messagePtr;
 	jfieldID message_msgid;
 };
 
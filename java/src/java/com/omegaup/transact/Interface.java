@@ -5,32 +5,54 @@
 package com.omegaup.transact;
 
 import java.io.IOException;
+import java.lang.ref.Cleaner;
 
-public class Interface {
+public class Interface implements AutoCloseable {
 	static {
 		System.loadLibrary("transact_java");
 	}
 
-	private long interfacePtr;
+	static final Cleaner CLEANER = Cleaner.create();
+
+	private final long interfacePtr;
+	private final Cleaner.Cleanable cleanable;
 	public final String name;
 
 	public Interface(boolean parent, String name, String transactName,
 			String shmName, long size) throws IOException {
 		this.name = name;
 		this.interfacePtr = nativeInit(parent, transactName, shmName, size);
+		this.cleanable = CLEANER.register(this,
+				new Deallocator(this.interfacePtr));
+	}
+
+	private static class Deallocator implements Runnable {
+		private final long interfacePtr;
+
+		Deallocator(long interfacePtr) {
+			this.interfacePtr = interfacePtr;
+		}
+
+		@Override
+		public void run() {
+			nativeFinalize(interfacePtr);
+		}
 	}
 
 	@Override
-	public void finalize() {
-		nativeFinalize(this.interfacePtr);
-		this.interfacePtr = 0;
+	public void close() {
+		cleanable.clean();
 	}
 
 	public Message buildMessage() throws IOException {
-		return new Message(interfacePtr);
+		return new Message(this);
+	}
+
+	long interfacePtr() {
+		return interfacePtr;
 	}
 
-	private native long nativeInit(boolean parent, String transactName,
+	private static native long nativeInit(boolean parent, String transactName,
 			String shmName, long size) throws IOException;
-	private native void nativeFinalize(long interfacePtr);
+	private static native void nativeFinalize(long interfacePtr);
 }
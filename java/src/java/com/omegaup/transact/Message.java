@@ -5,24 +5,59 @@
 package com.omegaup.transact;
 
 import java.io.IOException;
+import java.lang.ref.Cleaner;
+import java.nio.BufferOverflowException;
+import java.nio.BufferUnderflowException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
 
 public class Message {
-	private long messagePtr;
+	// Keeps the interface reachable (and therefore mapped) for as long as any
+	// of its messages are alive.
+	private final Interface iface;
+	private final long messagePtr;
+	private final Cleaner.Cleanable cleanable;
+
+	// A view over the data section of the current shm block. It is only valid
+	// between a call to allocate()/receive() and the next send().
+	private ByteBuffer buffer;
 	public int msgid;
 
-	Message(long interfacePtr) throws IOException {
-		messagePtr = nativeInit(interfacePtr);
+	Message(Interface iface) throws IOException {
+		this.iface = iface;
+		this.messagePtr = nativeInit(iface.interfacePtr());
+		this.cleanable = Interface.CLEANER.register(this,
+				new Deallocator(this.messagePtr));
+	}
+
+	private static class Deallocator implements Runnable {
+		private final long messagePtr;
+
+		Deallocator(long messagePtr) {
+			this.messagePtr = messagePtr;
+		}
+
+		@Override
+		public void run() {
+			nativeFinalize(messagePtr);
+		}
 	}
 
-	@Override
-	public void finalize() {
-		nativeFinalize(this.messagePtr);
-		this.messagePtr = 0;
+	public void allocate(int msgid, long bytes) throws IOException {
+		buffer = nativeAllocate(messagePtr, msgid, bytes)
+				.order(ByteOrder.nativeOrder());
+		this.msgid = msgid;
 	}
 
-	public native void allocate(int msgid, long bytes) throws IOException;
-	public native void receive() throws IOException;
-	public native int send() throws IOException;
+	public void receive() throws IOException {
+		buffer = nativeReceive(messagePtr).order(ByteOrder.nativeOrder());
+	}
+
+	public int send() throws IOException {
+		buffer = null;
+		return nativeSend(messagePtr);
+	}
 
 	public void writeInt(int x, int minValue, int maxValue) {
 		if (x < minValue || x > maxValue) {
@@ -33,10 +68,21 @@ public class Message {
 		writeInt(x);
 	}
 
-	public native void writeByte(int x);
-	public native void writeShort(short x);
-	public native void writeInt(int x);
-	public native void writeLong(long x);
+	public void writeByte(int x) {
+		buffer.put((byte)x);
+	}
+
+	public void writeShort(short x) {
+		buffer.putShort(x);
+	}
+
+	public void writeInt(int x) {
+		buffer.putInt(x);
+	}
+
+	public void writeLong(long x) {
+		buffer.putLong(x);
+	}
 
 	public void writeChar(char x) {
 		writeByte((int)x);
@@ -47,11 +93,45 @@ public class Message {
 	}
 
 	public void writeDouble(double x) {
-		writeLong(Double.doubleToLongBits(x));
+		buffer.putDouble(x);
 	}
 
 	public void writeFloat(float x) {
-		writeInt(Float.floatToIntBits(x));
+		buffer.putFloat(x);
+	}
+
+	// The bulk array methods copy the whole array in one bounded operation.
+	// They throw BufferOverflowException/BufferUnderflowException (and leave
+	// the message untouched) if the array does not fit in the message.
+
+	public void writeByteArray(byte[] x) {
+		buffer.put(x);
+	}
+
+	public void writeIntArray(int[] x) {
+		buffer.asIntBuffer().put(x);
+		skip(x.length * Integer.BYTES);
+	}
+
+	public void writeLongArray(long[] x) {
+		buffer.asLongBuffer().put(x);
+		skip(x.length * Long.BYTES);
+	}
+
+	public void writeDoubleArray(double[] x) {
+		buffer.asDoubleBuffer().put(x);
+		skip(x.length * Double.BYTES);
+	}
+
+	// Strings are written as a 32-bit length in bytes, followed by the
+	// UTF-8-encoded contents.
+	public void writeString(String x) {
+		byte[] bytes = x.getBytes(StandardCharsets.UTF_8);
+		if (buffer.remaining() < Integer.BYTES + bytes.length) {
+			throw new BufferOverflowException();
+		}
+		writeInt(bytes.length);
+		buffer.put(bytes);
 	}
 
 	public int readInt(int minValue, int maxValue) {
@@ -64,27 +144,157 @@ public class Message {
 		return x;
 	}
 
-	public native int readByte();
-	public native short readShort();
-	public native int readInt();
-	public native long readLong();
+	public int readByte() {
+		return buffer.get();
+	}
+
+	public short readShort() {
+		return buffer.getShort();
+	}
+
+	public int readInt() {
+		return buffer.getInt();
+	}
+
+	public long readLong() {
+		return buffer.getLong();
+	}
 
 	public char readChar() {
 		return (char)readByte();
 	}
 
 	public double readDouble() {
-		return Double.longBitsToDouble(readLong());
+		return buffer.getDouble();
 	}
 
 	public float readFloat() {
-		return Float.intBitsToFloat(readInt());
+		return buffer.getFloat();
 	}
 
 	public boolean readBool() {
 		return readByte() != 0;
 	}
 
-	private native long nativeInit(long interfacePtr) throws IOException;
-	private native void nativeFinalize(long messagePtr);
+	public byte[] readByteArray(int length) {
+		return readByteArray(new byte[length]);
+	}
+
+	public byte[] readByteArray(byte[] x) {
+		buffer.get(x);
+		return x;
+	}
+
+	public int[] readIntArray(int length) {
+		return readIntArray(new int[length]);
+	}
+
+	public int[] readIntArray(int[] x) {
+		buffer.asIntBuffer().get(x);
+		skip(x.length * Integer.BYTES);
+		return x;
+	}
+
+	// The range-checked array reads validate every element against [minValue,
+	// maxValue] in native code while copying, and throw
+	// IllegalArgumentException naming the first offending index. The array is
+	// consumed from the message either way.
+
+	public int[] readIntArray(int length, int minValue, int maxValue) {
+		return readIntArray(new int[length], minValue, maxValue);
+	}
+
+	public int[] readIntArray(int[] x, int minValue, int maxValue) {
+		int res = nativeReadIntArray(messagePtr, buffer.position(), x,
+				minValue, maxValue);
+		if (res == ARRAY_UNDERFLOW) {
+			throw new BufferUnderflowException();
+		}
+		skip(x.length * Integer.BYTES);
+		if (res != ARRAY_IN_RANGE) {
+			throw outOfRange(res, minValue, maxValue);
+		}
+		return x;
+	}
+
+	public long[] readLongArray(int length) {
+		return readLongArray(new long[length]);
+	}
+
+	public long[] readLongArray(long[] x) {
+		buffer.asLongBuffer().get(x);
+		skip(x.length * Long.BYTES);
+		return x;
+	}
+
+	public long[] readLongArray(int length, long minValue, long maxValue) {
+		return readLongArray(new long[length], minValue, maxValue);
+	}
+
+	public long[] readLongArray(long[] x, long minValue, long maxValue) {
+		int res = nativeReadLongArray(messagePtr, buffer.position(), x,
+				minValue, maxValue);
+		if (res == ARRAY_UNDERFLOW) {
+			throw new BufferUnderflowException();
+		}
+		skip(x.length * Long.BYTES);
+		if (res != ARRAY_IN_RANGE) {
+			throw outOfRange(res, minValue, maxValue);
+		}
+		return x;
+	}
+
+	public double[] readDoubleArray(int length) {
+		return readDoubleArray(new double[length]);
+	}
+
+	public double[] readDoubleArray(double[] x) {
+		buffer.asDoubleBuffer().get(x);
+		skip(x.length * Double.BYTES);
+		return x;
+	}
+
+	// Consumes nothing, not even the length, if the string does not fit in the
+	// message, like the ByteBuffer reads underneath.
+	public String readString() {
+		int start = buffer.position();
+		int length = readInt();
+		if (length < 0 || length > buffer.remaining()) {
+			buffer.position(start);
+			throw new BufferUnderflowException();
+		}
+		byte[] bytes = new byte[length];
+		buffer.get(bytes);
+		return new String(bytes, StandardCharsets.UTF_8);
+	}
+
+	private void skip(int bytes) {
+		buffer.position(buffer.position() + bytes);
+	}
+
+	// The native range-checked reads return ARRAY_IN_RANGE if every element
+	// was within range, ARRAY_UNDERFLOW if the array did not fit in the
+	// message, or the index of the first element that was out of range.
+	private static final int ARRAY_IN_RANGE = -1;
+	private static final int ARRAY_UNDERFLOW = -2;
+
+	private static IllegalArgumentException outOfRange(int index,
+			long minValue, long maxValue) {
+		return new IllegalArgumentException("Value at index " + index +
+				" outside of legal range: [" + minValue + ", " + maxValue +
+				"]");
+	}
+
+	private static native ByteBuffer nativeAllocate(long messagePtr, int msgid,
+			long bytes) throws IOException;
+	private native ByteBuffer nativeReceive(long messagePtr)
+			throws IOException;
+	private static native int nativeSend(long messagePtr) throws IOException;
+	private static native long nativeInit(long interfacePtr)
+			throws IOException;
+	private static native void nativeFinalize(long messagePtr);
+	private static native int nativeReadIntArray(long messagePtr,
+			int position, int[] x, int minValue, int maxValue);
+	private static native int nativeReadLongArray(long messagePtr,
+			int position, long[] x, long minValue, long maxValue);
 }
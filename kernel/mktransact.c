@@ -1,18 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include "transact.h"
 
 int main(int argc, char* argv[]) {
-	if (argc < 2) {
-		fprintf(stderr, "%s <path>\n", argv[0]);
+	int minor = 0;
+	const char* path = argv[1];
+
+	// With -c, creates the control node used to create anonymous pairs instead.
+	if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+		minor = TRANSACT_CONTROL_MINOR;
+		path = argv[2];
+	}
+	if (argc < 2 || (minor == 0 && argv[1][0] == '-')) {
+		fprintf(stderr, "%s [-c] <path>\n", argv[0]);
 		return 1;
 	}
 
-	if (mknod(argv[1], S_IFCHR | 0666, makedev(TRANSACT_MAJOR, 0)) != 0) {
+	if (mknod(path, S_IFCHR | 0666, makedev(TRANSACT_MAJOR, minor)) != 0) {
 		perror("mknod");
 		return 1;
 	}
@@ -21,7 +31,7 @@ int main(int argc, char* argv[]) {
 	char* caller_uid = getenv("SUDO_UID");
 	char* caller_gid = getenv("SUDO_GID");
 	if (caller_uid && caller_gid) {
-		if (chown(argv[1], atoi(caller_uid), atoi(caller_gid)) != 0) {
+		if (chown(path, atoi(caller_uid), atoi(caller_gid)) != 0) {
 			perror("chown");
 			return 1;
 		}
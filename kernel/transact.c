@@ -7,20 +7,27 @@
 
 /* Standard headers for LKMs */
 #include <linux/module.h>  
+#include <linux/anon_inodes.h>
+#include <linux/compat.h>
 #include <linux/poll.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/cdev.h>
+#include <linux/file.h>
 #include <linux/kref.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/wait.h>
 #include <asm/current.h>
 
 #include "transact.h"
 
+#define CREATE_TRACE_POINTS
+#include "transact_trace.h"
+
 struct transact_ctx;
 struct transact_cdev;
 
@@ -28,6 +35,12 @@ struct transact_proc {
 	struct transact_ctx *ctx;
 	int index;
 	int initialized;
+	// Set when a non-blocking read has handed control over to the other
+	// process, and control has not been collected back yet.
+	int waiting;
+	// What this process handed over in its last switch. Only read by the
+	// other process while it has control.
+	struct transact_switch payload;
 };
 
 struct transact_ctx {
@@ -38,6 +51,12 @@ struct transact_ctx {
 	struct list_head contexts;
 	spinlock_t lock;
 	unsigned long ino;
+	// Lane 0 is the context of the transact file itself, and the others are
+	// opened through TRANSACT_IOC_OPEN_LANE.
+	int lane;
+	// Set for pairs created through TRANSACT_IOC_NEW_PAIR, which are not
+	// backed by a file. |ino| is then a unique id instead of an inode number.
+	int anonymous;
 	struct kref kref;
 	int current_child;
 	int count;
@@ -54,6 +73,9 @@ struct transact_cdev {
 };
 
 static struct transact_cdev g_cdev;
+static struct file_operations transact_fops;
+static struct file_operations transact_control_fops;
+static atomic64_t g_anonymous_id = ATOMIC64_INIT(0);
 
 static void transact_notify_death(struct transact_proc *p)
 {
@@ -67,11 +89,16 @@ static void transact_notify_death(struct transact_proc *p)
 	ctx->current_child = !p->index;
 	ctx->uncontested = 1;
 	spin_unlock_irq(&ctx->lock);
+	trace_transact_peer_death(ctx->ino, ctx->lane, ctx->anonymous,
+			p->index);
 
 	spin_lock_irq(&ctx->wqh.lock);
 	// Wake up other process, if waiting.
-	if (waitqueue_active(&ctx->wqh))
+	if (waitqueue_active(&ctx->wqh)) {
+		trace_transact_wakeup(ctx->ino, ctx->lane, ctx->anonymous,
+				!p->index);
 		wake_up_locked_poll(&ctx->wqh, POLLHUP);
+	}
 	spin_unlock_irq(&ctx->wqh.lock);
 }
 
@@ -88,11 +115,16 @@ static int transact_switch_locked(struct transact_proc *p)
 	}
 	ctx->current_child = !p->index;
 	spin_unlock_irq(&ctx->lock);
+	trace_transact_switch_enter(ctx->ino, ctx->lane, ctx->anonymous,
+			p->index);
 
 	spin_lock_irq(&ctx->wqh.lock);
 	// Wake up other process, if waiting.
-	if (waitqueue_active(&ctx->wqh))
+	if (waitqueue_active(&ctx->wqh)) {
+		trace_transact_wakeup(ctx->ino, ctx->lane, ctx->anonymous,
+				!p->index);
 		wake_up_locked_poll(&ctx->wqh, POLLIN);
+	}
 
 	// And sleep until it is our turn.
 	__add_wait_queue(&ctx->wqh, &wait);
@@ -114,19 +146,43 @@ static int transact_switch_locked(struct transact_proc *p)
 	__remove_wait_queue(&ctx->wqh, &wait);
 	__set_current_state(TASK_RUNNING);
 	spin_unlock_irq(&ctx->wqh.lock);
+	trace_transact_switch_exit(ctx->ino, ctx->lane, ctx->anonymous,
+			p->index, res);
 
 	return res;
 }
 
+static struct transact_ctx* transact_alloc_ctx(struct transact_cdev *dev,
+		unsigned long ino, int lane, int anonymous, gfp_t gfp)
+{
+	struct transact_ctx* ctx;
+
+	ctx = kzalloc(sizeof(struct transact_ctx), gfp);
+	if (ctx) {
+		kref_init(&ctx->kref);
+		ctx->current_child = -1;
+		ctx->dev = dev;
+		ctx->ino = ino;
+		ctx->lane = lane;
+		ctx->anonymous = anonymous;
+		spin_lock_init(&ctx->lock);
+		init_waitqueue_head(&ctx->wqh);
+		INIT_LIST_HEAD(&ctx->contexts);
+	}
+
+	return ctx;
+}
+
 static struct transact_ctx* transact_get_ctx(struct transact_cdev *dev,
-		unsigned long ino)
+		unsigned long ino, int lane, int anonymous)
 {
 	struct transact_ctx* ctx = NULL;
 
 	spin_lock_irq(&dev->lock);
 	// Try to get the context from the list of previously created contexts.
 	list_for_each_entry(ctx, &dev->ctx, contexts) {
-		if (ctx->ino == ino) {
+		if (ctx->ino == ino && ctx->lane == lane &&
+				ctx->anonymous == anonymous) {
 			// And increase the reference count in case another process tries to
 			// destroy it.
 			kref_get(&ctx->kref);
@@ -135,17 +191,9 @@ static struct transact_ctx* transact_get_ctx(struct transact_cdev *dev,
 		}
 	}
 	// There is no previously created context. Allocate a new one.
-	ctx = kmalloc(sizeof(struct transact_ctx), GFP_ATOMIC);
-	if (ctx) {
-		memset(ctx, 0, sizeof(struct transact_ctx));
-		kref_init(&ctx->kref);
-		ctx->current_child = -1;
-		ctx->dev = dev;
-		ctx->ino = ino;
-		spin_lock_init(&ctx->lock);
-		init_waitqueue_head(&ctx->wqh);
+	ctx = transact_alloc_ctx(dev, ino, lane, anonymous, GFP_ATOMIC);
+	if (ctx)
 		list_add(&ctx->contexts, &dev->ctx);
-	}
 	spin_unlock_irq(&dev->lock);
 
 	return ctx;
@@ -158,17 +206,18 @@ static void transact_release_ctx_locked(struct kref *ref)
 	kfree(ctx);
 }
 
-int transact_open(struct inode *inode, struct file *filp)
+// Joins one of the two slots of the context for |ino| and |lane|, and waits
+// for the other process to join it too.
+static struct transact_proc* transact_attach(struct transact_cdev *dev,
+		unsigned long ino, int lane, int anonymous)
 {
-	struct transact_cdev *dev;
 	struct transact_ctx *ctx;
 	struct transact_proc *p;
 	int current_child, res;
 
-	dev = container_of(inode->i_cdev, struct transact_cdev, cdev);
-	ctx = transact_get_ctx(dev, inode->i_ino);
+	ctx = transact_get_ctx(dev, ino, lane, anonymous);
 	if (!ctx) {
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 	}
 
 	spin_lock_irq(&ctx->lock);
@@ -179,7 +228,7 @@ int transact_open(struct inode *inode, struct file *filp)
 		kref_put(&ctx->kref, transact_release_ctx_locked);
 		spin_unlock_irq(&dev->lock);
 
-		return -EBUSY;
+		return ERR_PTR(-EBUSY);
 	}
 	current_child = ctx->count++;
 	spin_unlock_irq(&ctx->lock);
@@ -187,7 +236,6 @@ int transact_open(struct inode *inode, struct file *filp)
 	p = &ctx->child[current_child];
 	p->ctx = ctx;
 	p->index = current_child;
-	filp->private_data = p;
 
 	// Always wait for the other process. This is done to avoid a situation where
 	// the parent gets so far ahead of the child process, that it opens the
@@ -204,12 +252,93 @@ int transact_open(struct inode *inode, struct file *filp)
 
 		// If the other side is gone by now, return ENXIO so it is not confused
 		// with EBUSY above.
-		return res == -EDEADLK ? -ENXIO : res;
+		return ERR_PTR(res == -EDEADLK ? -ENXIO : res);
 	}
 
+	return p;
+}
+
+static void transact_detach(struct transact_proc *p)
+{
+	struct transact_ctx *ctx = p->ctx;
+
+	transact_notify_death(p);
+	spin_lock_irq(&ctx->dev->lock);
+	kref_put(&ctx->kref, transact_release_ctx_locked);
+	spin_unlock_irq(&ctx->dev->lock);
+}
+
+int transact_open(struct inode *inode, struct file *filp)
+{
+	struct transact_cdev *dev;
+	struct transact_proc *p;
+
+	dev = container_of(inode->i_cdev, struct transact_cdev, cdev);
+	if (iminor(inode) == TRANSACT_CONTROL_MINOR) {
+		// The control node only creates anonymous pairs. replace_fops() drops
+		// the module reference taken for the old fops, so take one for the new.
+		filp->private_data = dev;
+		replace_fops(filp, fops_get(&transact_control_fops));
+		return 0;
+	}
+	p = transact_attach(dev, inode->i_ino, 0, 0);
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+	filp->private_data = p;
+
 	return 0;
 }
 
+// A read on a file opened with O_NONBLOCK is split in two: the first one hands
+// control over to the other process and returns -EAGAIN, and a later one
+// (once poll reports POLLIN) collects it back. This allows a single process to
+// drive many contexts at once.
+static ssize_t transact_read_nonblock(struct transact_proc *p,
+		char __user *buf)
+{
+	struct transact_ctx *ctx = p->ctx;
+	__u64 data;
+
+	spin_lock_irq(&ctx->lock);
+	if (unlikely(ctx->uncontested)) {
+		spin_unlock_irq(&ctx->lock);
+		return 0;
+	}
+	if (!p->waiting) {
+		p->waiting = 1;
+		p->payload.flags = 0;
+		ctx->current_child = !p->index;
+		spin_unlock_irq(&ctx->lock);
+		trace_transact_switch_enter(ctx->ino, ctx->lane, ctx->anonymous,
+				p->index);
+
+		spin_lock_irq(&ctx->wqh.lock);
+		// Wake up other process, if waiting.
+		if (waitqueue_active(&ctx->wqh)) {
+			trace_transact_wakeup(ctx->ino, ctx->lane, ctx->anonymous,
+					!p->index);
+			wake_up_locked_poll(&ctx->wqh, POLLIN);
+		}
+		spin_unlock_irq(&ctx->wqh.lock);
+		spin_lock_irq(&ctx->lock);
+	}
+	if (ctx->uncontested) {
+		spin_unlock_irq(&ctx->lock);
+		return 0;
+	}
+	if (ctx->current_child != p->index) {
+		spin_unlock_irq(&ctx->lock);
+		return -EAGAIN;
+	}
+	p->waiting = 0;
+	data = ctx->token;
+	spin_unlock_irq(&ctx->lock);
+	trace_transact_switch_exit(ctx->ino, ctx->lane, ctx->anonymous,
+			p->index, 0);
+
+	return put_user(data, (__u64 __user *)buf) ? -EFAULT : sizeof(data);
+}
+
 ssize_t transact_read(struct file *filp, char __user *buf, size_t count,
 		loff_t *ppos)
 {
@@ -219,7 +348,10 @@ ssize_t transact_read(struct file *filp, char __user *buf, size_t count,
 
 	if (count < sizeof(data))
 		return -EINVAL;
+	if (filp->f_flags & O_NONBLOCK)
+		return transact_read_nonblock(p, buf);
 	spin_lock_irq(&p->ctx->lock);
+	p->payload.flags = 0;
 	res = transact_switch_locked(p);  // releases p->ctx->lock.
 	data = p->ctx->token;
 	if (unlikely(res == -EDEADLOCK)) {
@@ -261,6 +393,11 @@ ssize_t transact_write(struct file *filp, const char __user *buf, size_t count,
 	// Main has issued its first read call.
 	res = sizeof(data);
 	spin_lock_irq(&p->ctx->lock);
+	if (p->ctx->anonymous && p->ctx->lane == 0 && parent != (p->index == 0)) {
+		// The roles of anonymous pairs are fixed when they are created.
+		res = -EINVAL;
+		goto unlock;
+	}
 	if (parent) {
 		if (p->ctx->parent_initialized) {
 			res = -EINVAL;
@@ -274,7 +411,10 @@ ssize_t transact_write(struct file *filp, const char __user *buf, size_t count,
 			goto unlock;
 		}
 		p->ctx->child_initialized = 1;
-		if (!p->ctx->parent_initialized) {
+		// Anonymous pairs skip the rendezvous in transact_open(), so the
+		// child might also get here before the parent's first read.
+		if (!p->ctx->parent_initialized ||
+				p->ctx->current_child != p->index) {
 			int switch_res = transact_switch_locked(p);  // releases ctx->lock.
 			if (switch_res == -EDEADLOCK) {
 				res = 0;
@@ -298,15 +438,182 @@ out:
 	return res;
 }
 
-int transact_release(struct inode *inode, struct file *filp)
+static unsigned int transact_poll(struct file *filp, poll_table *wait)
 {
 	struct transact_proc *p = (struct transact_proc *)filp->private_data;
 	struct transact_ctx *ctx = p->ctx;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(filp, &ctx->wqh, wait);
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (ctx->uncontested)
+		mask |= POLLIN | POLLHUP;
+	else if (ctx->current_child == p->index)
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return mask;
+}
 
-	transact_notify_death(p);
-	spin_lock_irq(&ctx->dev->lock);
-	kref_put(&ctx->kref, transact_release_ctx_locked);
-	spin_unlock_irq(&ctx->dev->lock);
+// Switches like transact_read() does, but carries a small payload in each
+// direction so that tiny messages do not need to go through shared memory.
+static long transact_switch_inline(struct transact_proc *p,
+		struct transact_switch __user *arg)
+{
+	struct transact_ctx *ctx = p->ctx;
+	struct transact_switch payload;
+	int res;
+
+	if (copy_from_user(&payload, arg, sizeof(payload)))
+		return -EFAULT;
+	if ((payload.flags & TRANSACT_SWITCH_INLINE) &&
+			payload.len > TRANSACT_INLINE_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&ctx->lock);
+	p->payload = payload;
+	res = transact_switch_locked(p);  // releases ctx->lock.
+	if (unlikely(res == -EDEADLOCK))
+		return 0;
+	else if (unlikely(res < 0))
+		return res;
+
+	// The other process is waiting for its turn, so its payload is stable.
+	payload = ctx->child[!p->index].payload;
+	if (copy_to_user(arg, &payload, sizeof(payload)))
+		return -EFAULT;
+	return 1;
+}
+
+// Lanes are independent contexts that share the inode of a transact file, so
+// that each pair of threads in the two processes can take turns on its own.
+// Each one is paired up exactly like the file itself: both processes issue
+// TRANSACT_IOC_OPEN_LANE (which waits for the other one), and then the
+// handshake write on the returned file descriptor.
+static long transact_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct transact_proc *p = (struct transact_proc *)filp->private_data;
+	struct transact_proc *lane;
+	int fd;
+
+	if (cmd == TRANSACT_IOC_SWITCH)
+		return transact_switch_inline(p, (struct transact_switch __user *)arg);
+	if (cmd != TRANSACT_IOC_OPEN_LANE)
+		return -ENOTTY;
+	if (p->ctx->lane != 0 || arg < 1 || arg >= TRANSACT_MAX_LANES)
+		return -EINVAL;
+
+	lane = transact_attach(p->ctx->dev, p->ctx->ino, arg, p->ctx->anonymous);
+	if (IS_ERR(lane))
+		return PTR_ERR(lane);
+	fd = anon_inode_getfd("[transact]", &transact_fops, lane,
+			O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		transact_detach(lane);
+
+	return fd;
+}
+
+// Creates a connected pair of transact file descriptors, much like
+// socketpair(2) does. The first one belongs to the parent and the second one
+// to the child, and both still need the usual handshake write. Since there is
+// no rendezvous, the parent starts with control.
+static long transact_new_pair(struct transact_cdev *dev,
+		struct transact_pair __user *arg)
+{
+	struct transact_pair pair;
+	struct transact_ctx *ctx;
+	struct file *files[2] = {NULL, NULL};
+	int fds[2] = {-1, -1};
+	int i, res;
+
+	if (copy_from_user(&pair, arg, sizeof(pair)))
+		return -EFAULT;
+	if (pair.flags & ~(O_CLOEXEC | O_NONBLOCK))
+		return -EINVAL;
+
+	ctx = transact_alloc_ctx(dev, atomic64_inc_return(&g_anonymous_id), 0, 1,
+			GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->count = 2;
+	ctx->current_child = 0;
+	// One reference for each file.
+	kref_get(&ctx->kref);
+
+	for (i = 0; i < 2; i++) {
+		ctx->child[i].ctx = ctx;
+		ctx->child[i].index = i;
+	}
+	for (i = 0; i < 2; i++) {
+		fds[i] = get_unused_fd_flags(pair.flags & O_CLOEXEC);
+		if (fds[i] < 0) {
+			res = fds[i];
+			goto err;
+		}
+		files[i] = anon_inode_getfile("[transact]", &transact_fops,
+				&ctx->child[i], O_RDWR | (pair.flags & O_NONBLOCK));
+		if (IS_ERR(files[i])) {
+			res = PTR_ERR(files[i]);
+			files[i] = NULL;
+			goto err;
+		}
+	}
+
+	pair.fds[0] = fds[0];
+	pair.fds[1] = fds[1];
+	if (copy_to_user(arg, &pair, sizeof(pair))) {
+		res = -EFAULT;
+		goto err;
+	}
+	for (i = 0; i < 2; i++)
+		fd_install(fds[i], files[i]);
+
+	return 0;
+
+err:
+	for (i = 0; i < 2; i++) {
+		if (fds[i] >= 0)
+			put_unused_fd(fds[i]);
+		// Files drop their reference when released.
+		if (files[i]) {
+			fput(files[i]);
+		} else {
+			spin_lock_irq(&dev->lock);
+			kref_put(&ctx->kref, transact_release_ctx_locked);
+			spin_unlock_irq(&dev->lock);
+		}
+	}
+	return res;
+}
+
+static long transact_control_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct transact_cdev *dev = (struct transact_cdev *)filp->private_data;
+
+	if (cmd != TRANSACT_IOC_NEW_PAIR)
+		return -ENOTTY;
+	return transact_new_pair(dev, (struct transact_pair __user *)arg);
+}
+
+#ifdef CONFIG_COMPAT
+// TRANSACT_IOC_OPEN_LANE takes a plain number, but every other command takes
+// a pointer, which 32-bit processes pass in compat form.
+static long transact_compat_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	if (cmd != TRANSACT_IOC_OPEN_LANE)
+		arg = (unsigned long)compat_ptr(arg);
+	return transact_ioctl(filp, cmd, arg);
+}
+#endif
+
+int transact_release(struct inode *inode, struct file *filp)
+{
+	transact_detach((struct transact_proc *)filp->private_data);
 
 	return 0;
 }
@@ -316,9 +623,20 @@ static struct file_operations transact_fops = {
 	.open = transact_open,
 	.read = transact_read,
 	.write = transact_write,
+	.poll = transact_poll,
+	.unlocked_ioctl = transact_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = transact_compat_ioctl,
+#endif
 	.release = transact_release,
 };
 
+static struct file_operations transact_control_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = transact_control_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
 /* Initialize the LKM */
 __init int init_module()
 {
@@ -326,7 +644,7 @@ __init int init_module()
 	
 	memset(&g_cdev, 0, sizeof(g_cdev));
 	g_cdev.devnum = MKDEV(TRANSACT_MAJOR, 0);
-	err = register_chrdev_region(g_cdev.devnum, 1, "transact");
+	err = register_chrdev_region(g_cdev.devnum, TRANSACT_MINORS, "transact");
 	if (err < 0) {
 		printk(KERN_WARNING "Failed to allocate major/minor numbers\n");
 		return err;
@@ -337,7 +655,7 @@ __init int init_module()
 	g_cdev.cdev.ops = &transact_fops;
 	spin_lock_init(&g_cdev.lock);
 	INIT_LIST_HEAD(&g_cdev.ctx);
-	err = cdev_add(&g_cdev.cdev, g_cdev.devnum, 1);
+	err = cdev_add(&g_cdev.cdev, g_cdev.devnum, TRANSACT_MINORS);
 	if (err < 0) {
 		printk(KERN_WARNING "Failed to add cdev\n");
 		goto unregister;
@@ -346,14 +664,14 @@ __init int init_module()
   return 0;
 
 unregister:
-	unregister_chrdev_region(g_cdev.devnum, 1);
+	unregister_chrdev_region(g_cdev.devnum, TRANSACT_MINORS);
 	return err;
 }
 
 __exit void cleanup_module()
 {
 	cdev_del(&g_cdev.cdev);
-	unregister_chrdev_region(g_cdev.devnum, 1);
+	unregister_chrdev_region(g_cdev.devnum, TRANSACT_MINORS);
 }
 
 MODULE_AUTHOR("lhchavez");
@@ -1 +1,58 @@
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 #define TRANSACT_MAJOR 2038
+
+/*
+ * Minor 0 is used by the transact files themselves. Opening a file with minor
+ * TRANSACT_CONTROL_MINOR instead yields a control node, which only supports
+ * TRANSACT_IOC_NEW_PAIR.
+ */
+#define TRANSACT_CONTROL_MINOR 1
+#define TRANSACT_MINORS 2
+
+/*
+ * Opens lane |arg| (1 <= |arg| < TRANSACT_MAX_LANES) of a transact file, and
+ * returns a new file descriptor for it.
+ */
+#define TRANSACT_IOC_OPEN_LANE _IO(0xF6, 1)
+#define TRANSACT_MAX_LANES 64
+
+/*
+ * The argument of TRANSACT_IOC_SWITCH. Up to TRANSACT_INLINE_MAX bytes of
+ * payload can be carried along with each switch. |flags| is 0 when the switch
+ * carries no payload, in which case the other fields are meaningless.
+ */
+#define TRANSACT_INLINE_MAX 56
+#define TRANSACT_SWITCH_INLINE 1
+
+struct transact_switch {
+	__s32 msgid;
+	__u16 len;
+	__u16 flags;
+	__u8 data[TRANSACT_INLINE_MAX];
+};
+
+/*
+ * Same as a read, but hands |struct transact_switch| over to the other process
+ * and, once control comes back, overwrites it with whatever the other process
+ * handed over (which has no payload if the other process used a plain read).
+ * Returns 1 once control comes back, or 0 if the other process is gone.
+ */
+#define TRANSACT_IOC_SWITCH _IOWR(0xF6, 2, struct transact_switch)
+
+/*
+ * The argument of TRANSACT_IOC_NEW_PAIR. |flags| can contain O_CLOEXEC and
+ * O_NONBLOCK, which are applied to both new file descriptors.
+ */
+struct transact_pair {
+	__u32 flags;
+	/* Filled in with the parent's and the child's file descriptors. */
+	__s32 fds[2];
+};
+
+/*
+ * Issued on a control node: creates a connected pair of transact file
+ * descriptors that are not backed by any file, socketpair-style.
+ */
+#define TRANSACT_IOC_NEW_PAIR _IOWR(0xF6, 3, struct transact_pair)
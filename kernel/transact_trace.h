@@ -0,0 +1,89 @@
+/* transact_trace.h
+ *
+ * Tracepoints for the transact module. Each pair of processes is identified by
+ * the inode number of its transact file, its lane, and whether it is an
+ * anonymous pair, whose ids can coincide with inode numbers. Each side is
+ * identified by its index (0 for the first one to open the file).
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM transact
+
+#if !defined(_TRANSACT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRANSACT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(transact_proc_class,
+	TP_PROTO(unsigned long ino, int lane, int anonymous, int index),
+	TP_ARGS(ino, lane, anonymous, index),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, ino)
+		__field(int, lane)
+		__field(int, anonymous)
+		__field(int, index)
+	),
+
+	TP_fast_assign(
+		__entry->ino = ino;
+		__entry->lane = lane;
+		__entry->anonymous = anonymous;
+		__entry->index = index;
+	),
+
+	TP_printk("ino=%lu lane=%d anonymous=%d index=%d", __entry->ino,
+		__entry->lane, __entry->anonymous, __entry->index)
+);
+
+/* A process hands control over to its peer and starts waiting for it. */
+DEFINE_EVENT(transact_proc_class, transact_switch_enter,
+	TP_PROTO(unsigned long ino, int lane, int anonymous, int index),
+	TP_ARGS(ino, lane, anonymous, index)
+);
+
+/* The peer of |index| was sleeping and is being woken up. */
+DEFINE_EVENT(transact_proc_class, transact_wakeup,
+	TP_PROTO(unsigned long ino, int lane, int anonymous, int index),
+	TP_ARGS(ino, lane, anonymous, index)
+);
+
+/* The process at |index| closed the transact file or died. */
+DEFINE_EVENT(transact_proc_class, transact_peer_death,
+	TP_PROTO(unsigned long ino, int lane, int anonymous, int index),
+	TP_ARGS(ino, lane, anonymous, index)
+);
+
+/* A process got control back, or stopped waiting for it because of |res|. */
+TRACE_EVENT(transact_switch_exit,
+	TP_PROTO(unsigned long ino, int lane, int anonymous, int index, int res),
+	TP_ARGS(ino, lane, anonymous, index, res),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, ino)
+		__field(int, lane)
+		__field(int, anonymous)
+		__field(int, index)
+		__field(int, res)
+	),
+
+	TP_fast_assign(
+		__entry->ino = ino;
+		__entry->lane = lane;
+		__entry->anonymous = anonymous;
+		__entry->index = index;
+		__entry->res = res;
+	),
+
+	TP_printk("ino=%lu lane=%d anonymous=%d index=%d res=%d", __entry->ino,
+		__entry->lane, __entry->anonymous, __entry->index, __entry->res)
+);
+
+#endif /* _TRANSACT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE transact_trace
+#include <trace/define_trace.h>
@@ -33,12 +33,30 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
 #include <memory>
 
 namespace {
@@ -76,6 +94,11 @@ class ScopedFD {
   DISALLOW_COPY_AND_ASSIGN(ScopedFD);
 };
 
+struct FreeDeleter {
+  void operator()(void* p) const { free(p); }
+};
+
+// The block header of TRANSACT_FORMAT_LEGACY.
 struct Message {
   ptrdiff_t next;
   size_t blocks_len;
@@ -86,282 +109,3588 @@ struct Message {
 
 static_assert(sizeof(Message) == 64, "Invalid Message size");
 
+// The block header of TRANSACT_FORMAT_COMPACT. Offsets and lengths are 32-bit,
+// and the free bit is packed with the length, so that a single block can hold
+// up to 48 bytes of payload.
+struct CompactMessage {
+  static constexpr uint32_t kNone = static_cast<uint32_t>(-1);
+
+  uint32_t next;
+  uint32_t blocks_len : 31;
+  uint32_t free : 1;
+  int32_t msgid;
+  uint32_t reserved;
+  char data[48];
+};
+
+static_assert(sizeof(CompactMessage) == 64, "Invalid CompactMessage size");
+
 struct MessageHeader {
   volatile ptrdiff_t current_msg_offset;
   volatile ptrdiff_t free_offset;
   volatile ptrdiff_t small_message_list;
   volatile ptrdiff_t large_message_list;
-  char padding[32];
+  // Written by the parent on open, so that the child can pick the same block
+  // format.
+  volatile uint32_t format;
+  // Written by the parent on open, so that the child can pin itself to the
+  // CPUs that were chosen for it (see transact_placement_info).
+  volatile int32_t placement;
+  volatile int32_t placement_cpu[2];
+  volatile int32_t placement_node;
+  // Written by the parent on open. The region is split into |lanes|
+  // partitions of |lane_blocks| blocks each, every one of which starts with
+  // its own header. Only the first header has the fields above.
+  volatile uint32_t lanes;
+  volatile uint32_t lane_blocks;
+  // A combination of kFeature* bits, one written by each side.
+  volatile uint32_t features;
 
   Message root[0];
 };
 
 static_assert(sizeof(MessageHeader) == 64, "Invalid MessageHeader size");
 
-}  // namespace
+// Accessors for the fields that are not stored identically in all block
+// formats. A next offset of -1 marks the end of a free list.
+inline ptrdiff_t NextOffset(const Message* msg) {
+  return msg->next;
+}
 
-inline void* operator new(size_t len) {
-  return malloc(len);
+inline ptrdiff_t NextOffset(const CompactMessage* msg) {
+  return msg->next == CompactMessage::kNone ? static_cast<ptrdiff_t>(-1)
+                                            : msg->next;
 }
 
-inline void operator delete(void* p) {
-  free(p);
+inline void SetNextOffset(Message* msg, ptrdiff_t next) {
+  msg->next = next;
 }
 
-struct transact_interface {
-  ScopedFD transact_fd;
-  ScopedFD shm_fd;
-  size_t blocks_len;
-  MessageHeader* shm = reinterpret_cast<MessageHeader*>(-1);
+inline void SetNextOffset(CompactMessage* msg, ptrdiff_t next) {
+  msg->next = next == static_cast<ptrdiff_t>(-1) ? CompactMessage::kNone
+                                                 : static_cast<uint32_t>(next);
+}
 
-  ~transact_interface() {
-    if (shm == reinterpret_cast<MessageHeader*>(-1))
-      return;
-    munmap(shm, blocks_len * sizeof(Message));
-  }
+// Mirrors struct transact_switch from kernel/transact.h: a message that is
+// carried by the switch itself instead of living in shared memory.
+struct InlinePayload {
+  static constexpr size_t kCapacity = 56;
+  static constexpr uint16_t kInline = 1;
+
+  int32_t msgid;
+  uint16_t len;
+  uint16_t flags;
+  char data[kCapacity];
 };
 
-static void MessageInitialize(struct transact_message* message, Message* msg) {
-  if (!message)
-    return;
+static_assert(sizeof(InlinePayload) == 64, "Invalid InlinePayload size");
 
-  if (!msg) {
-    message->method_id = 0;
-    message->message = nullptr;
-    message->data = message->end = nullptr;
-    return;
-  }
+// Mirrors struct transact_pair from kernel/transact.h.
+struct TransactPair {
+  uint32_t flags;
+  int32_t fds[2];
+};
 
-  message->message = msg;
-  message->method_id = msg->msgid;
-  message->data = msg->data;
-  message->end = reinterpret_cast<char*>(msg + msg->blocks_len);
+// Mirror the ioctls in kernel/transact.h.
+#define TRANSACT_IOC_OPEN_LANE _IO(0xF6, 1)
+#define TRANSACT_IOC_SWITCH _IOWR(0xF6, 2, InlinePayload)
+#define TRANSACT_IOC_NEW_PAIR _IOWR(0xF6, 3, TransactPair)
+
+// Set in MessageHeader::features by a side that switches through
+// TRANSACT_IOC_SWITCH, and can therefore receive inline messages.
+constexpr uint32_t kFeatureInlineParent = 1;
+constexpr uint32_t kFeatureInlineChild = 2;
+
+// Set in MessageHeader::features by a parent that declared idempotent
+// methods. They are listed in the first block of the arena of the first lane,
+// whose msgid is kIdempotentMethodsId.
+constexpr uint32_t kFeatureIdempotentMethods = 4;
+constexpr int kIdempotentMethodsId = -1;
+
+// Set in MessageHeader::features by a parent that shares a read-only segment.
+// Its SegmentHandle is published in the first block of the arena of the first
+// lane, whose msgid is kSegmentId, ahead of the idempotent methods.
+constexpr uint32_t kFeatureSegment = 8;
+constexpr int kSegmentId = -2;
+
+// Set in MessageHeader::features by a side that can take replies written into
+// the block of its own request (see transact_message_reply()).
+constexpr uint32_t kFeatureReplyInPlaceParent = 16;
+constexpr uint32_t kFeatureReplyInPlaceChild = 32;
+
+// Set in MessageHeader::features by a parent that keeps a turn timeline (see
+// transact_timeline_header) right after the last lane. Every lane is then
+// followed by its own header block, even if there is only one.
+constexpr uint32_t kFeatureTimeline = 64;
+
+// Where the child can find the read-only segment of the parent.
+struct SegmentHandle {
+  int32_t pid;
+  // The parent's own copy of the descriptor, to be reopened through /proc.
+  int32_t fd;
+  uint64_t len;
+  // Identifies the file, so that the child can tell whether the descriptor it
+  // ends up with is the one the parent meant.
+  uint64_t dev;
+  uint64_t ino;
+  // The descriptor the parent was handed in transact_options::segment_fd,
+  // which the child might have inherited with the same number.
+  int32_t inherited_fd;
+  int32_t reserved;
+};
+
+// The seals that guarantee that a segment never changes under the child.
+constexpr int kSegmentSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+// Set in transact_message::flags for messages created with
+// transact_message_prepare().
+constexpr int kMessagePrepared = 1;
+
+// Set in transact_message::flags for messages that point to an InlinePayload
+// instead of a block in shared memory.
+constexpr int kMessageInline = 2;
+
+// Set in transact_message::flags for messages created with
+// transact_message_allocate_stream(), whose block is reused for every chunk.
+constexpr int kMessageStream = 4;
+
+// Set in transact_message::flags for a received chunk of a streamed message
+// that is followed by more chunks.
+constexpr int kMessageMoreChunks = 8;
+
+// Set in transact_message::flags for messages that point to an answer in the
+// response cache instead of a block in shared memory.
+constexpr int kMessageCached = 16;
+
+// Set in transact_message::flags for replies written into the block of the
+// request they answer, which still belongs to the peer.
+constexpr int kMessageInPlace = 32;
+
+// Set in MessageHeader::current_msg_offset when the block it points to is a
+// chunk of a streamed message, which starts with a ChunkHeader. Peers that do
+// not know about streams reject such offsets as out of range.
+constexpr ptrdiff_t kChunkOffset = static_cast<ptrdiff_t>(1) << 62;
+
+// Set in MessageHeader::current_msg_offset when the sender keeps the block it
+// points to, so that the peer must not reply in place. Only sent to peers that
+// can take replies in place themselves, which know to strip it.
+constexpr ptrdiff_t kPinnedOffset = static_cast<ptrdiff_t>(1) << 61;
+
+// The start of the payload of every chunk of a streamed message.
+struct ChunkHeader {
+  // The number of payload bytes that follow the header in this chunk.
+  uint32_t len;
+  // Whether the sender will hand over another chunk once this one has been
+  // consumed.
+  uint32_t more;
+};
+
+static_assert(sizeof(ChunkHeader) == 8, "Invalid ChunkHeader size");
+
+// USDT probes, which bpftrace, perf and friends can attach to as
+// usdt:libtransact.so:transact:<name>. Each one is a single nop plus an ELF
+// note (laid out just like the ones <sys/sdt.h> emits) that describes where to
+// find its arguments, so they cost nothing while nothing is attached.
+#if defined(__x86_64__)
+#define TRANSACT_PROBE3(name, arg1, arg2, arg3)                               \
+  __asm__ __volatile__(                                                       \
+      "990: nop\n"                                                            \
+      ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+      ".balign 4\n"                                                           \
+      ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+      "991: .asciz \"stapsdt\"\n"                                             \
+      "992: .balign 4\n"                                                      \
+      "993: .8byte 990b\n"                                                    \
+      ".8byte _.stapsdt.base\n"                                               \
+      ".8byte 0\n"                                                            \
+      ".asciz \"transact\"\n"                                                 \
+      ".asciz \"" #name "\"\n"                                                \
+      ".asciz \"-8@%0 -8@%1 -8@%2\"\n"                                        \
+      "994: .balign 4\n"                                                      \
+      ".popsection\n"                                                         \
+      ".ifndef _.stapsdt.base\n"                                              \
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+      ".weak _.stapsdt.base\n"                                                \
+      ".hidden _.stapsdt.base\n"                                              \
+      "_.stapsdt.base: .space 1\n"                                            \
+      ".size _.stapsdt.base, 1\n"                                             \
+      ".popsection\n"                                                         \
+      ".endif\n"                                                              \
+      :                                                                       \
+      : "nor"(static_cast<int64_t>(arg1)), "nor"(static_cast<int64_t>(arg2)), \
+        "nor"(static_cast<int64_t>(arg3)))
+#else
+#define TRANSACT_PROBE3(name, arg1, arg2, arg3) \
+  do {                                          \
+  } while (0)
+#endif
+
+// The stack size of the child coroutine in TRANSACT_INPROCESS_COROUTINES mode.
+// It is only reserved, so pages are not used until they are touched.
+constexpr size_t kCoroutineStackSize = 64 * 1024 * 1024;
+
+#if defined(__x86_64__)
+#define HAVE_COROUTINES 1
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in |*from_sp| and resumes whatever was suspended at |to_sp|. Unlike
+// swapcontext(), this does not save the signal mask, so it never enters the
+// kernel.
+extern "C" void TransactSwapStack(void** from_sp, void* to_sp);
+
+// The first frame of a new coroutine: calls r13(r12) on an aligned stack.
+extern "C" void TransactCoroutineStart();
+
+asm(R"(
+  .text
+  .p2align 4
+  .type TransactSwapStack, @function
+TransactSwapStack:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size TransactSwapStack, .-TransactSwapStack
+
+  .p2align 4
+  .type TransactCoroutineStart, @function
+TransactCoroutineStart:
+  movq %r12, %rdi
+  andq $-16, %rsp
+  callq *%r13
+  ud2
+  .size TransactCoroutineStart, .-TransactCoroutineStart
+)");
+
+// Lays out a stack so that the first TransactSwapStack() into it calls
+// |fn|(|arg|), and returns the stack pointer to resume.
+void* PrepareCoroutineStack(void* stack,
+                            size_t len,
+                            void (*fn)(void*),
+                            void* arg) {
+  uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + len) & ~0xFULL;
+  void** sp = reinterpret_cast<void**>(top) - 7;
+  sp[0] = nullptr;                                    // r15
+  sp[1] = nullptr;                                    // r14
+  sp[2] = reinterpret_cast<void*>(fn);                // r13
+  sp[3] = arg;                                        // r12
+  sp[4] = nullptr;                                    // rbx
+  sp[5] = nullptr;                                    // rbp
+  sp[6] = reinterpret_cast<void*>(TransactCoroutineStart);  // return address
+  return sp;
 }
+#endif  // defined(__x86_64__)
 
-transact_interface* transact_interface_open(int is_parent,
-                                            const char* transact_filename,
-                                            const char* shm_filename,
-                                            size_t shm_len) {
-  std::unique_ptr<transact_interface> interface(new transact_interface());
+// The state shared by the two peers of transact_run_inprocess(). It plays the
+// role of the kernel module: exactly one peer runs at any given time, and a
+// peer that is gone wakes up the other one.
+class InProcessPair {
+ public:
+  InProcessPair(int mode) : mode_(mode) {}
 
-  if (!interface) {
-    errno = ENOMEM;
-    return nullptr;
+  int mode() const { return mode_; }
+
+  // Hands control over to the other peer and waits until it is |index|'s turn
+  // again. Returns 1 on success and 0 if the other peer is gone.
+  int Switch(int index) {
+    if (__atomic_load_n(&dead_[!index], __ATOMIC_ACQUIRE))
+      return 0;
+    started_ = true;
+    if (mode_ == TRANSACT_INPROCESS_COROUTINES) {
+      current_ = !index;
+      SwapTo(index);
+    } else {
+      __atomic_store_n(&current_, !index, __ATOMIC_RELEASE);
+      Wake();
+      WaitForTurn(index);
+    }
+    return __atomic_load_n(&dead_[!index], __ATOMIC_ACQUIRE) ? 0 : 1;
   }
 
-  interface->blocks_len = shm_len / sizeof(MessageHeader);
-  interface->transact_fd.reset(open(transact_filename, O_RDWR));
-  if (!interface->transact_fd)
-    return nullptr;
+  // Blocks a thread until it is |index|'s turn or the other peer is gone.
+  void WaitForTurn(int index) {
+    int current;
+    while ((current = __atomic_load_n(&current_, __ATOMIC_ACQUIRE)) != index &&
+           !__atomic_load_n(&dead_[!index], __ATOMIC_ACQUIRE)) {
+      syscall(SYS_futex, &current_, FUTEX_WAIT_PRIVATE, current, nullptr,
+              nullptr, 0);
+    }
+  }
 
-  // Make sure the child process waits until the parent issues a read() call.
-  {
-    unsigned long long handshake = is_parent;
-    ssize_t written = TEMP_FAILURE_RETRY(
-        write(interface->transact_fd.get(), &handshake, sizeof(handshake)));
-		if (written == 0)
-			errno = EPIPE;
-    if (written != sizeof(handshake))
-      return nullptr;
+  // Marks |index| as gone, and gives the turn to the other peer so that it
+  // notices.
+  void NotifyDeath(int index) {
+    __atomic_store_n(&dead_[index], 1, __ATOMIC_RELEASE);
+    if (mode_ == TRANSACT_INPROCESS_THREADS) {
+      __atomic_store_n(&current_, !index, __ATOMIC_RELEASE);
+      Wake();
+    }
   }
 
-  interface->shm_fd.reset(open(shm_filename, O_RDWR));
-  if (!interface->shm_fd)
-    return nullptr;
-  if (is_parent && ftruncate(interface->shm_fd.get(), shm_len) == -1)
-    return nullptr;
-  interface->shm = reinterpret_cast<MessageHeader*>(
-      mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED,
-           interface->shm_fd.get(), 0));
-  if (interface->shm == reinterpret_cast<MessageHeader*>(-1))
-    return nullptr;
-  if (is_parent) {
-    interface->shm->free_offset = 0;
-    interface->shm->small_message_list = static_cast<ptrdiff_t>(-1);
-    interface->shm->large_message_list = static_cast<ptrdiff_t>(-1);
+  bool dead(int index) const {
+    return __atomic_load_n(&dead_[index], __ATOMIC_ACQUIRE);
   }
-  return interface.release();
-}
 
-void transact_interface_close(struct transact_interface* interface) {
-	if (!interface)
-		return;
-  delete interface;
-}
+  // Whether the parent has handed control over at least once. Only
+  // meaningful while the child is waiting for its first turn.
+  bool started() const { return started_; }
 
-struct transact_message* transact_message_new() {
-  struct transact_message* message = new transact_message();
-  if (!message)
-    errno = ENOMEM;
-  return message;
-}
+  // Suspends the coroutine |index| and resumes the other one.
+  void SwapTo(int index) {
+#if defined(HAVE_COROUTINES)
+    TransactSwapStack(&sp_[index], sp_[!index]);
+#endif
+  }
 
-void transact_message_free(struct transact_message* message) {
-  if (!message)
-    return;
-  delete message;
-}
+  void set_sp(int index, void* sp) { sp_[index] = sp; }
 
-int transact_message_init(struct transact_interface* interface,
-                          struct transact_message* message) {
-  if (!interface) {
-    errno = EFAULT;
-    return -1;
+ private:
+  void Wake() {
+    syscall(SYS_futex, &current_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
   }
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+
+  const int mode_;
+  int current_ = 0;
+  int dead_[2] = {0, 0};
+  bool started_ = false;
+  void* sp_[2] = {nullptr, nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(InProcessPair);
+};
+
+// The highest NUMA node that can be bound to.
+constexpr int kMaxNode = 1023;
+
+// Reads a sysfs list of CPUs or nodes, such as "0-3,8,10-11", into |set|.
+bool ReadCpuList(const char* path, cpu_set_t* set) {
+  char buf[4096];
+  ScopedFD fd(open(path, O_RDONLY | O_CLOEXEC));
+  if (!fd)
+    return false;
+  ssize_t len = TEMP_FAILURE_RETRY(read(fd.get(), buf, sizeof(buf) - 1));
+  if (len <= 0)
+    return false;
+  buf[len] = '\0';
+
+  CPU_ZERO(set);
+  char* p = buf;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10), last = first;
+    if (*p == '-')
+      last = strtol(p + 1, &p, 10);
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    if (*p == ',')
+      p++;
   }
+  return true;
+}
 
-  memset(message, 0, sizeof(*message));
-  message->interface = interface;
-  return 0;
+bool NodeCpus(int node, cpu_set_t* set) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  return ReadCpuList(path, set);
 }
 
-int transact_message_allocate(struct transact_message* message,
-                              int id,
-                              size_t len) {
-  if (!message) {
-    errno = EFAULT;
+// Returns the NUMA node |cpu| belongs to, or -1 if the kernel does not report
+// one.
+int CpuNode(int cpu) {
+  cpu_set_t nodes, cpus;
+  if (!ReadCpuList("/sys/devices/system/node/online", &nodes))
     return -1;
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    if (CPU_ISSET(node, &nodes) && NodeCpus(node, &cpus) &&
+        CPU_ISSET(cpu, &cpus)) {
+      return node;
+    }
   }
+  return -1;
+}
 
-  len += 32;                   // For the page header.
-  len += (~(len - 1) & 0x3F);  // Align to blocks.
-  size_t blocks = len / sizeof(Message);
-
-  ptrdiff_t head = blocks == 1 ? message->interface->shm->small_message_list
-                               : message->interface->shm->large_message_list;
-  ptrdiff_t next = head;
-  ptrdiff_t prev_next = message->interface->blocks_len + 1;
-
-  // Try to reuse an old allocation.
-  while (next != static_cast<ptrdiff_t>(-1)) {
-    // The messages form a linked list that goes backwards. If any next pointer
-    // lies outside of the legal values, or it does not appear before in the
-    // shared memory region, it is definitely invalid.
-    if (next < 0 || next >= message->interface->blocks_len ||
-        next >= prev_next) {
-      errno = EINVAL;
-      return -1;
+// Reads the CPUs that share the highest level of cache with |cpu|.
+bool LastLevelCacheCpus(int cpu, cpu_set_t* set) {
+  char path[96];
+  int best_index = -1, best_level = 0;
+  for (int index = 0;; index++) {
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+    cpu_set_t level;
+    if (!ReadCpuList(path, &level))
+      break;
+    // The level is a single number, so it is the only CPU in the set.
+    for (int l = best_level + 1; l < 16; l++) {
+      if (CPU_ISSET(l, &level)) {
+        best_index = index;
+        best_level = l;
+      }
     }
-    Message* prev = message->interface->shm->root + next;
-    if (prev->free && prev->blocks_len == blocks) {
-      prev->free = 0;
-      prev->msgid = id;
-      MessageInitialize(message, prev);
-      return 0;
+  }
+  if (best_index == -1)
+    return false;
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu,
+           best_index);
+  return ReadCpuList(path, set);
+}
+
+// Returns the lowest CPU in |candidates| that is also in |allowed| and not in
+// |exclude|, or -1 if there is none.
+int PickCpu(const cpu_set_t& candidates,
+            const cpu_set_t& allowed,
+            const cpu_set_t& exclude) {
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &candidates) && CPU_ISSET(cpu, &allowed) &&
+        !CPU_ISSET(cpu, &exclude)) {
+      return cpu;
     }
-    prev_next = next;
-    next = prev->next;
   }
+  return -1;
+}
 
-  // Sanity check.
-  ptrdiff_t free_offset = message->interface->shm->free_offset;
-  if (free_offset < 0 || free_offset >= message->interface->blocks_len) {
+// Chooses the CPUs for both peers according to |policy|, falling back to the
+// next looser policy whenever the topology cannot satisfy it.
+bool ChoosePlacement(int policy, int cpu, transact_placement_info* info) {
+  info->placement = TRANSACT_PLACEMENT_NONE;
+  info->parent_cpu = info->child_cpu = info->node = -1;
+  if (policy == TRANSACT_PLACEMENT_NONE)
+    return true;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return false;
+  if (cpu == -1 && (cpu = sched_getcpu()) == -1)
+    return false;
+  if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
     errno = EINVAL;
-    return -1;
+    return false;
   }
 
-  // Need to perform allocation.
-  if (message->interface->blocks_len < free_offset + blocks) {
-    errno = ENOMEM;
-    return -1;
+  char path[96];
+  cpu_set_t siblings;
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  if (!ReadCpuList(path, &siblings)) {
+    CPU_ZERO(&siblings);
+    CPU_SET(cpu, &siblings);
   }
+  info->node = CpuNode(cpu);
 
-  Message* ptr = message->interface->shm->root + free_offset;
-  ptr->next = head;
-  ptr->blocks_len = blocks;
-  ptr->free = 0;
-  ptr->msgid = id;
-  if (blocks == 1) {
-    message->interface->shm->small_message_list = free_offset;
+  if (policy == TRANSACT_PLACEMENT_SHARED_CORE) {
+    cpu_set_t self;
+    CPU_ZERO(&self);
+    CPU_SET(cpu, &self);
+    int child_cpu = PickCpu(siblings, allowed, self);
+    if (child_cpu != -1) {
+      info->placement = policy;
+      info->parent_cpu = cpu;
+      info->child_cpu = child_cpu;
+      return true;
+    }
+    policy = TRANSACT_PLACEMENT_SHARED_CACHE;
+  }
+  if (policy == TRANSACT_PLACEMENT_SHARED_CACHE) {
+    cpu_set_t cache;
+    int child_cpu = -1;
+    if (LastLevelCacheCpus(cpu, &cache))
+      child_cpu = PickCpu(cache, allowed, siblings);
+    if (child_cpu != -1) {
+      info->placement = policy;
+      info->parent_cpu = cpu;
+      info->child_cpu = child_cpu;
+      return true;
+    }
+    policy = TRANSACT_PLACEMENT_SAME_NODE;
+  }
+  if (info->node != -1)
+    info->placement = TRANSACT_PLACEMENT_SAME_NODE;
+  return true;
+}
+
+// Pins the calling thread to the CPUs |info| chose for peer |index|.
+bool ApplyPlacement(const transact_placement_info& info, int index) {
+  cpu_set_t cpus;
+  if (info.placement == TRANSACT_PLACEMENT_NONE)
+    return true;
+  if (info.placement == TRANSACT_PLACEMENT_SAME_NODE) {
+    if (!NodeCpus(info.node, &cpus))
+      return false;
   } else {
-    message->interface->shm->large_message_list = free_offset;
+    CPU_ZERO(&cpus);
+    CPU_SET(index == 0 ? info.parent_cpu : info.child_cpu, &cpus);
   }
-  message->interface->shm->free_offset = free_offset + blocks;
+  return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
 
-  MessageInitialize(message, ptr);
-  return 0;
+// Binds the pages of the shared memory region to |node|, moving the ones that
+// were already faulted in elsewhere. Kernels without NUMA support accept any
+// placement.
+bool BindMemory(void* addr, size_t len, int node) {
+  constexpr size_t kBitsPerLong = 8 * sizeof(unsigned long);
+  unsigned long nodemask[(kMaxNode + 1) / kBitsPerLong] = {};
+  if (node < 0 || node > kMaxNode)
+    return true;
+  nodemask[node / kBitsPerLong] = 1UL << (node % kBitsPerLong);
+  if (syscall(SYS_mbind, addr, len, MPOL_BIND, nodemask, kMaxNode + 1,
+              MPOL_MF_MOVE) == -1 &&
+      errno != ENOSYS) {
+    return false;
+  }
+  return true;
 }
 
-int transact_message_recv(struct transact_message* message) {
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+// The initial size of a message log. It doubles every time it fills up.
+constexpr size_t kInitialLogSize = 1024 * 1024;
+
+inline size_t LogRecordSize(uint32_t payload_len) {
+  return sizeof(transact_log_record) + ((payload_len + 7) & ~7ULL);
+}
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Appends every message sent through an interface to a memory-mapped log
+// (see transact_log_header).
+class Recorder {
+ public:
+  Recorder() = default;
+
+  ~Recorder() {
+    if (base_) {
+      munmap(base_, capacity_);
+      // Drop the unused tail of the last growth step.
+      ftruncate(fd_.get(), len_);
+    }
   }
 
-  ptrdiff_t offset = message->interface->shm->current_msg_offset;
-  if (offset < 0 || offset >= message->interface->blocks_len) {
-    errno = EMSGSIZE;
-    return -1;
+  bool Open(const char* filename, int is_parent) {
+    fd_.reset(open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd_ || !Reserve(sizeof(transact_log_header)))
+      return false;
+    transact_log_header* header =
+        reinterpret_cast<transact_log_header*>(base_);
+    memcpy(header->magic, TRANSACT_LOG_MAGIC, sizeof(header->magic));
+    header->version = TRANSACT_LOG_VERSION;
+    header->is_parent = is_parent;
+    header->records = 0;
+    len_ = sizeof(transact_log_header);
+    return true;
   }
-  MessageInitialize(message, message->interface->shm->root + offset);
-  return 0;
-}
 
-int transact_message_send(struct transact_message* message) {
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+  // Appends a record for a message that is about to be sent. The record only
+  // counts once it has been completely written.
+  bool Append(int msgid, const char* payload, uint32_t payload_len) {
+    stream_ = false;
+    if (!Start(msgid, 0, 0) || !Write(payload, payload_len))
+      return false;
+    Commit();
+    return true;
   }
 
-  message->interface->shm->current_msg_offset =
-      reinterpret_cast<Message*>(message->message) -
-      message->interface->shm->root;
-  unsigned long long response;
-  ssize_t read_bytes = TEMP_FAILURE_RETRY(
-      read(message->interface->transact_fd.get(), &response, sizeof(response)));
-  if (read_bytes == 0)
-    return 0;
-  if (read_bytes != sizeof(response))
-    return -1;
-  reinterpret_cast<Message*>(message->message)->free = 1;
-  MessageInitialize(message, nullptr);
-  return 1;
-}
+  // Appends the payload of a chunk of a streamed message that is about to be
+  // sent. The whole stream is recorded as a single message, which only counts
+  // once its |last| chunk has been written.
+  bool AppendChunk(int msgid,
+                   const char* payload,
+                   uint32_t payload_len,
+                   uint32_t chunk_len,
+                   bool last) {
+    if (!stream_ && !Start(msgid, TRANSACT_LOG_RECORD_STREAM, chunk_len))
+      return false;
+    stream_ = !last;
+    if (!Write(payload, payload_len))
+      return false;
+    if (last)
+      Commit();
+    return true;
+  }
 
-ssize_t transact_message_read(struct transact_message* message,
-                              void* target,
-                              size_t len) {
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+  // Drops whatever was recorded of a stream that was never finished.
+  void DropStream() { stream_ = false; }
+
+  // Marks the time at which control came back after the last message.
+  // Control also comes back between the chunks of a stream, which do not
+  // count.
+  void Resumed() {
+    if (stream_)
+      return;
+    reinterpret_cast<transact_log_record*>(base_ + last_)->resumed_ns =
+        NowNs();
   }
 
-  if (message->data + len > message->end)
-    return 0;
-  memcpy(target, message->data, len);
-  message->data += len;
-  return len;
-}
+ private:
+  bool Reserve(size_t len) {
+    if (len <= capacity_)
+      return true;
+    size_t capacity = capacity_ ? capacity_ : kInitialLogSize;
+    while (capacity < len)
+      capacity *= 2;
+    if (ftruncate(fd_.get(), capacity) == -1)
+      return false;
+    void* base = base_ ? mremap(base_, capacity_, capacity, MREMAP_MAYMOVE)
+                       : mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd_.get(), 0);
+    if (base == MAP_FAILED)
+      return false;
+    base_ = reinterpret_cast<char*>(base);
+    capacity_ = capacity;
+    return true;
+  }
 
-ssize_t transact_message_read_array(struct transact_message* message,
-                                    void** target,
-                                    size_t len) {
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+  // The record being written, right after the last one that counts.
+  transact_log_record* Pending() {
+    return reinterpret_cast<transact_log_record*>(base_ + len_);
   }
 
-  if (message->data + len > message->end)
-    return 0;
-  *target = reinterpret_cast<void*>(message->data);
-  message->data += len;
-  return len;
-}
+  bool Start(int msgid, uint32_t flags, uint32_t chunk_len) {
+    if (!Reserve(len_ + sizeof(transact_log_record)))
+      return false;
+    transact_log_record* record = Pending();
+    record->sent_ns = NowNs();
+    record->resumed_ns = 0;
+    record->msgid = msgid;
+    record->size = 0;
+    record->flags = flags;
+    record->chunk_len = chunk_len;
+    return true;
+  }
 
-ssize_t transact_message_write(struct transact_message* message,
-                               const void* source,
-                               size_t len) {
-  if (!message) {
-    errno = EFAULT;
-    return -1;
+  bool Write(const char* payload, uint32_t payload_len) {
+    uint64_t size = static_cast<uint64_t>(Pending()->size) + payload_len;
+    if (size > UINT32_MAX || !Reserve(len_ + LogRecordSize(size)))
+      return false;
+    transact_log_record* record = Pending();
+    memcpy(reinterpret_cast<char*>(record + 1) + record->size, payload,
+           payload_len);
+    record->size = size;
+    return true;
   }
 
-  if (message->data + len > message->end)
-    return 0;
-  memcpy(message->data, source, len);
-  message->data += len;
-  return len;
+  void Commit() {
+    last_ = len_;
+    len_ += LogRecordSize(Pending()->size);
+    reinterpret_cast<transact_log_header*>(base_)->records++;
+  }
+
+  ScopedFD fd_;
+  char* base_ = nullptr;
+  size_t capacity_ = 0;
+  size_t len_ = 0;
+  size_t last_ = 0;
+  // Whether a streamed message is being recorded.
+  bool stream_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(Recorder);
+};
+
+// A timestamp that is cheap enough to take on every switch.
+inline uint64_t Ticks() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return NowNs();
+#endif
+}
+
+// The length of a timeline with |entries| records.
+inline size_t TimelineLen(uint32_t entries) {
+  return sizeof(transact_timeline_header) +
+         entries * sizeof(transact_timeline_record);
+}
+
+// Whether |header| looks like a timeline that fits in |len| bytes.
+bool ValidTimeline(const transact_timeline_header& header, size_t len) {
+  return memcmp(header.magic, TRANSACT_TIMELINE_MAGIC,
+                sizeof(header.magic)) == 0 &&
+         header.version == TRANSACT_TIMELINE_VERSION &&
+         header.entries != 0 &&
+         header.entries <= TRANSACT_MAX_TIMELINE_ENTRIES &&
+         (header.entries & (header.entries - 1)) == 0 &&
+         TimelineLen(header.entries) <= len;
+}
+
+// Appends a record to the turn timeline in shared memory every time control
+// is handed over to the peer. Only one side runs at a time, so the two sides
+// never append concurrently; |seq| is written last so that a reader running
+// alongside them can tell whether a record is complete. The peer can scribble
+// over the header at any time, so the size of the ring is only ever taken
+// from the one |entries| it was validated with.
+class Timeline {
+ public:
+  Timeline(transact_timeline_header* header, uint32_t entries, int is_parent)
+      : header_(header),
+        records_(reinterpret_cast<transact_timeline_record*>(header + 1)),
+        mask_(entries - 1),
+        is_parent_(is_parent) {}
+
+  // Starts an empty timeline.
+  void Initialize() {
+    memset(header_, 0, TimelineLen(mask_ + 1));
+    memcpy(header_->magic, TRANSACT_TIMELINE_MAGIC, sizeof(header_->magic));
+    header_->version = TRANSACT_TIMELINE_VERSION;
+    header_->entries = mask_ + 1;
+    header_->start_ticks = Ticks();
+    header_->start_ns = NowNs();
+  }
+
+  // Appends a record for a message of |size| bytes that is about to be sent.
+  void Handoff(int msgid, uint32_t size) {
+    uint64_t count = header_->count;
+    last_ = &records_[count & mask_];
+    __atomic_store_n(&last_->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    last_->msgid = msgid;
+    last_->size = size;
+    last_->is_parent = is_parent_;
+    last_->wakeup_ticks = 0;
+    last_->handoff_ticks = Ticks();
+    __atomic_store_n(&last_->seq, static_cast<uint32_t>(count + 1),
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&header_->count, count + 1, __ATOMIC_RELEASE);
+  }
+
+  // Marks the time at which control came back after the last Handoff().
+  void Resumed() {
+    if (last_)
+      __atomic_store_n(&last_->wakeup_ticks, Ticks(), __ATOMIC_RELAXED);
+  }
+
+  void Close() {
+    header_->end_ticks = Ticks();
+    header_->end_ns = NowNs();
+  }
+
+ private:
+  transact_timeline_header* header_;
+  transact_timeline_record* const records_;
+  const uint32_t mask_;
+  int is_parent_;
+  transact_timeline_record* last_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(Timeline);
+};
+
+// Checks whether all of |src| lies within [|min|, |max|], copying it into
+// |dst| along the way unless it is NULL. These are the scalar fallbacks of the
+// vectorized versions below, which also finish off their tails.
+template <typename T>
+bool InRangeScalar(const T* src, T* dst, size_t count, T min, T max) {
+  bool in_range = true;
+  for (size_t i = 0; i < count; i++) {
+    T value = src[i];
+    if (dst)
+      dst[i] = value;
+    in_range &= (value >= min) & (value <= max);
+  }
+  return in_range;
+}
+
+#if defined(__x86_64__)
+// The widest vector instructions that the range checks can use.
+enum VectorLevel {
+  kVectorUnknown = 0,
+  kVectorScalar,
+  // SSE4.2, for the 64-bit comparisons.
+  kVectorSse,
+  kVectorAvx2,
+};
+
+int g_vector_level = kVectorUnknown;
+
+int DetectVectorLevel() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_2))
+    return kVectorScalar;
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return kVectorSse;
+  // The kernel must also be saving the AVX registers across context switches.
+  uint32_t xcr0_low, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0_low & 6) != 6 || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ||
+      !(ebx & bit_AVX2)) {
+    return kVectorSse;
+  }
+  return kVectorAvx2;
+}
+
+int VectorLevel() {
+  int level = __atomic_load_n(&g_vector_level, __ATOMIC_RELAXED);
+  if (level == kVectorUnknown) {
+    level = DetectVectorLevel();
+    __atomic_store_n(&g_vector_level, level, __ATOMIC_RELAXED);
+  }
+  return level;
+}
+
+__attribute__((target("avx2"))) bool InRangeAvx2(const int32_t* src,
+                                                 int32_t* dst,
+                                                 size_t count,
+                                                 int32_t min,
+                                                 int32_t max) {
+  __m256i low = _mm256_set1_epi32(INT32_MAX);
+  __m256i high = _mm256_set1_epi32(INT32_MIN);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    if (dst)
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+    low = _mm256_min_epi32(low, v);
+    high = _mm256_max_epi32(high, v);
+  }
+  int32_t lows[8], highs[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lows), low);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(highs), high);
+  bool in_range = true;
+  for (int lane = 0; lane < 8; lane++)
+    in_range &= (lows[lane] >= min) & (highs[lane] <= max);
+  return in_range &
+         InRangeScalar(src + i, dst ? dst + i : nullptr, count - i, min, max);
+}
+
+__attribute__((target("avx2"))) bool InRangeAvx2(const int64_t* src,
+                                                 int64_t* dst,
+                                                 size_t count,
+                                                 int64_t min,
+                                                 int64_t max) {
+  // There is no 64-bit min/max before AVX-512, so accumulate the lanes that
+  // fall outside of the range instead.
+  __m256i low = _mm256_set1_epi64x(min);
+  __m256i high = _mm256_set1_epi64x(max);
+  __m256i outside = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    if (dst)
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+    outside = _mm256_or_si256(
+        outside, _mm256_or_si256(_mm256_cmpgt_epi64(low, v),
+                                 _mm256_cmpgt_epi64(v, high)));
+  }
+  return _mm256_testz_si256(outside, outside) &
+         InRangeScalar(src + i, dst ? dst + i : nullptr, count - i, min, max);
+}
+
+__attribute__((target("sse4.2"))) bool InRangeSse(const int32_t* src,
+                                                  int32_t* dst,
+                                                  size_t count,
+                                                  int32_t min,
+                                                  int32_t max) {
+  __m128i low = _mm_set1_epi32(INT32_MAX);
+  __m128i high = _mm_set1_epi32(INT32_MIN);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (dst)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    low = _mm_min_epi32(low, v);
+    high = _mm_max_epi32(high, v);
+  }
+  int32_t lows[4], highs[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lows), low);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(highs), high);
+  bool in_range = true;
+  for (int lane = 0; lane < 4; lane++)
+    in_range &= (lows[lane] >= min) & (highs[lane] <= max);
+  return in_range &
+         InRangeScalar(src + i, dst ? dst + i : nullptr, count - i, min, max);
+}
+
+__attribute__((target("sse4.2"))) bool InRangeSse(const int64_t* src,
+                                                  int64_t* dst,
+                                                  size_t count,
+                                                  int64_t min,
+                                                  int64_t max) {
+  __m128i low = _mm_set1_epi64x(min);
+  __m128i high = _mm_set1_epi64x(max);
+  __m128i outside = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (dst)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    outside = _mm_or_si128(
+        outside, _mm_or_si128(_mm_cmpgt_epi64(low, v), _mm_cmpgt_epi64(v, high)));
+  }
+  return _mm_testz_si128(outside, outside) &
+         InRangeScalar(src + i, dst ? dst + i : nullptr, count - i, min, max);
+}
+#endif  // defined(__x86_64__)
+
+// Checks whether all of |src| lies within [|min|, |max|] in a single pass,
+// with the widest vector instructions the CPU has, copying it into |dst|
+// along the way unless it is NULL.
+template <typename T>
+bool InRange(const T* src, T* dst, size_t count, T min, T max) {
+#if defined(__x86_64__)
+  switch (VectorLevel()) {
+    case kVectorAvx2:
+      return InRangeAvx2(src, dst, count, min, max);
+    case kVectorSse:
+      return InRangeSse(src, dst, count, min, max);
+  }
+#endif
+  return InRangeScalar(src, dst, count, min, max);
+}
+
+// Returns the index of the first element of |values| outside of [|min|,
+// |max|]. Only used once a range check has already failed.
+template <typename T>
+size_t FirstOutOfRange(const T* values, size_t count, T min, T max) {
+  size_t i = 0;
+  while (i < count && values[i] >= min && values[i] <= max)
+    i++;
+  return i;
+}
+
+// Remembers the answers to requests for idempotent methods, so that repeated
+// requests can be answered without a round trip. Every request hashes to two
+// slots, and a new answer evicts the least recently used of them.
+class ResponseCache {
+ public:
+  struct Entry {
+    uint64_t hash;
+    int32_t request_id;
+    int32_t response_id;
+    uint32_t request_len;
+    uint32_t response_len;
+    uint64_t last_used;
+    size_t capacity;
+    // The request, immediately followed by the response.
+    char* data;
+  };
+
+  ResponseCache() = default;
+
+  ~ResponseCache() {
+    for (size_t i = 0; i < len_; i++)
+      free(entries_.get()[i].data);
+  }
+
+  bool Init(size_t len) {
+    entries_.reset(reinterpret_cast<Entry*>(calloc(len, sizeof(Entry))));
+    if (!entries_) {
+      errno = ENOMEM;
+      return false;
+    }
+    len_ = len;
+    return true;
+  }
+
+  bool SetMethods(const int32_t* methods, size_t len) {
+    if (len == 0)
+      return true;
+    methods_.reset(reinterpret_cast<int32_t*>(malloc(len * sizeof(int32_t))));
+    if (!methods_) {
+      errno = ENOMEM;
+      return false;
+    }
+    memcpy(methods_.get(), methods, len * sizeof(int32_t));
+    std::sort(methods_.get(), methods_.get() + len);
+    methods_len_ = len;
+    return true;
+  }
+
+  bool Idempotent(int method_id) const {
+    return methods_len_ && std::binary_search(methods_.get(),
+                                              methods_.get() + methods_len_,
+                                              method_id);
+  }
+
+  static uint64_t Hash(int method_id, const char* data, size_t len) {
+    constexpr uint64_t kMultiplier = 0xff51afd7ed558ccdULL;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ static_cast<uint32_t>(method_id) ^
+                    (static_cast<uint64_t>(len) << 32);
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, data, sizeof(word));
+      data += sizeof(word);
+      hash = (hash ^ word) * kMultiplier;
+      hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, len);
+    hash = (hash ^ tail) * kMultiplier;
+    return hash ^ (hash >> 29);
+  }
+
+  const Entry* Lookup(uint64_t hash,
+                      int method_id,
+                      const char* request,
+                      size_t len) {
+    for (int way = 0; way < 2; way++) {
+      Entry* entry = Slot(hash, way);
+      if (entry->data && entry->hash == hash &&
+          entry->request_id == method_id && entry->request_len == len &&
+          memcmp(entry->data, request, len) == 0) {
+        entry->last_used = ++clock_;
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  void Store(uint64_t hash,
+             int request_id,
+             const char* request,
+             size_t request_len,
+             int response_id,
+             const char* response,
+             size_t response_len) {
+    Entry* entry = Slot(hash, 0);
+    Entry* other = Slot(hash, 1);
+    if (other->last_used < entry->last_used)
+      entry = other;
+    size_t len = request_len + response_len;
+    if (entry->capacity < len) {
+      // A failure to grow only means one less cached answer.
+      char* data = reinterpret_cast<char*>(realloc(entry->data, len));
+      if (!data)
+        return;
+      entry->data = data;
+      entry->capacity = len;
+    }
+    entry->hash = hash;
+    entry->request_id = request_id;
+    entry->response_id = response_id;
+    entry->request_len = request_len;
+    entry->response_len = response_len;
+    entry->last_used = ++clock_;
+    memcpy(entry->data, request, request_len);
+    memcpy(entry->data + request_len, response, response_len);
+  }
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+ private:
+  Entry* Slot(uint64_t hash, int way) {
+    return &entries_.get()[(way ? hash >> 32 : hash) % len_];
+  }
+
+  std::unique_ptr<Entry, FreeDeleter> entries_;
+  size_t len_ = 0;
+  uint64_t clock_ = 0;
+  std::unique_ptr<int32_t, FreeDeleter> methods_;
+  size_t methods_len_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+};
+
+}  // namespace
+
+inline void* operator new(size_t len) {
+  return malloc(len);
+}
+
+inline void operator delete(void* p) {
+  free(p);
+}
+
+struct transact_interface {
+  ScopedFD transact_fd;
+  ScopedFD shm_fd;
+  // Kept around so that transact_interface_reset() can pair up again.
+  std::unique_ptr<char, FreeDeleter> transact_filename;
+  size_t blocks_len;
+  // The length of the whole mapping, which might span several lanes.
+  size_t shm_len = 0;
+  int is_parent = 0;
+  uint32_t format = TRANSACT_FORMAT_LEGACY;
+  MessageHeader* shm = reinterpret_cast<MessageHeader*>(-1);
+  int lanes = 1;
+  // The number of blocks in each lane, header included. Like |lanes|, it is
+  // only taken out of the region once, when the interface is opened: the
+  // peer is free to rewrite the copy in shared memory.
+  size_t lane_blocks = 0;
+  // Only set for interfaces created by transact_interface_open_lane(), which
+  // share the mapping of |owner|.
+  transact_interface* owner = nullptr;
+
+  // Whether every switch goes through TRANSACT_IOC_SWITCH, so that inline
+  // messages from the peer are never missed.
+  bool switch_inline = false;
+  // Whether control has been handed over since pairing up. The peer's first
+  // turn starts from the handshake, which cannot carry a payload.
+  bool switched = false;
+  // What the peer handed over in the last switch, if it was an inline
+  // message.
+  bool has_inline_in = false;
+  InlinePayload inline_in;
+  // The one inline message that can be in flight, and the message it was
+  // allocated for.
+  InlinePayload inline_out;
+  transact_message* inline_owner = nullptr;
+  std::unique_ptr<Recorder> recorder;
+  // Only set on the root interface of a region that keeps a turn timeline.
+  std::unique_ptr<Timeline> timeline;
+  // Where to append |stats| when the interface is closed, if anywhere.
+  std::unique_ptr<char, FreeDeleter> stats_filename;
+  transact_stats stats = {};
+  // The methods the parent declared idempotent, which it publishes again
+  // every time the arena is initialized.
+  std::unique_ptr<int32_t, FreeDeleter> idempotent_methods;
+  size_t idempotent_methods_len = 0;
+  // Only set on children that asked for a response cache.
+  std::unique_ptr<ResponseCache> cache;
+  // The answer to the last request, if it came from |cache|.
+  const ResponseCache::Entry* cached_in = nullptr;
+  // The block of the last request the peer replied to in place, which is
+  // released once the reply has been read, at the next send.
+  void* in_place_reply = nullptr;
+  // The number of messages that hold a block from transact_message_prepare(),
+  // which must all be released before the arena can start over.
+  size_t prepared_messages = 0;
+  // The read-only segment shared by the parent, if any.
+  ScopedFD segment_fd;
+  // The number of the descriptor |segment_fd| was duplicated from.
+  int inherited_segment_fd = -1;
+  void* segment = MAP_FAILED;
+  size_t segment_len = 0;
+  transact_placement_info placement = {TRANSACT_PLACEMENT_NONE, -1, -1, -1};
+
+  // Only set for interfaces created by transact_run_inprocess(), which owns
+  // both the pair and the shared memory region.
+  InProcessPair* pair = nullptr;
+  int index = 0;
+
+  ~transact_interface() {
+    if (pair) {
+      pair->NotifyDeath(index);
+      return;
+    }
+    if (owner)
+      return;
+    if (segment != MAP_FAILED)
+      munmap(segment, segment_len);
+    if (shm == reinterpret_cast<MessageHeader*>(-1))
+      return;
+    munmap(shm, shm_len);
+  }
+};
+
+static void InitializeHeader(MessageHeader* shm, int format) {
+  shm->free_offset = 0;
+  shm->small_message_list = static_cast<ptrdiff_t>(-1);
+  shm->large_message_list = static_cast<ptrdiff_t>(-1);
+  shm->format = format;
+}
+
+// Returns the header of lane |lane| within the region that starts at |shm|,
+// whose lanes are |lane_blocks| blocks long.
+static MessageHeader* LaneHeader(MessageHeader* shm,
+                                 size_t lane_blocks,
+                                 int lane) {
+  return reinterpret_cast<MessageHeader*>(reinterpret_cast<Message*>(shm) +
+                                          lane * lane_blocks);
+}
+
+// Initializes the allocator of every one of the |lanes| lanes of the region
+// that starts at |shm|, and publishes their layout for the child.
+static void InitializeLanes(MessageHeader* shm,
+                            int lanes,
+                            size_t lane_blocks,
+                            int format) {
+  shm->lanes = lanes;
+  shm->lane_blocks = lane_blocks;
+  for (int lane = 0; lane < lanes; lane++)
+    InitializeHeader(LaneHeader(shm, lane_blocks, lane), format);
+}
+
+// Returns the header that holds the fields shared by all lanes.
+static MessageHeader* RootHeader(struct transact_interface* interface) {
+  return interface->owner ? interface->owner->shm : interface->shm;
+}
+
+// Publishes whether |interface| can receive inline messages, so that the peer
+// only sends them when it is safe to do so.
+static void AdvertiseInline(struct transact_interface* interface) {
+  uint32_t bit =
+      interface->is_parent ? kFeatureInlineParent : kFeatureInlineChild;
+  volatile uint32_t* features = &RootHeader(interface)->features;
+  if (interface->switch_inline)
+    __atomic_fetch_or(features, bit, __ATOMIC_RELEASE);
+  else
+    __atomic_fetch_and(features, ~bit, __ATOMIC_RELEASE);
+}
+
+// Publishes that |interface| can take replies written in place, so that a
+// peer serving its requests does not need to allocate them.
+static void AdvertiseReplyInPlace(struct transact_interface* interface) {
+  __atomic_fetch_or(&RootHeader(interface)->features,
+                    interface->is_parent ? kFeatureReplyInPlaceParent
+                                         : kFeatureReplyInPlaceChild,
+                    __ATOMIC_RELEASE);
+}
+
+// Whether the peer of |interface| can take replies in place.
+static bool PeerTakesReplyInPlace(struct transact_interface* interface) {
+  uint32_t peer = interface->is_parent ? kFeatureReplyInPlaceChild
+                                       : kFeatureReplyInPlaceParent;
+  return __atomic_load_n(&RootHeader(interface)->features, __ATOMIC_ACQUIRE) &
+         peer;
+}
+
+// Adds the blocks handed out by the allocator of the lane that starts at
+// |shm| to |class_blocks| and |stats|.
+template <typename Block>
+static void CollectArena(MessageHeader* shm,
+                         size_t blocks_len,
+                         uint64_t* class_blocks,
+                         transact_stats* stats) {
+  ptrdiff_t free_offset = shm->free_offset;
+  if (free_offset < 0 || static_cast<size_t>(free_offset) > blocks_len)
+    return;
+  if (static_cast<uint64_t>(free_offset) > stats->peak_blocks)
+    stats->peak_blocks = free_offset;
+
+  // Blocks are handed out one right after the other, so the arena can be
+  // walked from start to end. Stop at anything that does not look like a
+  // block, since the peer is free to scribble over it.
+  Block* blocks = reinterpret_cast<Block*>(shm->root);
+  for (ptrdiff_t offset = 0; offset < free_offset;) {
+    size_t len = blocks[offset].blocks_len;
+    if (len == 0 || len > static_cast<size_t>(free_offset - offset))
+      break;
+    int size_class = 63 - __builtin_clzll(len);
+    if (size_class >= TRANSACT_STATS_CLASSES)
+      size_class = TRANSACT_STATS_CLASSES - 1;
+    class_blocks[size_class] += len;
+    if (blocks[offset].free)
+      stats->idle_blocks += len;
+    offset += len;
+  }
+}
+
+// Folds the current state of the allocator of every lane of |interface| into
+// the peaks in its stats.
+static void CollectStats(struct transact_interface* interface) {
+  transact_stats* stats = &interface->stats;
+  uint64_t class_blocks[TRANSACT_STATS_CLASSES] = {};
+  stats->idle_blocks = 0;
+  for (int lane = 0; lane < interface->lanes; lane++) {
+    MessageHeader* shm =
+        LaneHeader(interface->shm, interface->lane_blocks, lane);
+    if (interface->format == TRANSACT_FORMAT_COMPACT) {
+      CollectArena<CompactMessage>(shm, interface->blocks_len, class_blocks,
+                                   stats);
+    } else {
+      CollectArena<Message>(shm, interface->blocks_len, class_blocks, stats);
+    }
+  }
+  for (int i = 0; i < TRANSACT_STATS_CLASSES; i++) {
+    if (class_blocks[i] > stats->class_blocks[i])
+      stats->class_blocks[i] = class_blocks[i];
+  }
+}
+
+// Performs the handshake that pairs the already-open |interface| up with a
+// peer process.
+static bool InterfaceHandshake(struct transact_interface* interface) {
+  // Older versions of the kernel module do not know about
+  // TRANSACT_IOC_SWITCH, and newer ones fail with EFAULT before doing
+  // anything else when passed a NULL argument.
+  int saved_errno = errno;
+  interface->switch_inline =
+      ioctl(interface->transact_fd.get(), TRANSACT_IOC_SWITCH, nullptr) ==
+          -1 &&
+      errno == EFAULT;
+  errno = saved_errno;
+  interface->switched = !interface->is_parent;
+  interface->has_inline_in = false;
+  interface->inline_owner = nullptr;
+
+  // Make sure the child process waits until the parent issues a read() call.
+  unsigned long long handshake = interface->is_parent;
+  ssize_t written = TEMP_FAILURE_RETRY(
+      write(interface->transact_fd.get(), &handshake, sizeof(handshake)));
+  if (written == 0)
+    errno = EPIPE;
+  return written == sizeof(handshake);
+}
+
+// Opens the transact device and pairs |interface| up with a peer process.
+static bool InterfaceConnect(struct transact_interface* interface) {
+  interface->transact_fd.reset(
+      open(interface->transact_filename.get(), O_RDWR));
+  if (!interface->transact_fd)
+    return false;
+  return InterfaceHandshake(interface);
+}
+
+// Hands control over to the peer, along with |payload| if it is not NULL, and
+// waits until it hands it back. Returns 1 on success, 0 if the peer is gone,
+// and -1 on error.
+static int InterfaceSwitch(struct transact_interface* interface,
+                           const InlinePayload* payload) {
+  if (interface->pair) {
+    int res = interface->pair->Switch(interface->index);
+    if (res == 1)
+      interface->switched = true;
+    return res;
+  }
+
+  if (interface->switch_inline) {
+    InlinePayload exchange;
+    if (payload) {
+      exchange = *payload;
+    } else {
+      exchange.len = 0;
+      exchange.flags = 0;
+    }
+    int res = TEMP_FAILURE_RETRY(
+        ioctl(interface->transact_fd.get(), TRANSACT_IOC_SWITCH, &exchange));
+    if (res != 1)
+      return res;
+    interface->switched = true;
+    interface->has_inline_in = exchange.flags & InlinePayload::kInline;
+    if (interface->has_inline_in)
+      interface->inline_in = exchange;
+    return 1;
+  }
+
+  unsigned long long response;
+  ssize_t read_bytes = TEMP_FAILURE_RETRY(
+      read(interface->transact_fd.get(), &response, sizeof(response)));
+  if (read_bytes == 0)
+    return 0;
+  if (read_bytes != sizeof(response))
+    return -1;
+  interface->switched = true;
+  return 1;
+}
+
+static void MessageReset(struct transact_message* message) {
+  if ((message->flags & kMessageInline) &&
+      message->interface->inline_owner == message) {
+    message->interface->inline_owner = nullptr;
+  }
+  message->method_id = 0;
+  message->flags = 0;
+  message->message = nullptr;
+  message->data = message->end = nullptr;
+}
+
+template <typename Block>
+static Block* BlockAt(struct transact_interface* interface, ptrdiff_t offset) {
+  return reinterpret_cast<Block*>(interface->shm->root + offset);
+}
+
+template <typename Block>
+static void MessageInitialize(struct transact_message* message, Block* msg) {
+  message->message = msg;
+  message->method_id = msg->msgid;
+  message->data = msg->data;
+  message->end = reinterpret_cast<char*>(msg + msg->blocks_len);
+}
+
+void transact_options_init(struct transact_options* options) {
+  if (!options)
+    return;
+  memset(options, 0, sizeof(*options));
+  options->format = TRANSACT_FORMAT_LEGACY;
+  options->placement = TRANSACT_PLACEMENT_NONE;
+  options->cpu = -1;
+  options->lanes = 1;
+  options->segment_fd = -1;
+  options->timeline_entries = 0;
+}
+
+transact_interface* transact_interface_open(int is_parent,
+                                            const char* transact_filename,
+                                            const char* shm_filename,
+                                            size_t shm_len) {
+  return transact_interface_open_with_options(
+      is_parent, transact_filename, shm_filename, shm_len, nullptr);
+}
+
+static int MessageAllocateAny(struct transact_message* message,
+                              int id,
+                              size_t len,
+                              bool allow_inline);
+
+// Lists the methods the parent declared idempotent at the start of the arena
+// of the first lane, where the child can find them. Must run right after the
+// arena has been initialized.
+static bool PublishIdempotentMethods(struct transact_interface* interface) {
+  if (!interface->idempotent_methods_len)
+    return true;
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  uint32_t len = interface->idempotent_methods_len;
+  if (MessageAllocateAny(&message, kIdempotentMethodsId,
+                         sizeof(len) + len * sizeof(int32_t), false) == -1) {
+    return false;
+  }
+  memcpy(message.data, &len, sizeof(len));
+  memcpy(message.data + sizeof(len), interface->idempotent_methods.get(),
+         len * sizeof(int32_t));
+  __atomic_fetch_or(&interface->shm->features, kFeatureIdempotentMethods,
+                    __ATOMIC_RELEASE);
+  return true;
+}
+
+// Points |message| at whatever the parent published with |id| at the start
+// of the arena of the first lane, skipping over the ones published before it.
+static bool FindPublished(struct transact_interface* interface,
+                          int id,
+                          struct transact_message* message) {
+  transact_message_init(interface, message);
+  size_t offset = 0;
+  // Each of the reserved ids is published at most once.
+  for (int reserved = kIdempotentMethodsId; reserved >= kSegmentId;
+       reserved--) {
+    size_t blocks_len;
+    if (interface->format == TRANSACT_FORMAT_COMPACT) {
+      CompactMessage* block = BlockAt<CompactMessage>(interface, offset);
+      blocks_len = block->blocks_len;
+      MessageInitialize(message, block);
+    } else {
+      Message* block = BlockAt<Message>(interface, offset);
+      blocks_len = block->blocks_len;
+      MessageInitialize(message, block);
+    }
+    if (blocks_len == 0 || blocks_len > interface->blocks_len - offset)
+      break;
+    if (message->method_id == id)
+      return true;
+    if (message->method_id > kIdempotentMethodsId ||
+        message->method_id < kSegmentId) {
+      break;
+    }
+    offset += blocks_len;
+  }
+  errno = EPROTO;
+  return false;
+}
+
+// Hands the methods the parent declared idempotent over to the response cache
+// of the child |interface|.
+static bool LoadIdempotentMethods(struct transact_interface* interface) {
+  if (!(__atomic_load_n(&interface->shm->features, __ATOMIC_ACQUIRE) &
+        kFeatureIdempotentMethods)) {
+    return true;
+  }
+  struct transact_message message;
+  if (!FindPublished(interface, kIdempotentMethodsId, &message))
+    return false;
+  uint32_t len;
+  if (static_cast<size_t>(message.end - message.data) < sizeof(len)) {
+    errno = EPROTO;
+    return false;
+  }
+  memcpy(&len, message.data, sizeof(len));
+  if (len > TRANSACT_MAX_IDEMPOTENT_METHODS ||
+      (message.end - message.data - sizeof(len)) / sizeof(int32_t) < len) {
+    errno = EPROTO;
+    return false;
+  }
+  return interface->cache->SetMethods(
+      reinterpret_cast<const int32_t*>(message.data + sizeof(len)), len);
+}
+
+// Maps the segment whose descriptor is in |interface->segment_fd| if it is
+// the one described by |handle|.
+static bool MapSegment(struct transact_interface* interface,
+                       const SegmentHandle& handle) {
+  struct stat st;
+  if (fstat(interface->segment_fd.get(), &st) == -1)
+    return false;
+  int seals = fcntl(interface->segment_fd.get(), F_GET_SEALS);
+  if (seals == -1)
+    return false;
+  if (st.st_dev != handle.dev || st.st_ino != handle.ino ||
+      static_cast<uint64_t>(st.st_size) != handle.len || handle.len == 0 ||
+      (seals & kSegmentSeals) != kSegmentSeals) {
+    errno = EINVAL;
+    return false;
+  }
+  interface->segment = mmap(NULL, handle.len, PROT_READ, MAP_SHARED,
+                            interface->segment_fd.get(), 0);
+  if (interface->segment == MAP_FAILED)
+    return false;
+  interface->segment_len = handle.len;
+  return true;
+}
+
+// Tells the child where to find the read-only segment of the parent
+// |interface|. Must run right after the arena has been initialized, before
+// PublishIdempotentMethods().
+static bool PublishSegment(struct transact_interface* interface) {
+  if (!interface->segment_fd)
+    return true;
+  struct stat st;
+  if (fstat(interface->segment_fd.get(), &st) == -1)
+    return false;
+  SegmentHandle handle = {getpid(),
+                          interface->segment_fd.get(),
+                          static_cast<uint64_t>(st.st_size),
+                          static_cast<uint64_t>(st.st_dev),
+                          static_cast<uint64_t>(st.st_ino),
+                          interface->inherited_segment_fd,
+                          0};
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  if (MessageAllocateAny(&message, kSegmentId, sizeof(handle), false) == -1)
+    return false;
+  memcpy(message.data, &handle, sizeof(handle));
+  __atomic_fetch_or(&interface->shm->features, kFeatureSegment,
+                    __ATOMIC_RELEASE);
+  return true;
+}
+
+// Maps the read-only segment the parent published, if any, into the child
+// |interface|. |segment_fd| is the descriptor the child received some other
+// way, or -1 to take it from the parent.
+static bool LoadSegment(struct transact_interface* interface, int segment_fd) {
+  if (!(__atomic_load_n(&interface->shm->features, __ATOMIC_ACQUIRE) &
+        kFeatureSegment)) {
+    return true;
+  }
+  struct transact_message message;
+  if (!FindPublished(interface, kSegmentId, &message))
+    return false;
+  SegmentHandle handle;
+  if (static_cast<size_t>(message.end - message.data) < sizeof(handle)) {
+    errno = EPROTO;
+    return false;
+  }
+  memcpy(&handle, message.data, sizeof(handle));
+
+  if (segment_fd == -1) {
+    // The descriptor might have been inherited, in which case it already has
+    // the same number as in the parent.
+    struct stat st;
+    if (fstat(handle.inherited_fd, &st) == 0 && st.st_dev == handle.dev &&
+        st.st_ino == handle.ino) {
+      segment_fd = handle.inherited_fd;
+    }
+  }
+  if (segment_fd != -1) {
+    interface->segment_fd.reset(fcntl(segment_fd, F_DUPFD_CLOEXEC, 0));
+  } else {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", handle.pid, handle.fd);
+    interface->segment_fd.reset(open(path, O_RDONLY | O_CLOEXEC));
+  }
+  if (!interface->segment_fd)
+    return false;
+  return MapSegment(interface, handle);
+}
+
+// Where the turn timeline starts in a region of |shm_len| bytes, after |lanes|
+// lanes of |lane_blocks| blocks. Returns false if the lanes do not fit in the
+// region.
+static bool TimelineOffset(uint32_t lanes,
+                           uint64_t lane_blocks,
+                           size_t shm_len,
+                           size_t* offset) {
+  if (lanes < 1)
+    lanes = 1;
+  if (lanes > TRANSACT_MAX_LANES || lane_blocks < 2 ||
+      lane_blocks > shm_len / sizeof(MessageHeader) / lanes) {
+    return false;
+  }
+  *offset = lanes * lane_blocks * sizeof(MessageHeader);
+  return shm_len - *offset >= sizeof(transact_timeline_header);
+}
+
+static transact_timeline_header* TimelineAt(MessageHeader* shm,
+                                           size_t offset) {
+  return reinterpret_cast<transact_timeline_header*>(
+      reinterpret_cast<char*>(shm) + offset);
+}
+
+// Attaches the child |interface| to the turn timeline of the parent.
+static bool LoadTimeline(struct transact_interface* interface) {
+  size_t offset;
+  if (!TimelineOffset(interface->lanes, interface->lane_blocks,
+                      interface->shm_len, &offset)) {
+    errno = EPROTO;
+    return false;
+  }
+  transact_timeline_header* header = TimelineAt(interface->shm, offset);
+  transact_timeline_header snapshot = *header;
+  if (!ValidTimeline(snapshot, interface->shm_len - offset)) {
+    errno = EPROTO;
+    return false;
+  }
+  interface->timeline.reset(
+      new Timeline(header, snapshot.entries, interface->is_parent));
+  if (!interface->timeline) {
+    errno = ENOMEM;
+    return false;
+  }
+  return true;
+}
+
+// Takes the layout of the lanes of the parent's region into the child
+// |interface|. It is read only once, since the parent might be changing it.
+static bool LoadLanes(struct transact_interface* interface) {
+  uint32_t lanes = interface->shm->lanes;
+  uint32_t lane_blocks = interface->shm->lane_blocks;
+  if (lanes > 1 &&
+      (lanes > TRANSACT_MAX_LANES || lane_blocks < 2 ||
+       static_cast<size_t>(lanes) * lane_blocks >
+           interface->shm_len / sizeof(MessageHeader))) {
+    // The parent's region does not fit in the child's mapping.
+    errno = EPROTO;
+    return false;
+  }
+  if (lanes > 1)
+    interface->lanes = lanes;
+  interface->lane_blocks = lane_blocks;
+  return true;
+}
+
+// Opens an interface that is paired up either through |transact_filename|, or
+// through |transact_fd| (which is taken over) if that is NULL.
+static transact_interface* InterfaceOpen(int is_parent,
+                                         const char* transact_filename,
+                                         ScopedFD* transact_fd,
+                                         const char* shm_filename,
+                                         size_t shm_len,
+                                         const struct transact_options* options) {
+  struct transact_options default_options;
+  if (!options) {
+    transact_options_init(&default_options);
+    options = &default_options;
+  }
+  if (shm_len < 2 * sizeof(MessageHeader) ||
+      (options->format != TRANSACT_FORMAT_LEGACY &&
+       options->format != TRANSACT_FORMAT_COMPACT) ||
+      options->placement < TRANSACT_PLACEMENT_NONE ||
+      options->placement > TRANSACT_PLACEMENT_SAME_NODE ||
+      options->lanes < 0 || options->lanes > TRANSACT_MAX_LANES ||
+      options->idempotent_methods_len < 0 ||
+      options->idempotent_methods_len > TRANSACT_MAX_IDEMPOTENT_METHODS ||
+      (options->idempotent_methods_len && !options->idempotent_methods) ||
+      options->response_cache_entries < 0 || options->segment_fd < -1 ||
+      options->timeline_entries < 0 ||
+      options->timeline_entries > TRANSACT_MAX_TIMELINE_ENTRIES) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  int lanes = options->lanes > 1 ? options->lanes : 1;
+  uint32_t timeline_entries = 0;
+  size_t timeline_len = 0;
+  if (is_parent && options->timeline_entries) {
+    timeline_entries = 1;
+    while (timeline_entries < static_cast<uint32_t>(options->timeline_entries))
+      timeline_entries *= 2;
+    timeline_len = TimelineLen(timeline_entries);
+  }
+  size_t lane_blocks = shm_len > timeline_len
+                           ? (shm_len - timeline_len) / sizeof(MessageHeader) /
+                                 lanes
+                           : 0;
+  if (is_parent && (lanes > 1 || timeline_entries) && lane_blocks < 2) {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  std::unique_ptr<transact_interface> interface(new transact_interface());
+
+  if (!interface) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  // The header block is not part of the arena.
+  interface->blocks_len = shm_len / sizeof(MessageHeader) - 1;
+  interface->shm_len = shm_len;
+  interface->is_parent = is_parent;
+  if (transact_filename) {
+    interface->transact_filename.reset(strdup(transact_filename));
+    if (!interface->transact_filename) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    if (!InterfaceConnect(interface.get()))
+      return nullptr;
+  } else {
+    interface->transact_fd.reset(transact_fd->release());
+    if (!InterfaceHandshake(interface.get()))
+      return nullptr;
+  }
+
+  interface->shm_fd.reset(open(shm_filename, O_RDWR));
+  if (!interface->shm_fd)
+    return nullptr;
+  if (is_parent && ftruncate(interface->shm_fd.get(), shm_len) == -1)
+    return nullptr;
+  interface->shm = reinterpret_cast<MessageHeader*>(
+      mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+           interface->shm_fd.get(), 0));
+  if (interface->shm == reinterpret_cast<MessageHeader*>(-1))
+    return nullptr;
+  transact_placement_info* placement = &interface->placement;
+  if (is_parent) {
+    if (!ChoosePlacement(options->placement, options->cpu, placement) ||
+        !ApplyPlacement(*placement, 0)) {
+      return nullptr;
+    }
+    // Bind before the header is written, so that no page is faulted in on
+    // the wrong node.
+    if (placement->placement != TRANSACT_PLACEMENT_NONE &&
+        !BindMemory(interface->shm, shm_len, placement->node)) {
+      return nullptr;
+    }
+    interface->lanes = lanes;
+    interface->lane_blocks = lane_blocks;
+    InitializeLanes(interface->shm, lanes, lane_blocks, options->format);
+    interface->shm->placement = placement->placement;
+    interface->shm->placement_cpu[0] = placement->parent_cpu;
+    interface->shm->placement_cpu[1] = placement->child_cpu;
+    interface->shm->placement_node = placement->node;
+    interface->shm->features = 0;
+    AdvertiseInline(interface.get());
+    AdvertiseReplyInPlace(interface.get());
+    if (timeline_entries) {
+      interface->timeline.reset(
+          new Timeline(TimelineAt(interface->shm,
+                                  lanes * lane_blocks * sizeof(MessageHeader)),
+                       timeline_entries, is_parent));
+      if (!interface->timeline) {
+        errno = ENOMEM;
+        return nullptr;
+      }
+      interface->timeline->Initialize();
+      __atomic_fetch_or(&interface->shm->features, kFeatureTimeline,
+                        __ATOMIC_RELEASE);
+    }
+  } else if (interface->shm->format != TRANSACT_FORMAT_LEGACY &&
+             interface->shm->format != TRANSACT_FORMAT_COMPACT) {
+    // The parent chose a format this version does not understand.
+    errno = EPROTO;
+    return nullptr;
+  } else if (!LoadLanes(interface.get())) {
+    return nullptr;
+  } else {
+    placement->placement = interface->shm->placement;
+    placement->parent_cpu = interface->shm->placement_cpu[0];
+    placement->child_cpu = interface->shm->placement_cpu[1];
+    placement->node = interface->shm->placement_node;
+    // The child might be running in a sandbox that does not allow changing
+    // its affinity, so its placement is only advisory.
+    if (!ApplyPlacement(*placement, 1)) {
+      placement->placement = TRANSACT_PLACEMENT_NONE;
+      placement->parent_cpu = placement->child_cpu = placement->node = -1;
+    }
+    AdvertiseInline(interface.get());
+    // Caching an answer needs the request it answers, so a child with a
+    // response cache only takes replies in blocks of their own.
+    if (!options->response_cache_entries)
+      AdvertiseReplyInPlace(interface.get());
+    if (__atomic_load_n(&interface->shm->features, __ATOMIC_ACQUIRE) &
+        kFeatureTimeline) {
+      if (!LoadTimeline(interface.get()))
+        return nullptr;
+    }
+  }
+  interface->format = interface->shm->format;
+  if (interface->lanes > 1 || interface->timeline) {
+    // The header block of each lane is not part of its arena.
+    interface->blocks_len = interface->lane_blocks - 1;
+  }
+  memcpy(interface->stats.magic, TRANSACT_STATS_MAGIC,
+         sizeof(interface->stats.magic));
+  interface->stats.version = TRANSACT_STATS_VERSION;
+  interface->stats.is_parent = is_parent;
+  interface->stats.shm_len = shm_len;
+  interface->stats.lanes = interface->lanes;
+  interface->stats.format = interface->format;
+  interface->stats.arena_blocks = interface->blocks_len;
+  if (options->stats_filename) {
+    interface->stats_filename.reset(strdup(options->stats_filename));
+    if (!interface->stats_filename) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+  }
+  if (is_parent && options->segment_fd != -1) {
+    interface->segment_fd.reset(fcntl(options->segment_fd, F_DUPFD_CLOEXEC, 0));
+    if (!interface->segment_fd)
+      return nullptr;
+    struct stat st;
+    if (fstat(interface->segment_fd.get(), &st) == -1)
+      return nullptr;
+    interface->inherited_segment_fd = options->segment_fd;
+    SegmentHandle handle = {0, 0, static_cast<uint64_t>(st.st_size),
+                            static_cast<uint64_t>(st.st_dev),
+                            static_cast<uint64_t>(st.st_ino), 0, 0};
+    if (!MapSegment(interface.get(), handle) ||
+        !PublishSegment(interface.get())) {
+      return nullptr;
+    }
+  } else if (!is_parent && !LoadSegment(interface.get(), options->segment_fd)) {
+    return nullptr;
+  }
+  if (is_parent && options->idempotent_methods_len) {
+    size_t len = options->idempotent_methods_len * sizeof(int32_t);
+    interface->idempotent_methods.reset(
+        reinterpret_cast<int32_t*>(malloc(len)));
+    if (!interface->idempotent_methods) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    memcpy(interface->idempotent_methods.get(), options->idempotent_methods,
+           len);
+    interface->idempotent_methods_len = options->idempotent_methods_len;
+    if (!PublishIdempotentMethods(interface.get()))
+      return nullptr;
+  } else if (!is_parent && options->response_cache_entries) {
+    interface->cache.reset(new ResponseCache());
+    if (!interface->cache) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    if (!interface->cache->Init(options->response_cache_entries) ||
+        !LoadIdempotentMethods(interface.get())) {
+      return nullptr;
+    }
+  }
+  if (options->record_filename) {
+    interface->recorder.reset(new Recorder());
+    if (!interface->recorder) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    if (!interface->recorder->Open(options->record_filename, is_parent))
+      return nullptr;
+  }
+  return interface.release();
+}
+
+transact_interface* transact_interface_open_with_options(
+    int is_parent,
+    const char* transact_filename,
+    const char* shm_filename,
+    size_t shm_len,
+    const struct transact_options* options) {
+  if (!transact_filename) {
+    errno = EFAULT;
+    return nullptr;
+  }
+  return InterfaceOpen(is_parent, transact_filename, nullptr, shm_filename,
+                       shm_len, options);
+}
+
+int transact_pair_create(const char* control_filename, int flags, int fds[2]) {
+  if (!control_filename || !fds) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  ScopedFD control(open(control_filename, O_RDWR | O_CLOEXEC));
+  if (!control)
+    return -1;
+  TransactPair pair;
+  pair.flags = flags;
+  if (TEMP_FAILURE_RETRY(ioctl(control.get(), TRANSACT_IOC_NEW_PAIR, &pair)) ==
+      -1) {
+    return -1;
+  }
+  fds[0] = pair.fds[0];
+  fds[1] = pair.fds[1];
+  return 0;
+}
+
+transact_interface* transact_interface_open_fd(
+    int is_parent,
+    int transact_fd,
+    const char* shm_filename,
+    size_t shm_len,
+    const struct transact_options* options) {
+  ScopedFD fd(transact_fd);
+  if (!fd) {
+    errno = EBADF;
+    return nullptr;
+  }
+  return InterfaceOpen(is_parent, nullptr, &fd, shm_filename, shm_len,
+                       options);
+}
+
+int transact_interface_get_placement(
+    const struct transact_interface* interface,
+    struct transact_placement_info* info) {
+  if (!interface || !info) {
+    errno = EFAULT;
+    return -1;
+  }
+  *info = interface->placement;
+  return 0;
+}
+
+int transact_interface_get_stats(struct transact_interface* interface,
+                                 struct transact_stats* stats) {
+  if (!interface || !stats) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (interface->owner) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  CollectStats(interface);
+  *stats = interface->stats;
+  return 0;
+}
+
+// Reads exactly |len| bytes at |offset| of |fd|. A short read means that the
+// file is not laid out like a region with a timeline.
+static bool ReadTimeline(int fd, void* buf, size_t len, size_t offset) {
+  ssize_t res = TEMP_FAILURE_RETRY(pread(fd, buf, len, offset));
+  if (res == static_cast<ssize_t>(len))
+    return true;
+  if (res != -1)
+    errno = ENOENT;
+  return false;
+}
+
+ssize_t transact_timeline_read(const char* shm_filename,
+                               struct transact_timeline_header* header,
+                               struct transact_timeline_record* records,
+                               size_t max) {
+  if (!shm_filename || !header || (max && !records)) {
+    errno = EFAULT;
+    return -1;
+  }
+  ScopedFD fd(open(shm_filename, O_RDONLY | O_CLOEXEC));
+  if (!fd)
+    return -1;
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1)
+    return -1;
+  MessageHeader shm;
+  if (!ReadTimeline(fd.get(), &shm, sizeof(shm), 0))
+    return -1;
+  size_t shm_len = st.st_size;
+  size_t offset;
+  if (!(shm.features & kFeatureTimeline) ||
+      !TimelineOffset(shm.lanes, shm.lane_blocks, shm_len, &offset) ||
+      !ReadTimeline(fd.get(), header, sizeof(*header), offset) ||
+      !ValidTimeline(*header, shm_len - offset)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  // The oldest record still in the ring, and the position it is at.
+  uint64_t count = header->count;
+  size_t len = std::min<uint64_t>(std::min<uint64_t>(count, header->entries),
+                                  max);
+  size_t first = (count - len) & (header->entries - 1);
+  size_t head = std::min<size_t>(len, header->entries - first);
+  offset += sizeof(*header);
+  if (!ReadTimeline(fd.get(), records, head * sizeof(*records),
+                    offset + first * sizeof(*records)) ||
+      !ReadTimeline(fd.get(), records + head, (len - head) * sizeof(*records),
+                    offset)) {
+    return -1;
+  }
+  return len;
+}
+
+int transact_segment_create(const char* name, const void* data, size_t len) {
+  if (!data && len) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  ScopedFD fd(memfd_create(name ? name : "transact-segment",
+                           MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  if (!fd)
+    return -1;
+  const char* src = reinterpret_cast<const char*>(data);
+  while (len) {
+    ssize_t written = TEMP_FAILURE_RETRY(write(fd.get(), src, len));
+    if (written == -1)
+      return -1;
+    src += written;
+    len -= written;
+  }
+  if (fcntl(fd.get(), F_ADD_SEALS, kSegmentSeals | F_SEAL_SEAL) == -1)
+    return -1;
+  return fd.release();
+}
+
+const void* transact_interface_get_segment(struct transact_interface* interface,
+                                           size_t* len) {
+  if (!interface || !len) {
+    errno = EFAULT;
+    return nullptr;
+  }
+  if (interface->owner)
+    interface = interface->owner;
+  if (interface->segment == MAP_FAILED) {
+    errno = ENOENT;
+    return nullptr;
+  }
+  *len = interface->segment_len;
+  return interface->segment;
+}
+
+int transact_interface_get_cache_stats(
+    const struct transact_interface* interface,
+    struct transact_cache_stats* stats) {
+  if (!interface || !stats) {
+    errno = EFAULT;
+    return -1;
+  }
+  stats->hits = interface->cache ? interface->cache->hits : 0;
+  stats->misses = interface->cache ? interface->cache->misses : 0;
+  return 0;
+}
+
+int transact_interface_reset(struct transact_interface* interface) {
+  if (!interface) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!interface->is_parent || interface->pair || interface->owner ||
+      !interface->transact_filename) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Their blocks would be handed out again once the arena starts over.
+  if (interface->prepared_messages) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  // The kernel module only hands out a fresh pairing once both ends of the
+  // previous one are closed, so the old descriptor must go first.
+  interface->transact_fd.reset();
+  // Forget whether the previous child could receive inline messages before
+  // the new one gets a chance to say so.
+  interface->shm->features = 0;
+  if (!InterfaceConnect(interface))
+    return -1;
+  AdvertiseInline(interface);
+  AdvertiseReplyInPlace(interface);
+  // The timeline keeps going across pairings.
+  if (interface->timeline) {
+    __atomic_fetch_or(&interface->shm->features, kFeatureTimeline,
+                      __ATOMIC_RELEASE);
+  }
+  interface->in_place_reply = nullptr;
+
+  // The new peer will not look at the arena until the first send, and the
+  // mapping (along with its already-faulted pages) is kept as-is. Only the
+  // peaks of the previous pairing survive.
+  CollectStats(interface);
+  InitializeLanes(interface->shm, interface->lanes, interface->lane_blocks,
+                  interface->format);
+  if (!PublishSegment(interface) || !PublishIdempotentMethods(interface))
+    return -1;
+  return 0;
+}
+
+struct transact_interface* transact_interface_open_lane(
+    struct transact_interface* interface,
+    int lane) {
+  if (!interface) {
+    errno = EFAULT;
+    return nullptr;
+  }
+  if (interface->pair || interface->owner || lane < 1 ||
+      lane >= interface->lanes) {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  std::unique_ptr<transact_interface> lane_interface(new transact_interface());
+  if (!lane_interface) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  lane_interface->transact_fd.reset(TEMP_FAILURE_RETRY(
+      ioctl(interface->transact_fd.get(), TRANSACT_IOC_OPEN_LANE, lane)));
+  if (!lane_interface->transact_fd)
+    return nullptr;
+  lane_interface->is_parent = interface->is_parent;
+  if (!InterfaceHandshake(lane_interface.get()))
+    return nullptr;
+
+  lane_interface->owner = interface;
+  lane_interface->blocks_len = interface->blocks_len;
+  lane_interface->format = interface->format;
+  lane_interface->placement = interface->placement;
+  lane_interface->lane_blocks = interface->lane_blocks;
+  lane_interface->shm =
+      LaneHeader(interface->shm, interface->lane_blocks, lane);
+  return lane_interface.release();
+}
+
+namespace {
+
+struct InProcessPeer {
+  transact_interface* interface;
+  transact_peer_fn fn;
+  void* arg;
+};
+
+// Runs |peer| and then closes its interface, the same way the kernel module
+// notices that a process has exited. Much like a child process whose
+// handshake fails, the child is not run at all if the parent exited before
+// ever handing control over.
+void RunPeer(InProcessPeer* peer) {
+  InProcessPair* pair = peer->interface->pair;
+  if (peer->interface->index == 0 || pair->started())
+    peer->fn(peer->interface, peer->arg);
+  transact_interface_close(peer->interface);
+  peer->interface = nullptr;
+}
+
+void* ChildThreadMain(void* arg) {
+  InProcessPeer* peer = reinterpret_cast<InProcessPeer*>(arg);
+  // The child only starts running once the parent hands control over.
+  peer->interface->pair->WaitForTurn(1);
+  RunPeer(peer);
+  return nullptr;
+}
+
+void ChildCoroutineMain(void* arg) {
+  InProcessPeer* peer = reinterpret_cast<InProcessPeer*>(arg);
+  InProcessPair* pair = peer->interface->pair;
+  RunPeer(peer);
+  // Return to wherever the parent last yielded. That is either one of its
+  // calls to transact_message_send(), which will now return 0, or the end of
+  // transact_run_inprocess(). This coroutine is never resumed.
+  pair->SwapTo(1);
+}
+
+}  // namespace
+
+int transact_run_inprocess(int mode,
+                           size_t shm_len,
+                           const struct transact_options* options,
+                           transact_peer_fn parent,
+                           void* parent_arg,
+                           transact_peer_fn child,
+                           void* child_arg) {
+  struct transact_options default_options;
+  if (!options) {
+    transact_options_init(&default_options);
+    options = &default_options;
+  }
+  if (!parent || !child ||
+      (mode != TRANSACT_INPROCESS_THREADS &&
+       mode != TRANSACT_INPROCESS_COROUTINES) ||
+      (options->format != TRANSACT_FORMAT_LEGACY &&
+       options->format != TRANSACT_FORMAT_COMPACT) ||
+      shm_len < 2 * sizeof(MessageHeader)) {
+    errno = EINVAL;
+    return -1;
+  }
+#if !defined(HAVE_COROUTINES)
+  if (mode == TRANSACT_INPROCESS_COROUTINES) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+
+  std::unique_ptr<InProcessPair> pair(new InProcessPair(mode));
+  if (!pair) {
+    errno = ENOMEM;
+    return -1;
+  }
+  MessageHeader* shm = reinterpret_cast<MessageHeader*>(
+      mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0));
+  if (shm == reinterpret_cast<MessageHeader*>(-1))
+    return -1;
+  InitializeHeader(shm, options->format);
+  shm->features = kFeatureReplyInPlaceParent | kFeatureReplyInPlaceChild;
+
+  InProcessPeer peers[2] = {{nullptr, parent, parent_arg},
+                            {nullptr, child, child_arg}};
+  for (int i = 0; i < 2; i++) {
+    peers[i].interface = new transact_interface();
+    if (!peers[i].interface) {
+      delete peers[0].interface;
+      munmap(shm, shm_len);
+      errno = ENOMEM;
+      return -1;
+    }
+    peers[i].interface->blocks_len = shm_len / sizeof(MessageHeader) - 1;
+    peers[i].interface->is_parent = i == 0;
+    peers[i].interface->format = options->format;
+    peers[i].interface->shm = shm;
+    peers[i].interface->pair = pair.get();
+    peers[i].interface->index = i;
+  }
+
+  if (mode == TRANSACT_INPROCESS_THREADS) {
+    pthread_t child_thread;
+    int res = pthread_create(&child_thread, nullptr, ChildThreadMain, &peers[1]);
+    if (res != 0) {
+      transact_interface_close(peers[0].interface);
+      transact_interface_close(peers[1].interface);
+      munmap(shm, shm_len);
+      errno = res;
+      return -1;
+    }
+    RunPeer(&peers[0]);
+    pthread_join(child_thread, nullptr);
+  } else {
+    void* stack = mmap(NULL, kCoroutineStackSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+      transact_interface_close(peers[0].interface);
+      transact_interface_close(peers[1].interface);
+      munmap(shm, shm_len);
+      return -1;
+    }
+#if defined(HAVE_COROUTINES)
+    pair->set_sp(1, PrepareCoroutineStack(stack, kCoroutineStackSize,
+                                          ChildCoroutineMain, &peers[1]));
+#endif
+    RunPeer(&peers[0]);
+    // Let the child run to completion if it is still around. It will see that
+    // the parent is gone the next time it tries to switch, or will not run at
+    // all if the parent never handed control over.
+    if (!pair->dead(1)) {
+      if (pair->started())
+        pair->SwapTo(0);
+      else
+        RunPeer(&peers[1]);
+    }
+    munmap(stack, kCoroutineStackSize);
+  }
+
+  munmap(shm, shm_len);
+  return 0;
+}
+
+void transact_interface_close(struct transact_interface* interface) {
+	if (!interface)
+		return;
+  if (interface->owner) {
+    // Lanes of the same interface might be closed concurrently.
+    transact_stats* stats = &interface->owner->stats;
+    __atomic_fetch_add(&stats->requested_bytes,
+                       interface->stats.requested_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->allocated_bytes,
+                       interface->stats.allocated_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->failed_allocations,
+                       interface->stats.failed_allocations, __ATOMIC_RELAXED);
+  } else if (interface->stats_filename) {
+    CollectStats(interface);
+    ScopedFD fd(open(interface->stats_filename.get(),
+                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+    // A single append, so that concurrent runs never interleave their
+    // records. There is nobody to report a failure to.
+    if (fd)
+      TEMP_FAILURE_RETRY(write(fd.get(), &interface->stats,
+                               sizeof(interface->stats)));
+  }
+  if (interface->timeline)
+    interface->timeline->Close();
+  delete interface;
+}
+
+struct transact_message* transact_message_new() {
+  struct transact_message* message = new transact_message();
+  if (!message)
+    errno = ENOMEM;
+  return message;
+}
+
+void transact_message_free(struct transact_message* message) {
+  if (!message)
+    return;
+  // The interface must not keep pointing at a message that is gone, nor keep
+  // the inline payload it was reading around for the next one.
+  if (message->interface && (message->flags & kMessageInline)) {
+    if (message->message == &message->interface->inline_in)
+      message->interface->has_inline_in = false;
+    MessageReset(message);
+  }
+  delete message;
+}
+
+int transact_message_init(struct transact_interface* interface,
+                          struct transact_message* message) {
+  if (!interface) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  memset(message, 0, sizeof(*message));
+  message->interface = interface;
+  return 0;
+}
+
+template <typename Block>
+static int MessageAllocate(struct transact_message* message,
+                           int id,
+                           size_t len) {
+  len += offsetof(Block, data);  // For the page header.
+  len += (~(len - 1) & 0x3F);    // Align to blocks.
+  size_t blocks = len / sizeof(Block);
+
+  ptrdiff_t head = blocks == 1 ? message->interface->shm->small_message_list
+                               : message->interface->shm->large_message_list;
+  ptrdiff_t next = head;
+  ptrdiff_t prev_next = message->interface->blocks_len + 1;
+
+  // Try to reuse an old allocation.
+  while (next != static_cast<ptrdiff_t>(-1)) {
+    // The messages form a linked list that goes backwards. If any next pointer
+    // lies outside of the legal values, or it does not appear before in the
+    // shared memory region, it is definitely invalid.
+    if (next < 0 ||
+        static_cast<size_t>(next) >= message->interface->blocks_len ||
+        next >= prev_next) {
+      errno = EINVAL;
+      return -1;
+    }
+    Block* prev = BlockAt<Block>(message->interface, next);
+    if (prev->free && prev->blocks_len == blocks) {
+      prev->free = 0;
+      prev->msgid = id;
+      MessageInitialize(message, prev);
+      return 0;
+    }
+    prev_next = next;
+    next = NextOffset(prev);
+  }
+
+  // Sanity check. A full arena is not an error, just out of room.
+  ptrdiff_t free_offset = message->interface->shm->free_offset;
+  if (free_offset < 0 ||
+      static_cast<size_t>(free_offset) > message->interface->blocks_len) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Need to perform allocation.
+  if (message->interface->blocks_len < free_offset + blocks) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  Block* ptr = BlockAt<Block>(message->interface, free_offset);
+  SetNextOffset(ptr, head);
+  ptr->blocks_len = blocks;
+  ptr->free = 0;
+  ptr->msgid = id;
+  if (blocks == 1) {
+    message->interface->shm->small_message_list = free_offset;
+  } else {
+    message->interface->shm->large_message_list = free_offset;
+  }
+  message->interface->shm->free_offset = free_offset + blocks;
+
+  MessageInitialize(message, ptr);
+  return 0;
+}
+
+// Points |message| back at the start of its (prepared) block, and restores
+// the block's msgid in case the peer replied in place.
+template <typename Block>
+static void MessageRewind(struct transact_message* message) {
+  Block* msg = reinterpret_cast<Block*>(message->message);
+  msg->msgid = message->method_id;
+  message->data = msg->data;
+}
+
+template <typename Block>
+static char* BlockData(struct transact_message* message) {
+  return reinterpret_cast<Block*>(message->message)->data;
+}
+
+// Returns the offset, in blocks, of the block |message| points to, or -1 for
+// inline messages.
+static ptrdiff_t MessageOffset(struct transact_message* message) {
+  if (message->flags & kMessageInline)
+    return -1;
+  return reinterpret_cast<Message*>(message->message) -
+         message->interface->shm->root;
+}
+
+// Returns the start of the payload of the block |message| points to.
+static char* MessageDataStart(struct transact_message* message) {
+  if (message->flags & kMessageInline)
+    return reinterpret_cast<InlinePayload*>(message->message)->data;
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT)
+    return BlockData<CompactMessage>(message);
+  return BlockData<Message>(message);
+}
+
+template <typename Block>
+static void MessageRelease(struct transact_message* message) {
+  reinterpret_cast<Block*>(message->message)->free = 1;
+}
+
+// Whether the next message sent through |interface| can be carried by the
+// switch itself.
+static bool CanSendInline(struct transact_interface* interface) {
+  if (!interface->switch_inline || !interface->switched)
+    return false;
+  uint32_t peer =
+      interface->is_parent ? kFeatureInlineChild : kFeatureInlineParent;
+  return __atomic_load_n(&RootHeader(interface)->features, __ATOMIC_ACQUIRE) &
+         peer;
+}
+
+// Points |message| at the inline payload of its interface. Only one message
+// can own it at any given time.
+static void MessageAllocateInline(struct transact_message* message, int id) {
+  InlinePayload* payload = &message->interface->inline_out;
+  payload->msgid = id;
+  payload->len = InlinePayload::kCapacity;
+  payload->flags = InlinePayload::kInline;
+  message->interface->inline_owner = message;
+  message->flags |= kMessageInline;
+  message->message = payload;
+  message->method_id = id;
+  message->data = payload->data;
+  message->end = payload->data + InlinePayload::kCapacity;
+}
+
+static int MessageAllocateAny(struct transact_message* message,
+                              int id,
+                              size_t len,
+                              bool allow_inline) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (message->flags & kMessagePrepared) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  struct transact_interface* interface = message->interface;
+  MessageReset(message);
+  if (allow_inline && len <= InlinePayload::kCapacity &&
+      !interface->inline_owner && CanSendInline(interface)) {
+    MessageAllocateInline(message, id);
+    TRANSACT_PROBE3(allocate, id, len, -1);
+    return 0;
+  }
+  int res = interface->format == TRANSACT_FORMAT_COMPACT
+                ? MessageAllocate<CompactMessage>(message, id, len)
+                : MessageAllocate<Message>(message, id, len);
+  if (res == 0)
+    TRANSACT_PROBE3(allocate, id, len, MessageOffset(message));
+  return res;
+}
+
+// Accounts for an allocation of |len| bytes for |message| that returned
+// |res|.
+static int MessageCountAllocation(struct transact_message* message,
+                                  size_t len,
+                                  int res) {
+  transact_stats* stats = &message->interface->stats;
+  if (res == -1) {
+    if (errno == ENOMEM)
+      stats->failed_allocations++;
+  } else if (!(message->flags & kMessageInline)) {
+    stats->requested_bytes += len;
+    stats->allocated_bytes +=
+        message->end - reinterpret_cast<char*>(message->message);
+  }
+  return res;
+}
+
+// Clears the whole capacity of a freshly allocated |message| if it is a
+// request the response cache will hash, so that whatever the block held
+// before does not get in the way of a match.
+static void MessageClearForCache(struct transact_message* message) {
+  ResponseCache* cache = message->interface->cache.get();
+  if (cache && cache->Idempotent(message->method_id))
+    memset(message->data, 0, message->end - message->data);
+}
+
+int transact_message_allocate(struct transact_message* message,
+                              int id,
+                              size_t len) {
+  if (MessageCountAllocation(message, len,
+                             MessageAllocateAny(message, id, len, true)) ==
+      -1) {
+    return -1;
+  }
+  MessageClearForCache(message);
+  return 0;
+}
+
+int transact_message_allocate_stream(struct transact_message* message,
+                                     int id,
+                                     size_t chunk_len) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (chunk_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Settle for smaller chunks while the arena is too full for the requested
+  // ones: it only means more switches.
+  while (MessageAllocateAny(message, id, sizeof(ChunkHeader) + chunk_len,
+                            false) == -1) {
+    if (errno != ENOMEM || chunk_len == 1)
+      return MessageCountAllocation(message, chunk_len, -1);
+    chunk_len /= 2;
+  }
+  MessageCountAllocation(message, sizeof(ChunkHeader) + chunk_len, 0);
+  message->flags |= kMessageStream;
+  message->data += sizeof(ChunkHeader);
+  if (message->interface->recorder)
+    message->interface->recorder->DropStream();
+  return 0;
+}
+
+int transact_message_prepare(struct transact_message* message,
+                             int id,
+                             size_t len) {
+  // Prepared messages are meant to be reused in place across many turns, so
+  // they always live in shared memory.
+  if (MessageCountAllocation(message, len,
+                             MessageAllocateAny(message, id, len, false)) ==
+      -1) {
+    return -1;
+  }
+  MessageClearForCache(message);
+  message->flags |= kMessagePrepared;
+  message->interface->prepared_messages++;
+  return 0;
+}
+
+int transact_message_rewind(struct transact_message* message) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!(message->flags & kMessagePrepared)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT)
+    MessageRewind<CompactMessage>(message);
+  else
+    MessageRewind<Message>(message);
+  return 0;
+}
+
+int transact_message_unprepare(struct transact_message* message) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!(message->flags & kMessagePrepared)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  message->interface->prepared_messages--;
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT)
+    MessageRelease<CompactMessage>(message);
+  else
+    MessageRelease<Message>(message);
+  MessageReset(message);
+  return 0;
+}
+
+int transact_message_reply(struct transact_message* message,
+                           int id,
+                           size_t len) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  struct transact_interface* interface = message->interface;
+  // Only a request that was just received in a block of its own, which the
+  // peer does not keep, and that is large enough can hold the reply.
+  if (message->message && message->flags == 0 && !interface->has_inline_in &&
+      interface->shm->current_msg_offset == MessageOffset(message) &&
+      PeerTakesReplyInPlace(interface) &&
+      len <= static_cast<size_t>(message->end - MessageDataStart(message))) {
+    if (interface->format == TRANSACT_FORMAT_COMPACT)
+      reinterpret_cast<CompactMessage*>(message->message)->msgid = id;
+    else
+      reinterpret_cast<Message*>(message->message)->msgid = id;
+    message->flags |= kMessageInPlace;
+    message->method_id = id;
+    message->data = MessageDataStart(message);
+    return 0;
+  }
+  return transact_message_allocate(message, id, len);
+}
+
+int transact_message_recv(struct transact_message* message) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (message->flags & kMessagePrepared) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  struct transact_interface* interface = message->interface;
+  MessageReset(message);
+  if (interface->cached_in) {
+    const ResponseCache::Entry* entry = interface->cached_in;
+    message->flags |= kMessageCached;
+    message->message = const_cast<ResponseCache::Entry*>(entry);
+    message->method_id = entry->response_id;
+    message->data = entry->data + entry->request_len;
+    message->end = message->data + entry->response_len;
+    return 0;
+  }
+  if (interface->has_inline_in) {
+    InlinePayload* payload = &interface->inline_in;
+    message->flags |= kMessageInline;
+    message->message = payload;
+    message->method_id = payload->msgid;
+    message->data = payload->data;
+    message->end = payload->data +
+                   (payload->len < InlinePayload::kCapacity
+                        ? payload->len
+                        : InlinePayload::kCapacity);
+    TRANSACT_PROBE3(recv, message->method_id, message->end - message->data,
+                    -1);
+    return 0;
+  }
+
+  ptrdiff_t offset = message->interface->shm->current_msg_offset;
+  bool chunk = offset > 0 && (offset & kChunkOffset);
+  if (chunk)
+    offset &= ~kChunkOffset;
+  if (offset > 0 && (offset & kPinnedOffset))
+    offset &= ~kPinnedOffset;
+  if (offset < 0 ||
+      static_cast<size_t>(offset) >= message->interface->blocks_len) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT) {
+    MessageInitialize(message,
+                      BlockAt<CompactMessage>(message->interface, offset));
+  } else {
+    MessageInitialize(message, BlockAt<Message>(message->interface, offset));
+  }
+  if (chunk) {
+    const ChunkHeader* header =
+        reinterpret_cast<const ChunkHeader*>(message->data);
+    size_t capacity = message->end - message->data;
+    if (capacity < sizeof(ChunkHeader) ||
+        header->len > capacity - sizeof(ChunkHeader)) {
+      MessageReset(message);
+      errno = EMSGSIZE;
+      return -1;
+    }
+    message->data += sizeof(ChunkHeader);
+    message->end = message->data + header->len;
+    if (header->more)
+      message->flags |= kMessageMoreChunks;
+  }
+  TRANSACT_PROBE3(recv, message->method_id, message->end - message->data,
+                  offset);
+  return 0;
+}
+
+// Finishes the chunk that the streamed |message| has been written into, and
+// makes it the one the peer will receive once it gets control.
+static void MessageSealChunk(struct transact_message* message, bool more) {
+  char* start = MessageDataStart(message);
+  ChunkHeader* header = reinterpret_cast<ChunkHeader*>(start);
+  header->len = message->data - start - sizeof(ChunkHeader);
+  header->more = more;
+  message->interface->shm->current_msg_offset =
+      MessageOffset(message) | kChunkOffset;
+}
+
+// Appends the sealed chunk of the streamed |message| to the recording of the
+// stream.
+static bool MessageRecordChunk(struct transact_message* message, bool more) {
+  char* start = MessageDataStart(message);
+  const ChunkHeader* header = reinterpret_cast<const ChunkHeader*>(start);
+  return message->interface->recorder->AppendChunk(
+      message->method_id, start + sizeof(ChunkHeader), header->len,
+      message->end - start - sizeof(ChunkHeader), !more);
+}
+
+// The first half of transact_message_send(): makes |message| the one the peer
+// will receive once it gets control.
+static bool MessageSendBegin(struct transact_message* message) {
+  struct transact_interface* interface = message->interface;
+  if (interface->in_place_reply &&
+      interface->in_place_reply != message->message) {
+    // Whatever the peer replied in place has been read by now.
+    if (interface->format == TRANSACT_FORMAT_COMPACT)
+      reinterpret_cast<CompactMessage*>(interface->in_place_reply)->free = 1;
+    else
+      reinterpret_cast<Message*>(interface->in_place_reply)->free = 1;
+  }
+  interface->in_place_reply = nullptr;
+  if (message->flags & kMessageCached) {
+    // A cached answer being sent back: move it to shared memory.
+    const ResponseCache::Entry* entry =
+        reinterpret_cast<const ResponseCache::Entry*>(message->message);
+    if (MessageAllocateAny(message, entry->response_id, entry->response_len,
+                           false) == -1) {
+      return false;
+    }
+    memcpy(message->data, entry->data + entry->request_len,
+           entry->response_len);
+  }
+  if ((message->flags & kMessageInline) &&
+      (message->message != &interface->inline_out ||
+       !CanSendInline(interface))) {
+    // A received inline message being sent back, or one that can no longer
+    // be sent inline: move it to shared memory.
+    InlinePayload payload =
+        *reinterpret_cast<InlinePayload*>(message->message);
+    if (MessageAllocateAny(message, payload.msgid, payload.len, false) == -1)
+      return false;
+    memcpy(message->data, payload.data, payload.len);
+  }
+  ptrdiff_t offset = MessageOffset(message);
+  if (message->flags & kMessageStream) {
+    MessageSealChunk(message, false);
+  } else if (offset != -1) {
+    interface->shm->current_msg_offset =
+        (message->flags & kMessagePrepared) && PeerTakesReplyInPlace(interface)
+            ? offset | kPinnedOffset
+            : offset;
+  }
+  TRANSACT_PROBE3(send, message->method_id,
+                  message->end - MessageDataStart(message), offset);
+  if (interface->recorder) {
+    // Callers are free to fill the payload in place without advancing
+    // |data|, so the whole capacity of the message is recorded. Streams can
+    // only be filled through transact_message_write(), so only what was
+    // written to their chunks is.
+    char* start = MessageDataStart(message);
+    bool recorded =
+        message->flags & kMessageStream
+            ? MessageRecordChunk(message, false)
+            : interface->recorder->Append(message->method_id, start,
+                                          message->end - start);
+    if (!recorded) {
+      // A log that cannot grow is no reason to stop the conversation.
+      interface->recorder.reset();
+    }
+  }
+  if (interface->timeline) {
+    interface->timeline->Handoff(message->method_id,
+                                 message->end - MessageDataStart(message));
+  }
+  return true;
+}
+
+// Whether the peer answered |message| by writing its reply into the same
+// block, once it has handed control back.
+static bool MessageRepliedInPlace(struct transact_message* message) {
+  struct transact_interface* interface = message->interface;
+  return !(message->flags &
+           (kMessageInline | kMessageStream | kMessageInPlace)) &&
+         !interface->has_inline_in &&
+         interface->shm->current_msg_offset == MessageOffset(message);
+}
+
+// The second half of transact_message_send(), once the peer has handed control
+// back and is done with |message|.
+static void MessageSendEnd(struct transact_message* message) {
+  if (message->flags & (kMessageInline | kMessageInPlace)) {
+    // The block of a reply in place belongs to the peer.
+    MessageReset(message);
+    return;
+  }
+  if (message->flags & kMessagePrepared) {
+    // Prepared messages keep their block, and are ready to be written again.
+    transact_message_rewind(message);
+    return;
+  }
+  if (MessageRepliedInPlace(message)) {
+    // The reply is still to be read.
+    message->interface->in_place_reply = message->message;
+    MessageReset(message);
+    return;
+  }
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT)
+    MessageRelease<CompactMessage>(message);
+  else
+    MessageRelease<Message>(message);
+  MessageReset(message);
+}
+
+// Returns the request held by |message| if its answer can be cached, or NULL
+// if it cannot.
+static const char* MessageCacheableRequest(struct transact_message* message,
+                                           size_t* len) {
+  struct transact_interface* interface = message->interface;
+  if (!interface->cache->Idempotent(message->method_id) ||
+      (message->flags &
+       (kMessageStream | kMessageCached | kMessageInPlace)) ||
+      ((message->flags & kMessageInline) &&
+       message->message != &interface->inline_out)) {
+    return nullptr;
+  }
+  // Callers are free to fill the payload in place without advancing |data|,
+  // so the whole capacity of the message is the request.
+  const char* request = MessageDataStart(message);
+  *len = message->end - request;
+  return *len <= TRANSACT_MAX_CACHED_LEN ? request : nullptr;
+}
+
+// Caches whatever the peer answered to |request|.
+static void MessageCacheResponse(struct transact_interface* interface,
+                                 uint64_t hash,
+                                 int request_id,
+                                 const char* request,
+                                 size_t request_len) {
+  struct transact_message response;
+  transact_message_init(interface, &response);
+  if (transact_message_recv(&response) == -1 ||
+      (response.flags & kMessageMoreChunks) ||
+      response.end - response.data > TRANSACT_MAX_CACHED_LEN) {
+    return;
+  }
+  interface->cache->Store(hash, request_id, request, request_len,
+                          response.method_id, response.data,
+                          response.end - response.data);
+}
+
+int transact_message_send(struct transact_message* message) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  struct transact_interface* interface = message->interface;
+  interface->cached_in = nullptr;
+  const char* request = nullptr;
+  size_t request_len = 0;
+  uint64_t hash = 0;
+  if (interface->cache &&
+      (request = MessageCacheableRequest(message, &request_len))) {
+    hash = ResponseCache::Hash(message->method_id, request, request_len);
+    interface->cached_in = interface->cache->Lookup(hash, message->method_id,
+                                                    request, request_len);
+    if (interface->cached_in) {
+      interface->cache->hits++;
+      interface->has_inline_in = false;
+      MessageSendEnd(message);
+      return 1;
+    }
+    interface->cache->misses++;
+  }
+
+  int method_id = message->method_id;
+  if (!MessageSendBegin(message))
+    return -1;
+  int res = InterfaceSwitch(
+      interface,
+      (message->flags & kMessageInline)
+          ? reinterpret_cast<InlinePayload*>(message->message)
+          : nullptr);
+  if (interface->recorder)
+    interface->recorder->Resumed();
+  if (interface->timeline)
+    interface->timeline->Resumed();
+  if (res != 1)
+    return res;
+  // The request is still intact unless the peer answered in place.
+  if (request && !MessageRepliedInPlace(message))
+    MessageCacheResponse(interface, hash, method_id, request, request_len);
+  MessageSendEnd(message);
+  return 1;
+}
+
+int transact_serve(struct transact_interface* interface,
+                   const transact_handler_fn* handlers,
+                   size_t handlers_len,
+                   void* arg) {
+  if (!interface || (!handlers && handlers_len)) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  // The parent holds control right after opening, and the child can only
+  // send the first request once it is handed over.
+  if (interface->is_parent && !interface->switched) {
+    int res = InterfaceSwitch(interface, nullptr);
+    if (res != 1)
+      return res;
+  }
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  for (;;) {
+    if (transact_message_recv(&message) == -1)
+      return -1;
+    int id = message.method_id;
+    if (id < 0 || static_cast<size_t>(id) >= handlers_len || !handlers[id]) {
+      errno = ENOSYS;
+      return -1;
+    }
+    void* request = message.message;
+    if (handlers[id](&message, arg) == -1)
+      return -1;
+    if (message.message == request && !(message.flags & kMessageInPlace)) {
+      // The handler did not reply.
+      errno = EPROTO;
+      return -1;
+    }
+    int res = transact_message_send(&message);
+    if (res != 1)
+      return res;
+  }
+}
+
+// Hands the chunk the streamed |message| has been written into over to the
+// peer, and waits until the peer has consumed it so that the block can be
+// filled again. Returns 1 on success, 0 if the peer is gone, and -1 on error.
+static int MessageFlushChunk(struct transact_message* message) {
+  struct transact_interface* interface = message->interface;
+  char* start = MessageDataStart(message);
+  ptrdiff_t offset = MessageOffset(message);
+  MessageSealChunk(message, true);
+  TRANSACT_PROBE3(send, message->method_id, message->end - start, offset);
+  if (interface->recorder && !MessageRecordChunk(message, true))
+    interface->recorder.reset();
+  if (interface->timeline)
+    interface->timeline->Handoff(message->method_id, message->end - start);
+  int res = InterfaceSwitch(interface, nullptr);
+  if (interface->recorder)
+    interface->recorder->Resumed();
+  if (interface->timeline)
+    interface->timeline->Resumed();
+  if (res != 1)
+    return res;
+
+  // The peer acknowledges a chunk by handing control back without sending
+  // anything. If it sent a message instead, it is not interested in the rest
+  // of the stream.
+  if (interface->has_inline_in ||
+      interface->shm->current_msg_offset != (offset | kChunkOffset)) {
+    if (interface->format == TRANSACT_FORMAT_COMPACT)
+      MessageRelease<CompactMessage>(message);
+    else
+      MessageRelease<Message>(message);
+    MessageReset(message);
+    errno = EPROTO;
+    return -1;
+  }
+  message->data = start + sizeof(ChunkHeader);
+  return 1;
+}
+
+// Hands the consumed chunk of |message| back to the sender and waits for the
+// next one. Returns 1 on success, 0 if the peer is gone, and -1 on error.
+static int MessageNextChunk(struct transact_message* message) {
+  struct transact_interface* interface = message->interface;
+  int method_id = message->method_id;
+  int res = InterfaceSwitch(interface, nullptr);
+  if (res != 1)
+    return res;
+  if (interface->has_inline_in ||
+      !(interface->shm->current_msg_offset & kChunkOffset)) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (transact_message_recv(message) == -1)
+    return -1;
+  if (message->method_id != method_id) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 1;
+}
+
+// Reads |len| bytes from the streamed |message|, pulling in as many chunks
+// as needed.
+static ssize_t MessageReadChunks(struct transact_message* message,
+                                 void* target,
+                                 size_t len) {
+  char* dest = reinterpret_cast<char*>(target);
+  size_t remaining = len;
+  while (remaining > 0) {
+    size_t available = message->end - message->data;
+    if (available == 0) {
+      if (!(message->flags & kMessageMoreChunks))
+        return 0;
+      int res = MessageNextChunk(message);
+      if (res == 0)
+        errno = EPIPE;
+      if (res != 1)
+        return -1;
+      continue;
+    }
+    size_t n = remaining < available ? remaining : available;
+    memcpy(dest, message->data, n);
+    message->data += n;
+    dest += n;
+    remaining -= n;
+  }
+  return len;
+}
+
+ssize_t transact_message_read(struct transact_message* message,
+                              void* target,
+                              size_t len) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  if (message->data + len > message->end) {
+    if (!(message->flags & kMessageMoreChunks))
+      return 0;
+    return MessageReadChunks(message, target, len);
+  }
+  memcpy(target, message->data, len);
+  message->data += len;
+  return len;
+}
+
+ssize_t transact_message_read_array(struct transact_message* message,
+                                    void** target,
+                                    size_t len) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  // Writes that fit in a single chunk are never split, so an array that
+  // does not fit in what is left of this chunk must start in the next one.
+  while (message->data + len > message->end &&
+         message->data == message->end &&
+         (message->flags & kMessageMoreChunks)) {
+    int res = MessageNextChunk(message);
+    if (res == 0)
+      errno = EPIPE;
+    if (res != 1)
+      return -1;
+  }
+  if (message->data + len > message->end)
+    return 0;
+  *target = reinterpret_cast<void*>(message->data);
+  message->data += len;
+  return len;
+}
+
+// Fails a range check of |values| with ERANGE.
+template <typename T>
+static ssize_t MessageRangeError(const T* values,
+                                 size_t count,
+                                 T min,
+                                 T max,
+                                 size_t* bad_index) {
+  if (bad_index)
+    *bad_index = FirstOutOfRange(values, count, min, max);
+  errno = ERANGE;
+  return -1;
+}
+
+template <typename T>
+static ssize_t MessageReadIntArray(struct transact_message* message,
+                                   T* target,
+                                   size_t count,
+                                   T min,
+                                   T max,
+                                   size_t* bad_index) {
+  if (!message || !target) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (count > SIZE_MAX / sizeof(T))
+    return 0;
+
+  size_t len = count * sizeof(T);
+  if (static_cast<size_t>(message->end - message->data) >= len) {
+    // Copy and check in the same pass.
+    bool in_range = InRange(reinterpret_cast<const T*>(message->data), target,
+                            count, min, max);
+    message->data += len;
+    if (!in_range)
+      return MessageRangeError<T>(target, count, min, max, bad_index);
+    return len;
+  }
+
+  // The array spans several chunks of a streamed message.
+  ssize_t res = transact_message_read(message, target, len);
+  if (res <= 0)
+    return res;
+  if (!InRange<T>(target, nullptr, count, min, max))
+    return MessageRangeError<T>(target, count, min, max, bad_index);
+  return len;
+}
+
+template <typename T>
+static ssize_t MessageViewIntArray(struct transact_message* message,
+                                   const T** target,
+                                   size_t count,
+                                   T min,
+                                   T max,
+                                   size_t* bad_index) {
+  if (!message || !target) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (count > SIZE_MAX / sizeof(T))
+    return 0;
+
+  void* values;
+  ssize_t res = transact_message_read_array(message, &values, count * sizeof(T));
+  if (res <= 0)
+    return res;
+  *target = reinterpret_cast<const T*>(values);
+  if (!InRange<T>(*target, nullptr, count, min, max))
+    return MessageRangeError<T>(*target, count, min, max, bad_index);
+  return res;
+}
+
+ssize_t transact_message_read_int32_array(struct transact_message* message,
+                                          int32_t* target,
+                                          size_t count,
+                                          int32_t min,
+                                          int32_t max,
+                                          size_t* bad_index) {
+  return MessageReadIntArray(message, target, count, min, max, bad_index);
+}
+
+ssize_t transact_message_view_int32_array(struct transact_message* message,
+                                          const int32_t** target,
+                                          size_t count,
+                                          int32_t min,
+                                          int32_t max,
+                                          size_t* bad_index) {
+  return MessageViewIntArray(message, target, count, min, max, bad_index);
+}
+
+ssize_t transact_message_read_int64_array(struct transact_message* message,
+                                          int64_t* target,
+                                          size_t count,
+                                          int64_t min,
+                                          int64_t max,
+                                          size_t* bad_index) {
+  return MessageReadIntArray(message, target, count, min, max, bad_index);
+}
+
+ssize_t transact_message_view_int64_array(struct transact_message* message,
+                                          const int64_t** target,
+                                          size_t count,
+                                          int64_t min,
+                                          int64_t max,
+                                          size_t* bad_index) {
+  return MessageViewIntArray(message, target, count, min, max, bad_index);
+}
+
+// Writes |len| bytes into the streamed |message|, handing chunks over to the
+// peer as they fill up.
+static ssize_t MessageWriteChunks(struct transact_message* message,
+                                  const void* source,
+                                  size_t len) {
+  const char* src = reinterpret_cast<const char*>(source);
+  size_t capacity =
+      message->end - (MessageDataStart(message) + sizeof(ChunkHeader));
+  size_t remaining = len;
+  while (remaining > 0) {
+    size_t available = message->end - message->data;
+    // Only writes that are larger than a whole chunk are split.
+    if (available == 0 || (remaining > available && remaining <= capacity)) {
+      int res = MessageFlushChunk(message);
+      if (res == 0)
+        errno = EPIPE;
+      if (res != 1)
+        return -1;
+      continue;
+    }
+    size_t n = remaining < available ? remaining : available;
+    memcpy(message->data, src, n);
+    message->data += n;
+    src += n;
+    remaining -= n;
+  }
+  return len;
+}
+
+ssize_t transact_message_write(struct transact_message* message,
+                               const void* source,
+                               size_t len) {
+  if (!message) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  if (message->data + len > message->end) {
+    if (!(message->flags & kMessageStream))
+      return 0;
+    return MessageWriteChunks(message, source, len);
+  }
+  memcpy(message->data, source, len);
+  message->data += len;
+  return len;
+}
+
+int transact_replay(struct transact_interface* interface,
+                    const char* log_filename) {
+  if (!interface) {
+    errno = EFAULT;
+    return -1;
+  }
+
+  ScopedFD fd(open(log_filename, O_RDONLY | O_CLOEXEC));
+  if (!fd)
+    return -1;
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1)
+    return -1;
+  size_t len = st.st_size;
+  if (len < sizeof(transact_log_header)) {
+    errno = EINVAL;
+    return -1;
+  }
+  const char* log = reinterpret_cast<const char*>(
+      mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd.get(), 0));
+  if (log == MAP_FAILED)
+    return -1;
+
+  const transact_log_header* header =
+      reinterpret_cast<const transact_log_header*>(log);
+  int res = 0;
+  if (memcmp(header->magic, TRANSACT_LOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != TRANSACT_LOG_VERSION ||
+      static_cast<int>(header->is_parent) != interface->is_parent) {
+    errno = EINVAL;
+    res = -1;
+  }
+
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  size_t offset = sizeof(transact_log_header);
+  for (uint64_t i = 0; res == 0 && i < header->records; i++) {
+    const transact_log_record* record =
+        reinterpret_cast<const transact_log_record*>(log + offset);
+    if (len - offset < sizeof(transact_log_record) ||
+        len - offset < LogRecordSize(record->size)) {
+      errno = EINVAL;
+      res = -1;
+      break;
+    }
+    offset += LogRecordSize(record->size);
+
+    int allocated =
+        record->flags & TRANSACT_LOG_RECORD_STREAM
+            ? transact_message_allocate_stream(&message, record->msgid,
+                                               record->chunk_len)
+            : transact_message_allocate(&message, record->msgid,
+                                        record->size);
+    if (allocated == -1) {
+      res = -1;
+      break;
+    }
+    if (transact_message_write(&message, record + 1, record->size) == -1) {
+      // The peer is gone halfway through a stream.
+      if (errno != EPIPE)
+        res = -1;
+      break;
+    }
+    int sent = transact_message_send(&message);
+    if (sent == -1)
+      res = -1;
+    if (sent != 1)
+      break;
+  }
+
+  int saved_errno = errno;
+  munmap(const_cast<char*>(log), len);
+  errno = saved_errno;
+  return res;
+}
+
+namespace {
+
+struct HubSession {
+  transact_interface* interface;
+  transact_message message;
+  transact_turn_fn fn;
+  void* arg;
+  HubSession* next;
+  // Whether the transact file is in the epoll set. It is only added once the
+  // parent hands control over for the first time: a registration that is
+  // disabled would still report the death of the child before that, while a
+  // worker might be running the session's first turn.
+  bool registered = false;
+};
+
+}  // namespace
+
+struct transact_hub {
+  ScopedFD epoll_fd;
+  // Becomes readable once every session is over, to release all workers.
+  ScopedFD done_fd;
+  int threads;
+  HubSession* sessions = nullptr;
+  // The sessions whose first turn has not been claimed by a worker yet.
+  HubSession* unstarted = nullptr;
+  int live = 0;
+  int error = 0;
+
+  ~transact_hub() {
+    while (sessions) {
+      HubSession* session = sessions;
+      sessions = session->next;
+      transact_interface_close(session->interface);
+      delete session;
+    }
+  }
+};
+
+namespace {
+
+void HubEndSession(transact_hub* hub, HubSession* session, int error) {
+  if (session->registered) {
+    epoll_ctl(hub->epoll_fd.get(), EPOLL_CTL_DEL,
+              session->interface->transact_fd.get(), nullptr);
+  }
+  if (error) {
+    // Only the first failure is reported by transact_hub_run().
+    int expected = 0;
+    __atomic_compare_exchange_n(&hub->error, &expected, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  if (__atomic_sub_fetch(&hub->live, 1, __ATOMIC_ACQ_REL) == 0) {
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(hub->done_fd.get(), &one, sizeof(one)));
+  }
+}
+
+// Tries to collect control of |session| back from its child. Returns 1 if it
+// is the parent's turn, 0 if the child is gone, and -1 if the child is still
+// running (or on error, with errno set to something other than EAGAIN).
+int HubCollect(HubSession* session) {
+  unsigned long long response;
+  ssize_t read_bytes = read(session->interface->transact_fd.get(), &response,
+                            sizeof(response));
+  if (read_bytes == 0)
+    return 0;
+  if (read_bytes != sizeof(response))
+    return -1;
+  if (session->interface->recorder)
+    session->interface->recorder->Resumed();
+  if (session->interface->timeline)
+    session->interface->timeline->Resumed();
+  MessageSendEnd(&session->message);
+  return 1;
+}
+
+// Runs turns of |session| for as long as its child keeps answering
+// immediately, and then hands it back to the epoll set.
+void HubRunSession(transact_hub* hub, HubSession* session, bool collected) {
+  for (;;) {
+    if (collected) {
+      if (transact_message_recv(&session->message) == -1) {
+        HubEndSession(hub, session, errno);
+        return;
+      }
+    }
+    int res = session->fn(&session->message, session->arg);
+    if (res != 1) {
+      HubEndSession(hub, session, res == 0 ? 0 : errno ? errno : EIO);
+      return;
+    }
+    if (!MessageSendBegin(&session->message)) {
+      HubEndSession(hub, session, errno);
+      return;
+    }
+    // The first non-blocking read hands control over to the child.
+    res = HubCollect(session);
+    if (res == 0) {
+      HubEndSession(hub, session, 0);
+      return;
+    }
+    if (res == -1) {
+      if (errno != EAGAIN) {
+        HubEndSession(hub, session, errno);
+        return;
+      }
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.ptr = session;
+      if (epoll_ctl(hub->epoll_fd.get(),
+                    session->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                    session->interface->transact_fd.get(), &event) == -1) {
+        HubEndSession(hub, session, errno);
+        return;
+      }
+      session->registered = true;
+      return;
+    }
+    collected = true;
+  }
+}
+
+void* HubWorkerMain(void* arg) {
+  transact_hub* hub = reinterpret_cast<transact_hub*>(arg);
+  for (;;) {
+    HubSession* session = __atomic_load_n(&hub->unstarted, __ATOMIC_ACQUIRE);
+    while (session &&
+           !__atomic_compare_exchange_n(&hub->unstarted, &session,
+                                        session->next, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+    }
+    if (session) {
+      HubRunSession(hub, session, false);
+      continue;
+    }
+
+    struct epoll_event event;
+    int ready = epoll_wait(hub->epoll_fd.get(), &event, 1, -1);
+    if (ready == -1 && errno == EINTR)
+      continue;
+    if (ready != 1 || !event.data.ptr)
+      return nullptr;
+    session = reinterpret_cast<HubSession*>(event.data.ptr);
+    int res = HubCollect(session);
+    if (res == 1) {
+      HubRunSession(hub, session, true);
+    } else if (res == 0 || errno != EAGAIN) {
+      HubEndSession(hub, session, res == 0 ? 0 : errno);
+    } else {
+      // Spurious wakeup: the child still has control.
+      event.events = EPOLLIN | EPOLLONESHOT;
+      if (epoll_ctl(hub->epoll_fd.get(), EPOLL_CTL_MOD,
+                    session->interface->transact_fd.get(), &event) == -1) {
+        HubEndSession(hub, session, errno);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+struct transact_hub* transact_hub_new(int threads) {
+  if (threads < 0) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  std::unique_ptr<transact_hub> hub(new transact_hub());
+  if (!hub) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  hub->threads = threads > 0 ? threads : 1;
+  hub->epoll_fd.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (!hub->epoll_fd)
+    return nullptr;
+  hub->done_fd.reset(eventfd(0, EFD_CLOEXEC));
+  if (!hub->done_fd)
+    return nullptr;
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (epoll_ctl(hub->epoll_fd.get(), EPOLL_CTL_ADD, hub->done_fd.get(),
+                &event) == -1) {
+    return nullptr;
+  }
+  return hub.release();
+}
+
+int transact_hub_add(struct transact_hub* hub,
+                     struct transact_interface* interface,
+                     transact_turn_fn fn,
+                     void* arg) {
+  if (!hub || !interface || !fn) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!interface->is_parent || interface->pair) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  std::unique_ptr<HubSession> session(new HubSession());
+  if (!session) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // Sessions collect control back with plain non-blocking reads, which cannot
+  // carry inline messages in either direction.
+  interface->switch_inline = false;
+  AdvertiseInline(interface);
+  int fd = interface->transact_fd.get();
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+
+  session->interface = interface;
+  transact_message_init(interface, &session->message);
+  session->fn = fn;
+  session->arg = arg;
+  session->next = hub->sessions;
+  hub->sessions = session.release();
+  hub->live++;
+  return 0;
+}
+
+int transact_hub_run(struct transact_hub* hub) {
+  if (!hub) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (hub->live == 0)
+    return 0;
+
+  hub->unstarted = hub->sessions;
+  hub->error = 0;
+  std::unique_ptr<pthread_t, FreeDeleter> workers(reinterpret_cast<pthread_t*>(
+      malloc(sizeof(pthread_t) * hub->threads)));
+  if (!workers) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // The calling thread is one of the workers.
+  int started = 0;
+  for (; started < hub->threads - 1; started++) {
+    if (pthread_create(&workers.get()[started], nullptr, HubWorkerMain,
+                       hub) != 0) {
+      break;
+    }
+  }
+  HubWorkerMain(hub);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers.get()[i], nullptr);
+
+  if (hub->error) {
+    errno = hub->error;
+    return -1;
+  }
+  return 0;
+}
+
+void transact_hub_free(struct transact_hub* hub) {
+  delete hub;
 }
@@ -39,6 +39,7 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -66,6 +67,294 @@ struct transact_interface* transact_interface_open(
     const char* shm_filename,
     size_t shm_len);
 
+/*
+ * The layout of the message blocks in the shared memory region.
+ */
+enum transact_format {
+  /*
+   * 64-byte blocks with a 32-byte header. This is the only format the Python
+   * module understands.
+   */
+  TRANSACT_FORMAT_LEGACY = 0,
+
+  /*
+   * 64-byte blocks with a 16-byte header, so that up to 48 bytes of payload
+   * fit in a single cache line.
+   */
+  TRANSACT_FORMAT_COMPACT = 1,
+};
+
+/*
+ * Where the two peers run relative to each other. If the topology cannot
+ * satisfy a policy, the next looser one is used instead.
+ */
+enum transact_placement {
+  /* Leave CPU and memory placement to the kernel. */
+  TRANSACT_PLACEMENT_NONE = 0,
+
+  /* Pin the peers to sibling hardware threads of the same core. */
+  TRANSACT_PLACEMENT_SHARED_CORE = 1,
+
+  /* Pin the peers to different cores that share the last-level cache. */
+  TRANSACT_PLACEMENT_SHARED_CACHE = 2,
+
+  /* Restrict both peers to the CPUs of a single NUMA node. */
+  TRANSACT_PLACEMENT_SAME_NODE = 3,
+};
+
+/*
+ * Options that can be passed to transact_interface_open_with_options().
+ */
+struct transact_options {
+  /*
+   * One of the transact_format values. Only the parent's choice is honored:
+   * the child always adopts the format the parent chose, and fails with
+   * EPROTO if it does not understand it.
+   */
+  int format;
+
+  /*
+   * If not NULL, every message sent through the interface is appended to a
+   * log at this path (see transact_log_header), which can later be played
+   * back with transact_replay(). If the log cannot grow any further,
+   * recording stops and the log keeps the messages sent until then, but
+   * messages are still sent. A parent that pairs up again with
+   * transact_interface_reset() keeps appending to the same log. Ignored by
+   * transact_run_inprocess().
+   */
+  const char* record_filename;
+
+  /*
+   * One of the transact_placement values. Only the parent's choice is
+   * honored: the child pins itself wherever the parent decided. In every
+   * policy other than TRANSACT_PLACEMENT_NONE, the shared memory region is
+   * also bound to the NUMA node of the parent's CPU. Ignored by
+   * transact_run_inprocess().
+   */
+  int placement;
+
+  /*
+   * The CPU the parent is pinned to, and around which the child's CPU is
+   * chosen. -1 means whichever CPU the parent is running on. Giving each pair
+   * its own CPU allows packing many of them per host.
+   */
+  int cpu;
+
+  /*
+   * The number of lanes (between 1 and TRANSACT_MAX_LANES) the shared memory
+   * region is split into. Each lane has its own turn and its own equal share
+   * of the region to allocate messages from, so that a different pair of
+   * threads can use each one without contending with the others. Lane 0 is
+   * the interface itself, and the rest are opened with
+   * transact_interface_open_lane(). Only the parent's choice is honored.
+   * Ignored by transact_run_inprocess().
+   */
+  int lanes;
+
+  /*
+   * If not NULL, a transact_stats record describing how much of the shared
+   * memory region was used is appended to the file at this path when the
+   * interface is closed, so that the records of many runs can be aggregated
+   * with transact-shm-size to pick the region size.
+   */
+  const char* stats_filename;
+
+  /*
+   * The |idempotent_methods_len| method ids in |idempotent_methods| are the
+   * ones whose answer only depends on the bytes of the request, so that a
+   * peer with a response cache can answer repeated requests by itself. Only
+   * the parent can declare them, and at most TRANSACT_MAX_IDEMPOTENT_METHODS.
+   * Ignored by transact_run_inprocess().
+   */
+  const int* idempotent_methods;
+  int idempotent_methods_len;
+
+  /*
+   * If not 0, the child keeps the answers to up to this many requests for
+   * the methods the parent declared idempotent, and serves repeated requests
+   * from them without handing control over. Requests and answers of up to
+   * TRANSACT_MAX_CACHED_LEN bytes are cached. Such a child does not take
+   * replies written over its requests (see transact_message_reply()).
+   * Ignored by lanes and by transact_run_inprocess().
+   */
+  int response_cache_entries;
+
+  /*
+   * If not -1, a sealed file (see transact_segment_create()) that the parent
+   * shares with the child as a read-only segment, outside of the shared
+   * memory region. The child maps it at open, through |segment_fd| if it
+   * received the descriptor some other way, through the parent's
+   * |segment_fd| if it inherited it with the same number, or otherwise by
+   * reopening the parent's descriptor through /proc. Ignored by
+   * transact_run_inprocess().
+   */
+  int segment_fd;
+
+  /*
+   * If not 0, the shared memory region ends with a ring of this many
+   * transact_timeline_record entries (rounded up to a power of two, and at
+   * most TRANSACT_MAX_TIMELINE_ENTRIES), to which both sides append a record
+   * every time they hand control over. It is read with
+   * transact_timeline_read(). Only the parent's choice is honored, and the
+   * ring takes its room from the arena. Ignored by transact_run_inprocess().
+   */
+  int timeline_entries;
+};
+
+#define TRANSACT_MAX_LANES 64
+#define TRANSACT_MAX_IDEMPOTENT_METHODS 1024
+#define TRANSACT_MAX_CACHED_LEN 4096
+#define TRANSACT_MAX_TIMELINE_ENTRIES (1 << 20)
+
+/*
+ * Initializes |options| with the default values used by
+ * transact_interface_open().
+ */
+void transact_options_init(struct transact_options* options);
+
+/*
+ * Same as transact_interface_open(), but allows passing |options|. If
+ * |options| is NULL, the defaults are used.
+ */
+struct transact_interface* transact_interface_open_with_options(
+    int is_parent,
+    const char* transact_filename,
+    const char* shm_filename,
+    size_t shm_len,
+    const struct transact_options* options);
+
+/*
+ * Creates a connected pair of transact file descriptors through the control
+ * node at |control_filename| (see mktransact -c), without needing a transact
+ * file for every pair. |fds[0]| must be used by the parent and |fds[1]| by the
+ * child, typically after being inherited across fork() and exec(). |flags|
+ * can contain O_CLOEXEC and O_NONBLOCK. Returns 0 on success, -1 on failure.
+ *
+ * The death of a peer is only noticed once every copy of its descriptor is
+ * closed, so after fork() each side must close the descriptor of the other
+ * one. Otherwise the survivor blocks forever when its peer dies.
+ */
+int transact_pair_create(const char* control_filename, int flags, int fds[2]);
+
+/*
+ * Same as transact_interface_open_with_options(), but pairs up through
+ * |transact_fd|, one of the file descriptors created by
+ * transact_pair_create(). The interface takes ownership of |transact_fd|, even
+ * if this function fails. Such interfaces cannot be reset.
+ */
+struct transact_interface* transact_interface_open_fd(
+    int is_parent,
+    int transact_fd,
+    const char* shm_filename,
+    size_t shm_len,
+    const struct transact_options* options);
+
+/*
+ * Modes for transact_run_inprocess().
+ */
+enum transact_inprocess_mode {
+  /*
+   * The child runs in a new thread. Switching control is a futex handoff.
+   */
+  TRANSACT_INPROCESS_THREADS = 0,
+
+  /*
+   * Both peers run as stackful coroutines in the calling thread, and switching
+   * control is a user-level context switch that does not enter the kernel.
+   * The child gets a 64 MiB stack. Only available on x86-64; elsewhere
+   * transact_run_inprocess() fails with ENOSYS.
+   */
+  TRANSACT_INPROCESS_COROUTINES = 1,
+};
+
+/*
+ * The entry point of each of the peers run by transact_run_inprocess().
+ */
+typedef void (*transact_peer_fn)(struct transact_interface* interface,
+                                 void* arg);
+
+/*
+ * Runs |parent| and |child| within the current process, connected to each
+ * other through a private |shm_len|-byte arena instead of the kernel module
+ * and a shared memory file. Message semantics are the same as with
+ * transact_interface_open(): |parent| runs first, |child| starts once
+ * |parent| calls transact_message_send() for the first time, and at most one
+ * of them runs at any given point in time.
+ *
+ * Each peer gets its own interface, which is closed when the peer function
+ * returns (the functions must not close it themselves). At that point any
+ * pending or future transact_message_send() from the other peer returns 0.
+ * This function returns once both peers have returned.
+ */
+int transact_run_inprocess(int mode,
+                           size_t shm_len,
+                           const struct transact_options* options,
+                           transact_peer_fn parent,
+                           void* parent_arg,
+                           transact_peer_fn child,
+                           void* child_arg);
+
+/*
+ * The placement that was applied to one side of a connection.
+ */
+struct transact_placement_info {
+  /* One of the transact_placement values. */
+  int placement;
+
+  /* The CPUs the peers are pinned to, or -1 if not pinned to a single one. */
+  int parent_cpu;
+  int child_cpu;
+
+  /* The NUMA node the shared memory region is bound to, or -1. */
+  int node;
+};
+
+/*
+ * Fills |info| with the placement that was chosen for |interface|, after any
+ * fallback. A child whose affinity could not be changed reports
+ * TRANSACT_PLACEMENT_NONE. Returns 0 on success, -1 on failure.
+ */
+int transact_interface_get_placement(
+    const struct transact_interface* interface,
+    struct transact_placement_info* info);
+
+/*
+ * Pairs a parent |interface| up with a new child process, once the previous
+ * one has exited, without unmapping the shared memory region. All messages
+ * are freed and the allocator starts over, but the pages touched in previous
+ * sessions stay resident. This blocks until the new child opens the transact
+ * file, just like transact_interface_open() does.
+ *
+ * The log of transact_options::record_filename, if any, keeps going across
+ * pairings: it holds the messages sent to every child back to back, with
+ * nothing marking where one pairing ended.
+ *
+ * Returns 0 on success. On failure, returns -1 and sets errno: EINVAL if
+ * |interface| is not the parent side of a connection established by
+ * transact_interface_open(), and EBUSY if a message prepared with
+ * transact_message_prepare() has not been released with
+ * transact_message_unprepare() yet, or if the previous child still has the
+ * transact file open. After a failure other than a prepared message, the only
+ * valid operations are another transact_interface_reset() or
+ * transact_interface_close().
+ */
+int transact_interface_reset(struct transact_interface* interface);
+
+/*
+ * Opens lane |lane| of |interface|, which must be between 1 and one less than
+ * the number of lanes the parent asked for in transact_options::lanes. The
+ * returned interface is used exactly like any other one, and takes turns with
+ * the peer's interface for the same lane independently of every other lane.
+ * This blocks until the peer opens the same lane.
+ *
+ * Every lane must be closed before |interface| is, and before it is reset.
+ * Returns NULL and sets errno on failure: EINVAL if |lane| is out of range or
+ * |interface| is itself a lane or was created by transact_run_inprocess().
+ */
+struct transact_interface* transact_interface_open_lane(
+    struct transact_interface* interface,
+    int lane);
+
 /*
  * Closes the transact connection. The peer process will be notified of the
  * closure.
@@ -80,7 +369,7 @@ struct transact_message {
   struct transact_interface* interface;
   void* message;
   int method_id;
-  int padding;
+  int flags;  /* Reserved for libtransact. */
 
   char* data;
   char* end;
@@ -107,11 +396,40 @@ int transact_message_init(struct transact_interface* interface,
 /*
  * Allocates |len| bytes in the shared memory area and sets up |message|'s
  * |data| and |end| pointers so that they can be used to write the message.
+ *
+ * When both peers support it, messages of up to 56 bytes are instead carried
+ * by the switch itself and never touch the shared memory area. Only one such
+ * message can be outstanding per interface; while it is, further small
+ * messages are allocated in shared memory as usual.
  */
 int transact_message_allocate(struct transact_message* message,
                               int id,
                               size_t len);
 
+/*
+ * Allocates a streamed message, which can hold more data than fits in the
+ * shared memory area. Only a chunk of up to |chunk_len| bytes (or less, if the
+ * area is too full for that) is allocated, and it must be filled with
+ * transact_message_write(): whenever a write does not fit in what is left of
+ * the chunk, the chunk is handed over to the peer, which consumes it through
+ * transact_message_read() and transact_message_read_array() as if it were
+ * part of a regular message, and control comes back once it needs the next
+ * one. The last chunk is handed over by transact_message_send(). Writes of up
+ * to |chunk_len| bytes are never split across chunks, so the peer can use
+ * transact_message_read_array() for them, but arrays returned by it are only
+ * valid until the next chunk is read.
+ *
+ * If the peer sends a message of its own instead of reading the whole stream,
+ * transact_message_write() fails with EPROTO and releases |message|, and the
+ * peer's message can be received with transact_message_recv(). Streamed
+ * messages cannot be used on interfaces served by a transact_hub. Peers that
+ * do not support them fail to receive them: libtransact with EMSGSIZE, and
+ * the Python binding with IOError.
+ */
+int transact_message_allocate_stream(struct transact_message* message,
+                                     int id,
+                                     size_t chunk_len);
+
 /*
  * Fills the |message| data structure in a way its |data| and |end| pointers
  * can be used for reading the message after control has been handed off from
@@ -128,7 +446,73 @@ int transact_message_recv(struct transact_message* message);
 int transact_message_send(struct transact_message* message);
 
 /*
- * Reads exactly |len| bytes from |message|.
+ * Turns the request that was just received in |message| into a reply with the
+ * given |id| and room for |len| bytes, to be sent back with
+ * transact_message_send(). If the request's own block is large enough and the
+ * peer supports it, the reply is written over the request without going
+ * through the allocator, so everything needed from the request must be read
+ * before calling this function. Otherwise it behaves like
+ * transact_message_allocate().
+ */
+int transact_message_reply(struct transact_message* message,
+                           int id,
+                           size_t len);
+
+/*
+ * Handles one request received by transact_serve(). |message| holds the
+ * request, whose method id selected the handler. The handler must reply with
+ * transact_message_reply() (or transact_message_allocate()) and fill the
+ * reply in, and return 0, or return -1 with errno set to stop serving.
+ */
+typedef int (*transact_handler_fn)(struct transact_message* message,
+                                   void* arg);
+
+/*
+ * Serves requests from the peer of |interface| until it goes away: every
+ * request is dispatched to |handlers[method_id]| along with |arg|, and its
+ * reply sent back. A parent that has not sent anything yet hands control over
+ * first, so that the child can send the first request. Returns 0 once the
+ * peer is gone, or -1 with errno set on error, including ENOSYS for requests
+ * with no handler and EPROTO for handlers that did not reply.
+ */
+int transact_serve(struct transact_interface* interface,
+                   const transact_handler_fn* handlers,
+                   size_t handlers_len,
+                   void* arg);
+
+/*
+ * Allocates |len| bytes in the shared memory area for |message| like
+ * transact_message_allocate() does, but pins the block to |message|:
+ * transact_message_send() will not release it back to the allocator, and
+ * after it returns |message| is ready to be written and sent again without
+ * any further allocation. This is intended for calls that are made over and
+ * over with the same method id and payload size. Preparing all messages right
+ * after opening the interface lays them out contiguously in the shared memory
+ * region.
+ *
+ * A prepared message cannot be used with transact_message_allocate() or
+ * transact_message_recv() until it is released with
+ * transact_message_unprepare().
+ */
+int transact_message_prepare(struct transact_message* message,
+                             int id,
+                             size_t len);
+
+/*
+ * Moves the |data| pointer of a prepared |message| back to the beginning of
+ * its block, so that it can be rewritten from scratch.
+ */
+int transact_message_rewind(struct transact_message* message);
+
+/*
+ * Releases the block pinned by transact_message_prepare() back to the
+ * allocator.
+ */
+int transact_message_unprepare(struct transact_message* message);
+
+/*
+ * Reads exactly |len| bytes from |message|, pulling in the next chunks of a
+ * streamed message as needed.
  */
 ssize_t transact_message_read(struct transact_message* message,
                               void* target,
@@ -142,12 +526,302 @@ ssize_t transact_message_read_array(struct transact_message* message,
                                     size_t len);
 
 /*
- * Writes exactly |len| bytes into |message|.
+ * Copies the next |count| 32-bit integers of |message| into |target|, and
+ * checks that every one of them lies within [|min|, |max|] in the same pass.
+ * Returns the number of bytes read, or 0 if |message| does not have that many
+ * left. If some integer is out of range, the message is still advanced past
+ * the array, but -1 is returned with errno set to ERANGE and the index of the
+ * first offending integer is stored in |*bad_index| (if not NULL).
+ */
+ssize_t transact_message_read_int32_array(struct transact_message* message,
+                                          int32_t* target,
+                                          size_t count,
+                                          int32_t min,
+                                          int32_t max,
+                                          size_t* bad_index);
+
+/*
+ * Same as transact_message_read_int32_array(), but makes |*target| point to
+ * the integers in place instead of copying them, like
+ * transact_message_read_array() does.
+ */
+ssize_t transact_message_view_int32_array(struct transact_message* message,
+                                          const int32_t** target,
+                                          size_t count,
+                                          int32_t min,
+                                          int32_t max,
+                                          size_t* bad_index);
+
+/*
+ * The 64-bit counterparts of transact_message_read_int32_array() and
+ * transact_message_view_int32_array().
+ */
+ssize_t transact_message_read_int64_array(struct transact_message* message,
+                                          int64_t* target,
+                                          size_t count,
+                                          int64_t min,
+                                          int64_t max,
+                                          size_t* bad_index);
+ssize_t transact_message_view_int64_array(struct transact_message* message,
+                                          const int64_t** target,
+                                          size_t count,
+                                          int64_t min,
+                                          int64_t max,
+                                          size_t* bad_index);
+
+/*
+ * Writes exactly |len| bytes into |message|, handing full chunks of a
+ * streamed message over to the peer as needed.
  */
 ssize_t transact_message_write(struct transact_message* message,
                                const void* source,
                                size_t len);
 
+/*
+ * The log written when transact_options::record_filename is set. It starts
+ * with a transact_log_header, followed by one transact_log_record per message
+ * sent, in order. All fields are in host byte order.
+ */
+#define TRANSACT_LOG_MAGIC "TRLOG\0\0\0"
+#define TRANSACT_LOG_VERSION 2
+
+struct transact_log_header {
+  char magic[8];
+  uint32_t version;
+  /* Whether the log was recorded by the parent side of the connection. */
+  uint32_t is_parent;
+  /*
+   * The number of records that were completely written. Anything after them,
+   * such as the preallocated tail of a log whose process died, is not part
+   * of the log.
+   */
+  uint64_t records;
+};
+
+/* Set in transact_log_record::flags for a streamed message. */
+#define TRANSACT_LOG_RECORD_STREAM 1
+
+struct transact_log_record {
+  /*
+   * CLOCK_MONOTONIC time, in nanoseconds, when the message (or the first
+   * chunk of a streamed message) was sent.
+   */
+  uint64_t sent_ns;
+  /*
+   * CLOCK_MONOTONIC time, in nanoseconds, when control came back (after the
+   * last chunk of a streamed message).
+   */
+  uint64_t resumed_ns;
+  int32_t msgid;
+  /*
+   * The payload capacity of the message, which is recorded in full. For a
+   * streamed message, the payload of all of its chunks, back to back.
+   */
+  uint32_t size;
+  /* A combination of the TRANSACT_LOG_RECORD_* flags. */
+  uint32_t flags;
+  /* The capacity of each chunk of a streamed message. */
+  uint32_t chunk_len;
+  /* Followed by |size| bytes of payload, padded to a multiple of 8 bytes. */
+};
+
+/*
+ * How much of the shared memory region an interface used. This is what is
+ * appended to transact_options::stats_filename when the interface is closed.
+ * Sizes are in 64-byte blocks, and all fields are in host byte order.
+ */
+#define TRANSACT_STATS_MAGIC "TRSTATS\0"
+#define TRANSACT_STATS_VERSION 1
+#define TRANSACT_STATS_CLASSES 32
+
+struct transact_stats {
+  char magic[8];
+  uint32_t version;
+  uint32_t is_parent;
+  uint64_t shm_len;
+  uint32_t lanes;
+  uint32_t format;
+  /* The number of blocks available to the allocator of each lane. */
+  uint64_t arena_blocks;
+  /* The most blocks the allocator of any lane has ever handed out. */
+  uint64_t peak_blocks;
+  /*
+   * The blocks handed out for messages that take from 2^i to 2^(i+1) - 1
+   * blocks, at their peak. Blocks are only ever reused for messages of
+   * exactly the same size, so this is also the peak usage of each class.
+   */
+  uint64_t class_blocks[TRANSACT_STATS_CLASSES];
+  /* Blocks that had been handed out but were free when the stats were taken. */
+  uint64_t idle_blocks;
+  /*
+   * The payload bytes this side asked for, and the bytes of the blocks that
+   * held them. The difference is lost to rounding up to whole blocks.
+   */
+  uint64_t requested_bytes;
+  uint64_t allocated_bytes;
+  /* The allocations by this side that failed with ENOMEM. */
+  uint64_t failed_allocations;
+};
+
+/*
+ * Fills |stats| with the shared memory usage of |interface| so far. Lanes
+ * report their allocations through the interface they were opened from once
+ * they are closed. Returns 0 on success, -1 on failure.
+ */
+int transact_interface_get_stats(struct transact_interface* interface,
+                                 struct transact_stats* stats);
+
+/*
+ * The turn timeline kept at the end of the shared memory region when
+ * transact_options::timeline_entries is set. Times are in ticks of the
+ * timestamp counter, which can be converted to nanoseconds through the
+ * CLOCK_MONOTONIC readings taken along with |start_ticks| and |end_ticks|.
+ */
+#define TRANSACT_TIMELINE_MAGIC "TRTMLINE"
+#define TRANSACT_TIMELINE_VERSION 1
+
+struct transact_timeline_header {
+  char magic[8];
+  uint32_t version;
+  /* The capacity of the ring, a power of two. */
+  uint32_t entries;
+  /* The number of records appended so far, including overwritten ones. */
+  uint64_t count;
+  /* Taken by the parent when it opened the interface. */
+  uint64_t start_ticks;
+  uint64_t start_ns;
+  /* Taken every time a side closes its interface, or 0 while both run. */
+  uint64_t end_ticks;
+  uint64_t end_ns;
+  uint64_t reserved;
+  /* Followed by |entries| transact_timeline_record entries. */
+};
+
+struct transact_timeline_record {
+  /*
+   * The low 32 bits of the position of the record in the timeline, plus one.
+   * 0 in entries that have not been written yet.
+   */
+  uint32_t seq;
+  int32_t msgid;
+  /* The payload capacity of the message that was handed over. */
+  uint32_t size;
+  /* Whether it was the parent who handed control over. */
+  uint32_t is_parent;
+  /* When control was handed over, and when it came back (0 if it has not). */
+  uint64_t handoff_ticks;
+  uint64_t wakeup_ticks;
+};
+
+/*
+ * Copies the timeline header of the shared memory region in |shm_filename|
+ * into |header|, and up to |max| of its latest records, oldest first, into
+ * |records|. The region can be read while the peers are still running, in
+ * which case records that were overwritten while being copied have an
+ * unexpected |seq|. Returns the number of records copied, or -1 on failure,
+ * with errno set to ENOENT if the region has no timeline.
+ */
+ssize_t transact_timeline_read(const char* shm_filename,
+                               struct transact_timeline_header* header,
+                               struct transact_timeline_record* records,
+                               size_t max);
+
+/*
+ * Creates a sealed, read-only segment holding a copy of the |len| bytes at
+ * |data|, to be shared with children through transact_options::segment_fd.
+ * The same segment can be shared with any number of children, which all map
+ * the same pages. |name| only shows up in /proc. Returns a file descriptor
+ * that the caller must close, or -1 on failure.
+ */
+int transact_segment_create(const char* name, const void* data, size_t len);
+
+/*
+ * Returns the read-only segment that the parent shared through
+ * transact_options::segment_fd, and stores its length in |*len|. Returns NULL
+ * with errno set to ENOENT if there is none.
+ */
+const void* transact_interface_get_segment(struct transact_interface* interface,
+                                           size_t* len);
+
+/*
+ * How well the response cache of an interface (see
+ * transact_options::response_cache_entries) is doing.
+ */
+struct transact_cache_stats {
+  /* Requests that were answered from the cache. */
+  uint64_t hits;
+  /* Requests for idempotent methods that had to be sent to the peer. */
+  uint64_t misses;
+};
+
+/*
+ * Fills |stats| with the response cache counters of |interface|, which are
+ * all zero if it has no cache. Returns 0 on success, -1 on failure.
+ */
+int transact_interface_get_cache_stats(
+    const struct transact_interface* interface,
+    struct transact_cache_stats* stats);
+
+/*
+ * Plays back the messages recorded in |log_filename| through |interface|, as
+ * fast as possible, in place of the process that recorded them. Each
+ * recorded message is sent as-is and whatever the peer answers is ignored.
+ * |interface| must have been opened with the same role (parent or child) as
+ * the one that recorded the log. Returns 0 once the log is exhausted or the
+ * peer is gone.
+ */
+int transact_replay(struct transact_interface* interface,
+                    const char* log_filename);
+
+/*
+ * A hub drives many parent interfaces from a small pool of threads, so that a
+ * single process can serve many children at once without dedicating a thread
+ * to each one. Requires a kernel module with non-blocking read and poll
+ * support.
+ */
+struct transact_hub;
+
+/*
+ * Runs one turn of a session served by a hub. |message| is the session's
+ * message: on the first turn nothing has been received yet, and afterwards it
+ * holds whatever the child sent back. The function must leave a message
+ * allocated in |message| to be sent to the child, and return 1 to keep going,
+ * 0 to end the session or -1 (with errno set) on error. Turns of the same
+ * session never run concurrently, but different sessions might run in
+ * parallel.
+ */
+typedef int (*transact_turn_fn)(struct transact_message* message, void* arg);
+
+/*
+ * Creates a hub that runs its sessions in |threads| threads (including the one
+ * that calls transact_hub_run()), or as many threads as there are online CPUs
+ * if |threads| is 0.
+ */
+struct transact_hub* transact_hub_new(int threads);
+
+/*
+ * Adds the parent |interface| to |hub|, which takes ownership of it. The
+ * interface must have been opened with transact_interface_open() and must not
+ * have sent any message yet. Fails with EINVAL for child or in-process
+ * interfaces.
+ */
+int transact_hub_add(struct transact_hub* hub,
+                     struct transact_interface* interface,
+                     transact_turn_fn fn,
+                     void* arg);
+
+/*
+ * Serves every session in |hub| until all of them are over, either because a
+ * turn function returned 0 or the child went away. Returns 0 on success, or
+ * -1 with errno set to the first error that ended a session.
+ */
+int transact_hub_run(struct transact_hub* hub);
+
+/*
+ * Closes all the interfaces in |hub| and frees it.
+ */
+void transact_hub_free(struct transact_hub* hub);
+
 #ifdef __cplusplus
 }
 #endif
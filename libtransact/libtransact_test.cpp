@@ -0,0 +1,602 @@
+// Tests for libtransact that need neither the kernel module nor a peer
+// process. The whole library is compiled into the test, so that the
+// allocator, the lane layout and the range checks can be driven directly.
+// Whatever needs a peer runs through transact_run_inprocess().
+
+#include "libtransact.cpp"
+
+#include <limits>
+#include <type_traits>
+
+namespace {
+
+int g_failures = 0;
+
+#define EXPECT(condition)                                              \
+  do {                                                                 \
+    if (!(condition)) {                                                \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      __atomic_add_fetch(&g_failures, 1, __ATOMIC_RELAXED);            \
+    }                                                                  \
+  } while (0)
+
+const int kFormats[] = {TRANSACT_FORMAT_LEGACY, TRANSACT_FORMAT_COMPACT};
+const int kModes[] = {TRANSACT_INPROCESS_THREADS,
+                      TRANSACT_INPROCESS_COROUTINES};
+
+// The number of bytes in front of the payload of every block.
+size_t PayloadOffset(int format) {
+  return format == TRANSACT_FORMAT_COMPACT ? offsetof(CompactMessage, data)
+                                           : offsetof(Message, data);
+}
+
+// Returns an interface onto a private region of |shm_len| bytes, split into
+// |lanes| lanes the way the parent sets it up on open, but not paired up with
+// anything. Deleting it unmaps the region.
+std::unique_ptr<transact_interface> NewRegion(size_t shm_len,
+                                              int format,
+                                              int lanes) {
+  std::unique_ptr<transact_interface> interface(new transact_interface());
+  void* shm = mmap(NULL, shm_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    abort();
+  }
+  interface->shm = reinterpret_cast<MessageHeader*>(shm);
+  interface->shm_len = shm_len;
+  interface->is_parent = 1;
+  interface->format = format;
+  interface->lanes = lanes;
+  interface->lane_blocks = shm_len / sizeof(MessageHeader) / lanes;
+  interface->blocks_len = interface->lane_blocks - 1;
+  InitializeLanes(interface->shm, lanes, interface->lane_blocks, format);
+  return interface;
+}
+
+// Returns an interface onto lane |lane| of |region|, like the ones
+// transact_interface_open_lane() returns.
+std::unique_ptr<transact_interface> NewLane(transact_interface* region,
+                                            int lane) {
+  std::unique_ptr<transact_interface> interface(new transact_interface());
+  interface->shm = LaneHeader(region->shm, region->lane_blocks, lane);
+  interface->shm_len = region->shm_len;
+  interface->is_parent = region->is_parent;
+  interface->format = region->format;
+  interface->lane_blocks = region->lane_blocks;
+  interface->blocks_len = region->blocks_len;
+  interface->owner = region;
+  return interface;
+}
+
+// Hands the block of |message| back to the allocator, like a send does once
+// the peer is done with it.
+void Release(struct transact_message* message) {
+  if (message->interface->format == TRANSACT_FORMAT_COMPACT)
+    MessageRelease<CompactMessage>(message);
+  else
+    MessageRelease<Message>(message);
+}
+
+char PayloadByte(size_t seed, size_t i) {
+  return static_cast<char>(seed * 13 + i * 7 + (i >> 8));
+}
+
+// Every payload length takes as many blocks as its format says, arrives
+// intact, gets its blocks back once released, and a full arena never hands
+// out anything past the end of the region.
+void TestAllocatorRoundTrip(int format) {
+  std::unique_ptr<transact_interface> region =
+      NewRegion(64 * sizeof(MessageHeader), format, 1);
+  const size_t header = PayloadOffset(format);
+  const size_t lens[] = {0,
+                         1,
+                         sizeof(Message) - header,
+                         sizeof(Message) - header + 1,
+                         2 * sizeof(Message) - header,
+                         1000};
+  for (size_t len : lens) {
+    size_t blocks = (len + header + sizeof(Message) - 1) / sizeof(Message);
+    struct transact_message out, in;
+    transact_message_init(region.get(), &out);
+    transact_message_init(region.get(), &in);
+    ptrdiff_t free_offset = region->shm->free_offset;
+    EXPECT(transact_message_allocate(&out, 7, len) == 0);
+    EXPECT(region->shm->free_offset ==
+           free_offset + static_cast<ptrdiff_t>(blocks));
+    EXPECT(static_cast<size_t>(out.end - out.data) ==
+           blocks * sizeof(Message) - header);
+
+    char payload[1000];
+    for (size_t i = 0; i < len; i++)
+      payload[i] = PayloadByte(len, i);
+    EXPECT(transact_message_write(&out, payload, len) ==
+           static_cast<ssize_t>(len));
+    region->shm->current_msg_offset = MessageOffset(&out);
+    EXPECT(transact_message_recv(&in) == 0);
+    EXPECT(in.method_id == 7);
+    char received[1000];
+    EXPECT(transact_message_read(&in, received, len) ==
+           static_cast<ssize_t>(len));
+    EXPECT(memcmp(received, payload, len) == 0);
+
+    ptrdiff_t offset = MessageOffset(&out);
+    Release(&out);
+    EXPECT(transact_message_allocate(&out, 8, len) == 0);
+    EXPECT(MessageOffset(&out) == offset);
+    EXPECT(region->shm->free_offset ==
+           free_offset + static_cast<ptrdiff_t>(blocks));
+  }
+
+  const char* start = reinterpret_cast<char*>(region->shm->root);
+  const char* end = reinterpret_cast<char*>(region->shm) + region->shm_len;
+  struct transact_message message;
+  transact_message_init(region.get(), &message);
+  for (size_t i = 0; i <= region->blocks_len; i++) {
+    if (transact_message_allocate(&message, 1, 1) == -1)
+      break;
+    EXPECT(reinterpret_cast<char*>(message.message) >= start);
+    EXPECT(message.end <= end);
+  }
+  EXPECT(errno == ENOMEM);
+  EXPECT(region->shm->free_offset ==
+         static_cast<ptrdiff_t>(region->blocks_len));
+}
+
+// Every lane hands out blocks from its own slice of the region only, and
+// filling up or scribbling over one lane leaves the others alone.
+void TestLaneIsolation(int format) {
+  constexpr int kLanes = 4;
+  constexpr size_t kLaneBlocks = 16;
+  std::unique_ptr<transact_interface> region =
+      NewRegion(kLanes * kLaneBlocks * sizeof(MessageHeader), format, kLanes);
+  std::unique_ptr<transact_interface> lanes[kLanes];
+  for (int lane = 0; lane < kLanes; lane++)
+    lanes[lane] = NewLane(region.get(), lane);
+
+  for (int lane = 0; lane < kLanes; lane += 2) {
+    const char* start = reinterpret_cast<char*>(lanes[lane]->shm->root);
+    const char* end = start + (kLaneBlocks - 1) * sizeof(Message);
+    struct transact_message message;
+    transact_message_init(lanes[lane].get(), &message);
+    size_t allocated = 0;
+    while (allocated <= kLaneBlocks &&
+           transact_message_allocate(&message, lane, 1) == 0) {
+      EXPECT(reinterpret_cast<char*>(message.message) >= start);
+      EXPECT(message.end <= end);
+      memset(message.data, 'a' + lane, message.end - message.data);
+      allocated++;
+    }
+    EXPECT(errno == ENOMEM);
+    EXPECT(allocated == kLaneBlocks - 1);
+  }
+  EXPECT(lanes[1]->shm->free_offset == 0);
+  EXPECT(lanes[3]->shm->free_offset == 0);
+
+  lanes[1]->shm->free_offset = -1;
+  struct transact_message message;
+  transact_message_init(lanes[1].get(), &message);
+  EXPECT(transact_message_allocate(&message, 1, 1) == -1 && errno == EINVAL);
+  transact_message_init(lanes[3].get(), &message);
+  EXPECT(transact_message_allocate(&message, 3, 500) == 0);
+  memset(message.data, 'z', message.end - message.data);
+
+  // The lanes that were filled up still hold only their own payloads.
+  for (int lane = 0; lane < kLanes; lane += 2) {
+    const char* data = reinterpret_cast<char*>(lanes[lane]->shm->root);
+    for (size_t block = 0; block < kLaneBlocks - 1; block++) {
+      const char* payload =
+          data + block * sizeof(Message) + PayloadOffset(format);
+      const char* payload_end = data + (block + 1) * sizeof(Message);
+      bool intact = true;
+      for (const char* c = payload; c < payload_end; c++)
+        intact &= *c == 'a' + lane;
+      EXPECT(intact);
+    }
+  }
+}
+
+// Corrupting any of the allocator state that lives in shared memory makes
+// allocations and receptions fail instead of reaching out of the arena.
+template <typename Block>
+void TestHostileArena(int format) {
+  std::unique_ptr<transact_interface> region =
+      NewRegion(16 * sizeof(MessageHeader), format, 1);
+  MessageHeader* shm = region->shm;
+  const ptrdiff_t blocks_len = region->blocks_len;
+  struct transact_message message;
+  transact_message_init(region.get(), &message);
+
+  const ptrdiff_t bad_lists[] = {blocks_len, blocks_len + 1, -2,
+                                 std::numeric_limits<ptrdiff_t>::min()};
+  for (ptrdiff_t list : bad_lists) {
+    InitializeHeader(shm, format);
+    shm->small_message_list = list;
+    EXPECT(transact_message_allocate(&message, 1, 1) == -1 && errno == EINVAL);
+    InitializeHeader(shm, format);
+    shm->large_message_list = list;
+    EXPECT(transact_message_allocate(&message, 1, 500) == -1 &&
+           errno == EINVAL);
+  }
+
+  // A free list that loops back onto itself.
+  InitializeHeader(shm, format);
+  EXPECT(transact_message_allocate(&message, 1, 1) == 0);
+  EXPECT(transact_message_allocate(&message, 1, 1) == 0);
+  SetNextOffset(reinterpret_cast<Block*>(message.message),
+                MessageOffset(&message));
+  EXPECT(transact_message_allocate(&message, 1, 1) == -1 && errno == EINVAL);
+
+  const ptrdiff_t bad_free_offsets[] = {-1, blocks_len + 1,
+                                        std::numeric_limits<ptrdiff_t>::max()};
+  for (ptrdiff_t free_offset : bad_free_offsets) {
+    InitializeHeader(shm, format);
+    shm->free_offset = free_offset;
+    EXPECT(transact_message_allocate(&message, 1, 1) == -1 && errno == EINVAL);
+  }
+
+  InitializeHeader(shm, format);
+  const ptrdiff_t bad_offsets[] = {blocks_len, -2, kChunkOffset | blocks_len,
+                                   kPinnedOffset | blocks_len,
+                                   kChunkOffset | kPinnedOffset | blocks_len};
+  for (ptrdiff_t offset : bad_offsets) {
+    shm->current_msg_offset = offset;
+    EXPECT(transact_message_recv(&message) == -1 && errno == EMSGSIZE);
+  }
+
+  // A chunk that claims more payload than its block holds.
+  EXPECT(transact_message_allocate(&message, 1, 100) == 0);
+  size_t capacity = message.end - message.data;
+  ChunkHeader* chunk = reinterpret_cast<ChunkHeader*>(message.data);
+  chunk->len = capacity - sizeof(ChunkHeader) + 1;
+  chunk->more = 0;
+  shm->current_msg_offset = kChunkOffset | MessageOffset(&message);
+  EXPECT(transact_message_recv(&message) == -1 && errno == EMSGSIZE);
+
+  // Walking the arena for the stats stops at blocks that make no sense.
+  Block* first = reinterpret_cast<Block*>(shm->root);
+  first->blocks_len = 0;
+  CollectStats(region.get());
+  first->blocks_len = blocks_len + 1;
+  CollectStats(region.get());
+  shm->free_offset = blocks_len + 1;
+  CollectStats(region.get());
+  EXPECT(region->stats.peak_blocks <= static_cast<uint64_t>(blocks_len));
+}
+
+// The child only takes the layout of the lanes out of the region once it is
+// sure that it fits in its mapping, and the parent never takes it back.
+void TestHostileLanes() {
+  constexpr size_t kShmLen = 64 * sizeof(MessageHeader);
+  std::unique_ptr<transact_interface> region =
+      NewRegion(kShmLen, TRANSACT_FORMAT_LEGACY, 4);
+  struct {
+    uint32_t lanes;
+    uint32_t lane_blocks;
+    bool valid;
+  } layouts[] = {
+      {0, 0, true},
+      {1, 64, true},
+      {4, 16, true},
+      {2, 32, true},
+      {64, 1, false},
+      {4, 1, false},
+      {2, 0, false},
+      {4, 17, false},
+      {TRANSACT_MAX_LANES + 1, 2, false},
+      {0xffffffff, 0xffffffff, false},
+      {2, 0x80000000, false},
+  };
+  for (const auto& layout : layouts) {
+    transact_interface child;
+    child.shm = region->shm;
+    child.shm_len = kShmLen;
+    child.blocks_len = kShmLen / sizeof(MessageHeader) - 1;
+    child.owner = region.get();
+    region->shm->lanes = layout.lanes;
+    region->shm->lane_blocks = layout.lane_blocks;
+    errno = 0;
+    EXPECT(LoadLanes(&child) == layout.valid);
+    if (layout.valid) {
+      EXPECT(child.lanes ==
+             static_cast<int>(layout.lanes > 1 ? layout.lanes : 1));
+      EXPECT(child.lane_blocks == layout.lane_blocks);
+    } else {
+      EXPECT(errno == EPROTO);
+      EXPECT(child.lanes == 1);
+    }
+  }
+
+  region->shm->lanes = 0xffffffff;
+  region->shm->lane_blocks = 0x7fffffff;
+  for (int lane = 0; lane < region->lanes; lane++)
+    LaneHeader(region->shm, region->lane_blocks, lane)->free_offset = 1 << 30;
+  CollectStats(region.get());
+  EXPECT(region->stats.peak_blocks == 0);
+  InitializeLanes(region->shm, region->lanes, region->lane_blocks,
+                  region->format);
+  EXPECT(region->shm->lanes == 4);
+  EXPECT(region->shm->lane_blocks == 16);
+}
+
+// The timeline is only ever looked up where a valid lane layout says it is,
+// and only if its header fits in what is left of the region.
+void TestHostileTimeline() {
+  const size_t shm_len = 64 * sizeof(MessageHeader) + TimelineLen(4);
+  size_t offset = 0;
+  EXPECT(TimelineOffset(4, 16, shm_len, &offset));
+  EXPECT(offset == 64 * sizeof(MessageHeader));
+  EXPECT(TimelineOffset(0, 64, shm_len, &offset));
+  EXPECT(offset == 64 * sizeof(MessageHeader));
+  EXPECT(!TimelineOffset(4, 1, shm_len, &offset));
+  EXPECT(!TimelineOffset(4, shm_len / sizeof(MessageHeader) / 4 + 1, shm_len,
+                         &offset));
+  EXPECT(!TimelineOffset(TRANSACT_MAX_LANES + 1, 2, shm_len, &offset));
+  EXPECT(!TimelineOffset(0xffffffff, 0xffffffff, shm_len, &offset));
+  EXPECT(!TimelineOffset(1, std::numeric_limits<uint64_t>::max(), shm_len,
+                         &offset));
+  EXPECT(!TimelineOffset(1, 64, 64 * sizeof(MessageHeader), &offset));
+
+  transact_timeline_header header = {};
+  memcpy(header.magic, TRANSACT_TIMELINE_MAGIC, sizeof(header.magic));
+  header.version = TRANSACT_TIMELINE_VERSION;
+  header.entries = 4;
+  EXPECT(ValidTimeline(header, TimelineLen(4)));
+  EXPECT(!ValidTimeline(header, TimelineLen(4) - 1));
+  const uint32_t bad_entries[] = {0, 3, TRANSACT_MAX_TIMELINE_ENTRIES * 2,
+                                  0x80000000};
+  for (uint32_t entries : bad_entries) {
+    header.entries = entries;
+    EXPECT(!ValidTimeline(header, std::numeric_limits<size_t>::max()));
+  }
+  header.entries = 4;
+  header.version = TRANSACT_TIMELINE_VERSION + 1;
+  EXPECT(!ValidTimeline(header, TimelineLen(4)));
+}
+
+constexpr int kEchoRounds = 64;
+const size_t kEchoLens[] = {0, 1, 16, 47, 48, 49, 200, 1000};
+constexpr int kEchoLensLen = sizeof(kEchoLens) / sizeof(kEchoLens[0]);
+
+void EchoParent(struct transact_interface* interface, void*) {
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  ptrdiff_t free_offset = -1;
+  for (int round = 0; round < kEchoRounds; round++) {
+    size_t len = kEchoLens[round % kEchoLensLen];
+    EXPECT(transact_message_allocate(&message, round, len) == 0);
+    for (size_t i = 0; i < len; i++)
+      message.data[i] = PayloadByte(round, i);
+    EXPECT(transact_message_send(&message) == 1);
+    EXPECT(transact_message_recv(&message) == 0);
+    EXPECT(message.method_id == round + 1);
+    char received[1000];
+    EXPECT(transact_message_read(&message, received, len) ==
+           static_cast<ssize_t>(len));
+    bool intact = true;
+    for (size_t i = 0; i < len; i++)
+      intact &= received[i] == PayloadByte(round, i);
+    EXPECT(intact);
+    // Once every length has been sent, the blocks are all reused.
+    if (round == kEchoLensLen - 1)
+      free_offset = interface->shm->free_offset;
+  }
+  EXPECT(interface->shm->free_offset == free_offset);
+}
+
+void EchoChild(struct transact_interface* interface, void*) {
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  for (int round = 0; round < kEchoRounds; round++) {
+    size_t len = kEchoLens[round % kEchoLensLen];
+    EXPECT(transact_message_recv(&message) == 0);
+    EXPECT(message.method_id == round);
+    char received[1000];
+    EXPECT(transact_message_read(&message, received, len) ==
+           static_cast<ssize_t>(len));
+    EXPECT(transact_message_allocate(&message, round + 1, len) == 0);
+    EXPECT(transact_message_write(&message, received, len) ==
+           static_cast<ssize_t>(len));
+    // The parent is gone by the time the last reply has been read.
+    EXPECT(transact_message_send(&message) == (round + 1 < kEchoRounds));
+  }
+}
+
+constexpr size_t kStreamLen = 64 * 1024;
+constexpr size_t kStreamChunkLen = 256;
+constexpr int kStreamId = 5;
+constexpr int kStreamReplyId = 6;
+
+void StreamParent(struct transact_interface* interface, void*) {
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  EXPECT(transact_message_allocate_stream(&message, kStreamId,
+                                          kStreamChunkLen) == 0);
+  // Write in pieces that straddle the chunk boundaries.
+  char piece[100];
+  for (size_t offset = 0; offset < kStreamLen; offset += sizeof(piece)) {
+    size_t len = std::min(sizeof(piece), kStreamLen - offset);
+    for (size_t i = 0; i < len; i++)
+      piece[i] = PayloadByte(0, offset + i);
+    EXPECT(transact_message_write(&message, piece, len) ==
+           static_cast<ssize_t>(len));
+  }
+  EXPECT(transact_message_send(&message) == 1);
+  EXPECT(transact_message_recv(&message) == 0);
+  EXPECT(message.method_id == kStreamReplyId);
+  uint64_t received = 0;
+  EXPECT(transact_message_read(&message, &received, sizeof(received)) ==
+         static_cast<ssize_t>(sizeof(received)));
+  EXPECT(received == kStreamLen);
+}
+
+void StreamChild(struct transact_interface* interface, void*) {
+  struct transact_message message;
+  transact_message_init(interface, &message);
+  EXPECT(transact_message_recv(&message) == 0);
+  EXPECT(message.method_id == kStreamId);
+  // Read in pieces that straddle the chunk boundaries differently.
+  uint64_t received = 0;
+  bool intact = true;
+  char piece[77];
+  while (received < kStreamLen) {
+    size_t len = std::min<size_t>(sizeof(piece), kStreamLen - received);
+    if (transact_message_read(&message, piece, len) !=
+        static_cast<ssize_t>(len)) {
+      break;
+    }
+    for (size_t i = 0; i < len; i++)
+      intact &= piece[i] == PayloadByte(0, received + i);
+    received += len;
+  }
+  EXPECT(intact);
+  EXPECT(transact_message_read(&message, piece, 1) == 0);
+  EXPECT(transact_message_allocate(&message, kStreamReplyId,
+                                   sizeof(received)) == 0);
+  EXPECT(transact_message_write(&message, &received, sizeof(received)) ==
+         static_cast<ssize_t>(sizeof(received)));
+  EXPECT(transact_message_send(&message) == 0);
+}
+
+// Runs |parent| and |child| against each other in every in-process mode this
+// build supports.
+void RunInProcess(size_t shm_len,
+                  int format,
+                  transact_peer_fn parent,
+                  transact_peer_fn child) {
+  struct transact_options options;
+  transact_options_init(&options);
+  options.format = format;
+  for (int mode : kModes) {
+    int res = transact_run_inprocess(mode, shm_len, &options, parent, NULL,
+                                     child, NULL);
+    EXPECT(res == 0 ||
+           (mode == TRANSACT_INPROCESS_COROUTINES && errno == ENOSYS));
+  }
+}
+
+// Advances the xorshift generator in |state|.
+uint64_t NextRandom(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Returns a value within [|min|, |max|], most often one of its edges.
+template <typename T>
+T RandomInRange(uint64_t* state, T min, T max) {
+  typedef typename std::make_unsigned<T>::type U;
+  uint64_t random = NextRandom(state);
+  switch (random % 4) {
+    case 0:
+      return min;
+    case 1:
+      return max;
+  }
+  U span = static_cast<U>(max) - static_cast<U>(min);
+  U offset = static_cast<U>(random >> 2);
+  if (span != std::numeric_limits<U>::max())
+    offset %= span + 1;
+  return static_cast<T>(static_cast<U>(min) + offset);
+}
+
+constexpr size_t kMaxRangeCount = 67;
+// Enough to start the values at every misalignment of the widest vectors.
+constexpr size_t kMaxRangeSkew = 32;
+
+// Checks that every range check this CPU can run agrees with the scalar one
+// about |values|, and that they copy exactly |count| values.
+template <typename T>
+void ExpectInRange(const T* values, size_t count, T min, T max, bool expected) {
+  typedef bool (*RangeCheck)(const T*, T*, size_t, T, T);
+  RangeCheck checks[4] = {InRangeScalar<T>, InRange<T>};
+  int checks_len = 2;
+#if defined(__x86_64__)
+  if (VectorLevel() >= kVectorSse)
+    checks[checks_len++] = InRangeSse;
+  if (VectorLevel() >= kVectorAvx2)
+    checks[checks_len++] = InRangeAvx2;
+#endif
+  for (int i = 0; i < checks_len; i++) {
+    T copy[kMaxRangeCount + 1];
+    memset(copy, 0x5a, sizeof(copy));
+    T guard = copy[count];
+    EXPECT(checks[i](values, copy, count, min, max) == expected);
+    EXPECT(memcmp(copy, values, count * sizeof(T)) == 0);
+    EXPECT(copy[count] == guard);
+    EXPECT(checks[i](values, nullptr, count, min, max) == expected);
+  }
+}
+
+// Checks the vectorized range checks against the scalar one at every length
+// that leaves a tail, at every misalignment, and with a single value out of
+// range in every position, right past either edge.
+template <typename T>
+void TestRangeChecks() {
+  const T lowest = std::numeric_limits<T>::min();
+  const T highest = std::numeric_limits<T>::max();
+  const T bounds[][2] = {
+      {lowest, highest}, {lowest, lowest}, {highest, highest}, {lowest, -1},
+      {0, highest},      {-1, 0},          {0, 255},           {-100, 100},
+  };
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  alignas(32) T buffer[kMaxRangeSkew + kMaxRangeCount];
+  for (const auto& bound : bounds) {
+    T min = bound[0];
+    T max = bound[1];
+    T outliers[4];
+    int outliers_len = 0;
+    if (min != lowest) {
+      outliers[outliers_len++] = min - 1;
+      outliers[outliers_len++] = lowest;
+    }
+    if (max != highest) {
+      outliers[outliers_len++] = max + 1;
+      outliers[outliers_len++] = highest;
+    }
+    for (size_t count = 0; count <= kMaxRangeCount; count++) {
+      for (size_t skew = 0; skew < kMaxRangeSkew / sizeof(T); skew++) {
+        T* values = buffer + skew;
+        for (size_t i = 0; i < count; i++)
+          values[i] = RandomInRange(&state, min, max);
+        ExpectInRange(values, count, min, max, true);
+        EXPECT(FirstOutOfRange(values, count, min, max) == count);
+        for (size_t position = 0; position < count; position++) {
+          T value = values[position];
+          for (int i = 0; i < outliers_len; i++) {
+            values[position] = outliers[i];
+            ExpectInRange(values, count, min, max, false);
+            EXPECT(FirstOutOfRange(values, count, min, max) == position);
+          }
+          values[position] = value;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  for (int format : kFormats) {
+    TestAllocatorRoundTrip(format);
+    TestLaneIsolation(format);
+    RunInProcess(64 * sizeof(MessageHeader), format, EchoParent, EchoChild);
+    RunInProcess(64 * sizeof(MessageHeader), format, StreamParent,
+                 StreamChild);
+  }
+  TestHostileArena<Message>(TRANSACT_FORMAT_LEGACY);
+  TestHostileArena<CompactMessage>(TRANSACT_FORMAT_COMPACT);
+  TestHostileLanes();
+  TestHostileTimeline();
+  TestRangeChecks<int32_t>();
+  TestRangeChecks<int64_t>();
+
+  if (g_failures) {
+    fprintf(stderr, "%d failures\n", g_failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,131 @@
+// Plays back, or summarizes, a message log recorded by libtransact.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libtransact.h"
+
+namespace {
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s stats <log>\n"
+          "       %s replay <log> <transact file> <shm file> <shm len>\n",
+          argv0, argv0);
+}
+
+const transact_log_header* MapLog(const char* filename, size_t* len) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return nullptr;
+  struct stat st;
+  void* log = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(transact_log_header)) {
+    *len = st.st_size;
+    log = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  } else {
+    errno = EINVAL;
+  }
+  close(fd);
+  if (log == MAP_FAILED)
+    return nullptr;
+  const transact_log_header* header =
+      reinterpret_cast<const transact_log_header*>(log);
+  if (memcmp(header->magic, TRANSACT_LOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != TRANSACT_LOG_VERSION) {
+    munmap(log, *len);
+    errno = EINVAL;
+    return nullptr;
+  }
+  return header;
+}
+
+int Stats(const char* filename) {
+  size_t len;
+  const transact_log_header* header = MapLog(filename, &len);
+  if (!header) {
+    perror(filename);
+    return 1;
+  }
+
+  const char* log = reinterpret_cast<const char*>(header);
+  size_t offset = sizeof(transact_log_header);
+  uint64_t messages = 0, bytes = 0, peer_ns = 0, self_ns = 0;
+  uint64_t first_ns = 0, last_ns = 0, prev_resumed_ns = 0;
+  for (uint64_t i = 0;
+       i < header->records && len - offset >= sizeof(transact_log_record);
+       i++) {
+    const transact_log_record* record =
+        reinterpret_cast<const transact_log_record*>(log + offset);
+    offset += sizeof(transact_log_record) + ((record->size + 7) & ~7ULL);
+    if (offset > len)
+      break;
+    if (messages == 0)
+      first_ns = record->sent_ns;
+    else
+      self_ns += record->sent_ns - prev_resumed_ns;
+    // The last message of a session never gets an answer.
+    if (record->resumed_ns) {
+      peer_ns += record->resumed_ns - record->sent_ns;
+      prev_resumed_ns = last_ns = record->resumed_ns;
+    }
+    messages++;
+    bytes += record->size;
+  }
+
+  printf("role=%s messages=%llu bytes=%llu wall_ns=%llu peer_ns=%llu "
+         "self_ns=%llu\n",
+         header->is_parent ? "parent" : "child",
+         static_cast<unsigned long long>(messages),
+         static_cast<unsigned long long>(bytes),
+         static_cast<unsigned long long>(last_ns - first_ns),
+         static_cast<unsigned long long>(peer_ns),
+         static_cast<unsigned long long>(self_ns));
+  munmap(const_cast<transact_log_header*>(header), len);
+  return 0;
+}
+
+int Replay(const char* filename,
+           const char* transact_filename,
+           const char* shm_filename,
+           size_t shm_len) {
+  size_t len;
+  const transact_log_header* header = MapLog(filename, &len);
+  if (!header) {
+    perror(filename);
+    return 1;
+  }
+  int is_parent = header->is_parent;
+  munmap(const_cast<transact_log_header*>(header), len);
+
+  struct transact_interface* interface = transact_interface_open(
+      is_parent, transact_filename, shm_filename, shm_len);
+  if (!interface) {
+    perror("transact_interface_open");
+    return 1;
+  }
+  int res = transact_replay(interface, filename);
+  if (res == -1)
+    perror("transact_replay");
+  transact_interface_close(interface);
+  return res == 0 ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc == 3 && strcmp(argv[1], "stats") == 0)
+    return Stats(argv[2]);
+  if (argc == 6 && strcmp(argv[1], "replay") == 0)
+    return Replay(argv[2], argv[3], argv[4], strtoull(argv[5], nullptr, 10));
+  Usage(argv[0]);
+  return 1;
+}
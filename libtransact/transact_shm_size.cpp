@@ -0,0 +1,182 @@
+// Aggregates the shared memory usage records written by libtransact (see
+// transact_options::stats_filename) across many runs, and recommends the
+// smallest region that would have fit all of them.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libtransact.h"
+
+namespace {
+
+constexpr uint64_t kBlockSize = 64;
+constexpr uint64_t kPageSize = 4096;
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [-m <margin percent>] [-q] <stats file>...\n"
+          "\n"
+          "  -m  Extra room to leave on top of the largest run (default 25).\n"
+          "  -q  Only print the recommended shm_len, in bytes.\n",
+          argv0);
+}
+
+struct Summary {
+  uint64_t runs = 0;
+  uint64_t failed_runs = 0;
+  uint32_t lanes = 1;
+  uint64_t peak_blocks = 0;
+  uint64_t class_blocks[TRANSACT_STATS_CLASSES] = {};
+  uint64_t requested_bytes = 0;
+  uint64_t allocated_bytes = 0;
+  uint64_t largest_shm_len = 0;
+};
+
+void Add(Summary* summary, const transact_stats& stats) {
+  summary->runs++;
+  if (stats.failed_allocations)
+    summary->failed_runs++;
+  if (stats.lanes > summary->lanes)
+    summary->lanes = stats.lanes;
+  if (stats.peak_blocks > summary->peak_blocks)
+    summary->peak_blocks = stats.peak_blocks;
+  for (int i = 0; i < TRANSACT_STATS_CLASSES; i++) {
+    if (stats.class_blocks[i] > summary->class_blocks[i])
+      summary->class_blocks[i] = stats.class_blocks[i];
+  }
+  summary->requested_bytes += stats.requested_bytes;
+  summary->allocated_bytes += stats.allocated_bytes;
+  if (stats.shm_len > summary->largest_shm_len)
+    summary->largest_shm_len = stats.shm_len;
+}
+
+bool ReadStats(const char* filename, bool quiet, Summary* summary) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror(filename);
+    return false;
+  }
+  transact_stats stats;
+  ssize_t res;
+  bool ok = true;
+  while ((res = TEMP_FAILURE_RETRY(read(fd, &stats, sizeof(stats)))) ==
+         sizeof(stats)) {
+    if (memcmp(stats.magic, TRANSACT_STATS_MAGIC, sizeof(stats.magic)) != 0 ||
+        stats.version != TRANSACT_STATS_VERSION) {
+      fprintf(stderr, "%s: not a transact stats file\n", filename);
+      ok = false;
+      break;
+    }
+    Add(summary, stats);
+    if (quiet)
+      continue;
+    printf("%s: role=%s shm_len=%llu lanes=%u peak_blocks=%llu/%llu "
+           "idle_blocks=%llu rounding=%.1f%% failed=%llu\n",
+           filename, stats.is_parent ? "parent" : "child",
+           static_cast<unsigned long long>(stats.shm_len), stats.lanes,
+           static_cast<unsigned long long>(stats.peak_blocks),
+           static_cast<unsigned long long>(stats.arena_blocks),
+           static_cast<unsigned long long>(stats.idle_blocks),
+           stats.allocated_bytes
+               ? 100.0 * (stats.allocated_bytes - stats.requested_bytes) /
+                     stats.allocated_bytes
+               : 0.0,
+           static_cast<unsigned long long>(stats.failed_allocations));
+  }
+  if (res == -1) {
+    perror(filename);
+    ok = false;
+  } else if (ok && res != 0) {
+    fprintf(stderr, "%s: truncated record\n", filename);
+    ok = false;
+  }
+  close(fd);
+  return ok;
+}
+
+// The smallest region whose lanes each fit |summary|'s peak plus |margin|
+// percent, rounded up to whole pages.
+uint64_t Recommend(const Summary& summary, uint64_t margin) {
+  uint64_t lane_blocks =
+      summary.peak_blocks + summary.peak_blocks * margin / 100;
+  // Every lane also starts with its own header block.
+  uint64_t len = summary.lanes * (lane_blocks + 1) * kBlockSize;
+  return (len + kPageSize - 1) / kPageSize * kPageSize;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  uint64_t margin = 25;
+  bool quiet = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:q")) != -1) {
+    switch (opt) {
+      case 'm':
+        margin = strtoull(optarg, nullptr, 10);
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind == argc) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  Summary summary;
+  for (int i = optind; i < argc; i++) {
+    if (!ReadStats(argv[i], quiet, &summary))
+      return 1;
+  }
+  if (summary.runs == 0) {
+    fprintf(stderr, "no records found\n");
+    return 1;
+  }
+
+  uint64_t recommended = Recommend(summary, margin);
+  if (summary.failed_runs) {
+    // The peak of a run that ran out of memory says nothing about how much
+    // it would have needed.
+    fprintf(stderr,
+            "%llu runs ran out of memory with up to %llu bytes; rerun them "
+            "with a larger region\n",
+            static_cast<unsigned long long>(summary.failed_runs),
+            static_cast<unsigned long long>(summary.largest_shm_len));
+  }
+  if (quiet) {
+    printf("%llu\n", static_cast<unsigned long long>(recommended));
+    return summary.failed_runs ? 2 : 0;
+  }
+
+  printf("\nruns=%llu lanes=%u peak_blocks=%llu rounding=%.1f%%\n",
+         static_cast<unsigned long long>(summary.runs), summary.lanes,
+         static_cast<unsigned long long>(summary.peak_blocks),
+         summary.allocated_bytes
+             ? 100.0 * (summary.allocated_bytes - summary.requested_bytes) /
+                   summary.allocated_bytes
+             : 0.0);
+  printf("%12s %14s\n", "msg blocks", "peak blocks");
+  for (int i = 0; i < TRANSACT_STATS_CLASSES; i++) {
+    if (!summary.class_blocks[i])
+      continue;
+    char range[32];
+    snprintf(range, sizeof(range), "%llu-%llu", 1ULL << i,
+             (1ULL << (i + 1)) - 1);
+    printf("%12s %14llu\n", range,
+           static_cast<unsigned long long>(summary.class_blocks[i]));
+  }
+  printf("recommended shm_len=%llu (margin %llu%%)\n",
+         static_cast<unsigned long long>(recommended),
+         static_cast<unsigned long long>(margin));
+  return summary.failed_runs ? 2 : 0;
+}
@@ -0,0 +1,224 @@
+// Prints the turn timeline that libtransact keeps at the end of a shared
+// memory region (see transact_options::timeline_entries), either once the
+// peers are done or while they are still running.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "libtransact.h"
+
+namespace {
+
+// How often the timeline is read again while following it.
+constexpr useconds_t kPollIntervalUs = 100000;
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [-f] <shm file>\n"
+          "\n"
+          "  -f  Keep printing turns as they complete, until both peers are\n"
+          "      gone.\n",
+          argv0);
+}
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Must match the clock libtransact stamps the records with.
+uint64_t Ticks() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return NowNs();
+#endif
+}
+
+// Converts ticks of the timestamp counter into nanoseconds, through the
+// readings of both clocks taken at the start of the timeline and at its end,
+// or now if it has not ended yet.
+class Clock {
+ public:
+  explicit Clock(const transact_timeline_header& header)
+      : start_ticks_(header.start_ticks) {
+    uint64_t end_ticks = header.end_ticks;
+    uint64_t end_ns = header.end_ns;
+    if (!end_ns) {
+      end_ticks = Ticks();
+      end_ns = NowNs();
+    }
+    if (end_ticks > header.start_ticks && end_ns > header.start_ns) {
+      ns_per_tick_ = static_cast<double>(end_ns - header.start_ns) /
+                     (end_ticks - header.start_ticks);
+    }
+  }
+
+  double Since(uint64_t ticks) const {
+    return (static_cast<double>(ticks) - start_ticks_) * ns_per_tick_;
+  }
+
+  double Between(uint64_t from, uint64_t to) const {
+    return (static_cast<double>(to) - from) * ns_per_tick_;
+  }
+
+ private:
+  uint64_t start_ticks_;
+  double ns_per_tick_ = 1.0;
+};
+
+void PrintHeading() {
+  printf("%10s %6s %10s %10s %14s %12s %12s\n", "seq", "side", "msgid", "size",
+         "handoff us", "away ns", "wakeup ns");
+}
+
+// Prints |record|, the turn at |position|. |next| is the turn after it, if it
+// is known: the time from its handoff to the wakeup of |record| is how long
+// the switch back took.
+void PrintRecord(const Clock& clock,
+                 uint64_t position,
+                 const transact_timeline_record& record,
+                 const transact_timeline_record* next) {
+  if (record.seq != static_cast<uint32_t>(position + 1)) {
+    // Overwritten while it was being read.
+    printf("%10llu %6s\n", static_cast<unsigned long long>(position + 1),
+           "lost");
+    return;
+  }
+  char away[32] = "-";
+  char wakeup[32] = "-";
+  if (record.wakeup_ticks) {
+    snprintf(away, sizeof(away), "%.0f",
+             clock.Between(record.handoff_ticks, record.wakeup_ticks));
+    if (next && next->seq == record.seq + 1 &&
+        next->is_parent != record.is_parent &&
+        next->handoff_ticks <= record.wakeup_ticks) {
+      snprintf(wakeup, sizeof(wakeup), "%.0f",
+               clock.Between(next->handoff_ticks, record.wakeup_ticks));
+    }
+  }
+  printf("%10llu %6s %10d %10u %14.3f %12s %12s\n",
+         static_cast<unsigned long long>(position + 1),
+         record.is_parent ? "parent" : "child", record.msgid, record.size,
+         clock.Since(record.handoff_ticks) / 1000.0, away, wakeup);
+}
+
+void ReportError(const char* filename) {
+  // The region exists, but nobody asked for a timeline in it.
+  if (errno == ENOENT && access(filename, F_OK) == 0)
+    fprintf(stderr, "%s: no turn timeline in this region\n", filename);
+  else
+    perror(filename);
+}
+
+// Reads the whole timeline in |filename| into |records|, which is allocated
+// to hold every entry. Returns the number of records read, or -1 on failure.
+ssize_t Read(const char* filename,
+             transact_timeline_header* header,
+             transact_timeline_record** records) {
+  if (!*records) {
+    if (transact_timeline_read(filename, header, nullptr, 0) == -1)
+      return -1;
+    *records = reinterpret_cast<transact_timeline_record*>(
+        malloc(header->entries * sizeof(transact_timeline_record)));
+    if (!*records) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  return transact_timeline_read(filename, header, *records, header->entries);
+}
+
+int Dump(const char* filename) {
+  transact_timeline_header header;
+  transact_timeline_record* records = nullptr;
+  ssize_t len = Read(filename, &header, &records);
+  if (len == -1) {
+    ReportError(filename);
+    return 1;
+  }
+  Clock clock(header);
+  uint64_t first = header.count - len;
+  printf("turns=%llu shown=%zd entries=%u%s\n",
+         static_cast<unsigned long long>(header.count), len, header.entries,
+         header.end_ns ? "" : " (running)");
+  PrintHeading();
+  for (ssize_t i = 0; i < len; i++) {
+    PrintRecord(clock, first + i, records[i],
+                i + 1 < len ? &records[i + 1] : nullptr);
+  }
+  free(records);
+  return 0;
+}
+
+int Follow(const char* filename) {
+  transact_timeline_header header;
+  transact_timeline_record* records = nullptr;
+  uint64_t printed = 0;
+  PrintHeading();
+  for (;;) {
+    ssize_t len = Read(filename, &header, &records);
+    if (len == -1) {
+      ReportError(filename);
+      free(records);
+      return 1;
+    }
+    Clock clock(header);
+    uint64_t first = header.count - len;
+    if (printed < first) {
+      printf("%10s skipped %llu turns\n", "",
+             static_cast<unsigned long long>(first - printed));
+      printed = first;
+    }
+    // A turn is only printed once control came back from it, unless nobody
+    // is going to hand it back anymore.
+    for (; printed < header.count; printed++) {
+      const transact_timeline_record& record = records[printed - first];
+      if (!record.wakeup_ticks && !header.end_ns &&
+          record.seq == static_cast<uint32_t>(printed + 1)) {
+        break;
+      }
+      PrintRecord(clock, printed, record,
+                  printed + 1 < header.count ? &records[printed - first + 1]
+                                             : nullptr);
+    }
+    fflush(stdout);
+    if (header.end_ns && printed == header.count)
+      break;
+    usleep(kPollIntervalUs);
+  }
+  free(records);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool follow = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "f")) != -1) {
+    switch (opt) {
+      case 'f':
+        follow = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    Usage(argv[0]);
+    return 1;
+  }
+  return follow ? Follow(argv[optind]) : Dump(argv[optind]);
+}
@@ -4,6 +4,7 @@
 
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -75,6 +76,10 @@ static PyMethodDef Message_methods[] = {
 		"reads |size| bytes from the message"},
 	{"write", (PyCFunction)Message_write, METH_VARARGS,
 		"writes |buf| into the message"},
+	{"read_int32_array", (PyCFunction)Message_read_int32_array, METH_VARARGS,
+		"reads |count| int32 values, all of which must lie within [|min|, |max|]"},
+	{"read_int64_array", (PyCFunction)Message_read_int64_array, METH_VARARGS,
+		"reads |count| int64 values, all of which must lie within [|min|, |max|]"},
 	{NULL} // Sentinel
 };
 
@@ -198,6 +203,31 @@ Interface_init(Interface* self, PyObject* args, PyObject* kwds) {
 		self->shm->free_offset = 0;
 		self->shm->small_message_list = (ptrdiff_t)-1;
 		self->shm->large_message_list = (ptrdiff_t)-1;
+		self->shm->format = TRANSACT_FORMAT_LEGACY;
+		// Do not leave the placement of a previous parent behind for the child.
+		self->shm->placement = TRANSACT_PLACEMENT_NONE;
+		self->shm->placement_cpu[0] = -1;
+		self->shm->placement_cpu[1] = -1;
+		self->shm->placement_node = -1;
+		self->shm->lanes = 1;
+		self->shm->lane_blocks = self->size;
+		// Messages are only ever exchanged through shared memory.
+		self->shm->features = 0;
+	} else if (self->shm->format != TRANSACT_FORMAT_LEGACY) {
+		PyErr_Format(PyExc_IOError, "Unsupported message format %u",
+				self->shm->format);
+		return -1;
+	} else if (self->shm->lanes > 1 ||
+			(self->shm->features & TRANSACT_FEATURE_TIMELINE)) {
+		// Only the first lane is supported, and it must stay within its share of
+		// the region, which ends before the timeline if there is one. This module
+		// does not append to the timeline itself.
+		uint32_t lane_blocks = self->shm->lane_blocks;
+		if (lane_blocks < 2 || lane_blocks > self->size) {
+			PyErr_SetString(PyExc_IOError, "Invalid lane layout");
+			return -1;
+		}
+		self->size = lane_blocks - 1;
 	}
 
 	return 0;
@@ -290,6 +320,10 @@ Interface_allocate(Interface* self, PyObject* args) {
 static PyObject*
 Interface_internalGet(Interface* self, Message* msg) {
 	ptrdiff_t offset = self->shm->current_msg_offset;
+	if (offset >= 0 && (offset & TRANSACT_CHUNK_OFFSET)) {
+		PyErr_SetString(PyExc_IOError, "Streamed messages are not supported");
+		return NULL;
+	}
 	if (offset < 0 || offset >= self->size) {
 		fprintf(stderr, "Illegal message offset\n");
 		exit(1);
@@ -407,6 +441,65 @@ Message_write(Message* self, PyObject* args) {
 	return PyInt_FromLong(size);
 }
 
+// Checks all of |values| in a single branchless pass, which the compiler can
+// vectorize, and only looks for the offending index once the check fails.
+#define FIND_OUT_OF_RANGE(type, values, count, min, max, bad_index) \
+	do { \
+		const type* v = (const type*)(values); \
+		int in_range = 1; \
+		Py_ssize_t i; \
+		for (i = 0; i < (count); i++) \
+			in_range &= (v[i] >= (min)) & (v[i] <= (max)); \
+		*(bad_index) = -1; \
+		for (i = 0; !in_range && i < (count); i++) { \
+			if (v[i] < (min) || v[i] > (max)) { \
+				*(bad_index) = i; \
+				break; \
+			} \
+		} \
+	} while (0)
+
+static PyObject*
+read_int_array(Message* self, PyObject* args, Py_ssize_t width) {
+	Py_ssize_t count, bad_index;
+	PY_LONG_LONG min, max;
+	if (!PyArg_ParseTuple(args, "nLL", &count, &min, &max)) {
+		return NULL;
+	}
+
+	if (count < 0 || count > (self->end - self->readptr) / width) {
+		PyErr_SetString(PyExc_IOError, "Invalid read size");
+		return NULL;
+	}
+
+	if (width == sizeof(int32_t))
+		FIND_OUT_OF_RANGE(int32_t, self->readptr, count, min, max, &bad_index);
+	else
+		FIND_OUT_OF_RANGE(int64_t, self->readptr, count, min, max, &bad_index);
+
+	// The values are consumed even if they are out of range, like in the
+	// other bindings.
+	char* values = self->readptr;
+	self->readptr += count * width;
+	if (bad_index != -1) {
+		PyErr_Format(PyExc_ValueError,
+				"Value at index %zd outside of legal range: [%lld, %lld]",
+				bad_index, min, max);
+		return NULL;
+	}
+	return PyBuffer_FromMemory(values, count * width);
+}
+
+static PyObject*
+Message_read_int32_array(Message* self, PyObject* args) {
+	return read_int_array(self, args, sizeof(int32_t));
+}
+
+static PyObject*
+Message_read_int64_array(Message* self, PyObject* args) {
+	return read_int_array(self, args, sizeof(int64_t));
+}
+
 PyMODINIT_FUNC
 inittransact(void) {
 	PyObject *m;
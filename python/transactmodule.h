@@ -1,3 +1,18 @@
+// The only block format (see libtransact.h) this module understands.
+#define TRANSACT_FORMAT_LEGACY 0
+
+// The placement policy (see libtransact.h) of a parent that did not choose
+// where the pair runs.
+#define TRANSACT_PLACEMENT_NONE 0
+
+// Set in message_root::features by a parent that keeps a turn timeline right
+// after its last lane, in which case every lane starts with a header block.
+#define TRANSACT_FEATURE_TIMELINE 64
+
+// Set in message_root::current_msg_offset when the block it points to is a
+// chunk of a streamed message, which this module does not understand.
+#define TRANSACT_CHUNK_OFFSET ((ptrdiff_t)1 << 62)
+
 #define STATIC_ASSERT(cond) \
 	extern char (*STATIC_ASSERT(void)) [sizeof(char[1 - 2*!(cond)])]
 
@@ -16,7 +31,13 @@ struct message_root {
 	volatile ptrdiff_t free_offset;
 	volatile ptrdiff_t small_message_list;
 	volatile ptrdiff_t large_message_list;
-	char padding[32];
+	volatile uint32_t format;
+	volatile int32_t placement;
+	volatile int32_t placement_cpu[2];
+	volatile int32_t placement_node;
+	volatile uint32_t lanes;
+	volatile uint32_t lane_blocks;
+	volatile uint32_t features;
 
 	struct message root[0];
 };
@@ -65,3 +86,7 @@ static PyObject*
 Message_read(Message* self, PyObject* args);
 static PyObject*
 Message_write(Message* self, PyObject* args);
+static PyObject*
+Message_read_int32_array(Message* self, PyObject* args);
+static PyObject*
+Message_read_int64_array(Message* self, PyObject* args);